@@ -16,6 +16,7 @@ LOCAL_SRC_FILES:= \
     multirom_status.c \
     destructors.c \
     input.c \
+    input_record.c \
     multirom_ui.c \
     listview.c \
     checkbox.c \
@@ -25,7 +26,15 @@ LOCAL_SRC_FILES:= \
     multirom_ui_themes.c \
     themes/multirom_ui_portrait.c \
     fstab.c \
-    workers.c
+    workers.c \
+    jobs.c \
+    cpio.c \
+    multirom_ramdisk.c \
+    multirom_rdcache.c \
+    multirom_staging.c \
+    multirom_kexec.c \
+    multirom_kconfig.c \
+    trace.c
 
 ifeq ($(ARCH_ARM_HAVE_NEON),true)
     LOCAL_SRC_FILES += col32cb16blend_neon.S
@@ -39,7 +48,8 @@ LOCAL_FORCE_STATIC_EXECUTABLE := true
 LOCAL_MODULE_PATH := $(PRODUCT_OUT)/multirom
 #LOCAL_UNSTRIPPED_PATH := $(TARGET_ROOT_OUT_UNSTRIPPED)
 
-LOCAL_STATIC_LIBRARIES := libcutils libc libm
+LOCAL_STATIC_LIBRARIES := libcutils libc libm libz libmincrypt
+LOCAL_C_INCLUDES += external/zlib
 
 # clone libbootimg to /system/extras/ from
 # https://github.com/Tasssadar/libbootimg.git
@@ -140,6 +150,11 @@ ifeq ($(MR_KEXEC_DTB),true)
     LOCAL_CFLAGS += -DMR_KEXEC_DTB
 endif
 
+# Pass gzipped ramdisk to kexec, the kernel has to support gzip initramfs
+ifeq ($(MR_KEXEC_GZIP_RAMDISK),true)
+    LOCAL_CFLAGS += -DMR_KEXEC_GZIP_RAMDISK
+endif
+
 ifneq ($(MR_DEVICE_HOOKS),)
 ifeq ($(MR_DEVICE_HOOKS_VER),)
     $(info MR_DEVICE_HOOKS is set but MR_DEVICE_HOOKS_VER is not specified!)
@@ -159,3 +174,6 @@ include $(multirom_local_path)/trampoline/Android.mk
 
 # Reboot binary
 include $(multirom_local_path)/reboot/Android.mk
+
+# Setup executor
+include $(multirom_local_path)/setup/Android.mk
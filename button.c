@@ -50,7 +50,7 @@ void button_init_ui(button *b, const char *text, int size)
         b->rect = NULL;
     }
 
-    add_touch_handler(&button_touch_handler, b);
+    add_touch_handler_rect(&button_touch_handler, b, b->x, b->y, b->w, b->h);
 }
 
 void button_destroy(button *b)
@@ -71,6 +71,7 @@ void button_move(button *b, int x, int y)
 {
     b->x = x;
     b->y = y;
+    move_touch_handler(&button_touch_handler, b, x, y, b->w, b->h);
 
     if(b->text)
     {
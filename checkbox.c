@@ -45,7 +45,8 @@ checkbox *checkbox_create(int x, int y, void (*clicked)(int))
     checkbox_set_pos(c, x, y);
 
     if(c->clicked)
-        add_touch_handler(&checkbox_touch_handler, c);
+        add_touch_handler_rect(&checkbox_touch_handler, c, x-TOUCH, y-TOUCH,
+                               CHECKBOX_SIZE+TOUCH*2, CHECKBOX_SIZE+TOUCH*2);
 
     return c;
 }
@@ -68,6 +69,9 @@ void checkbox_set_pos(checkbox *c, int x, int y)
 {
     c->x = x;
     c->y = y;
+    if(c->clicked)
+        move_touch_handler(&checkbox_touch_handler, c, x-TOUCH, y-TOUCH,
+                           CHECKBOX_SIZE+TOUCH*2, CHECKBOX_SIZE+TOUCH*2);
 
     int pos[][2] =
     {
@@ -104,6 +108,7 @@ void checkbox_select(checkbox *c, int select)
     {
         c->selected = fb_add_rect(c->x + SELECTED_PADDING, c->y + SELECTED_PADDING,
                                   SELECTED_SIZE, SELECTED_SIZE, CLR_PRIMARY);
+        fb_item_set_hidden(c->selected, c->borders[0]->head.hidden);
     }
     else
     {
@@ -112,6 +117,14 @@ void checkbox_select(checkbox *c, int select)
     }
 }
 
+void checkbox_set_hidden(checkbox *c, int hidden)
+{
+    int i;
+    for(i = 0; i < BORDER_MAX; ++i)
+        fb_item_set_hidden(c->borders[i], hidden);
+    fb_item_set_hidden(c->selected, hidden);
+}
+
 int checkbox_touch_handler(touch_event *ev, void *data)
 {
     checkbox *box = (checkbox*)data;
@@ -48,6 +48,7 @@ void checkbox_destroy(checkbox *c);
 
 void checkbox_set_pos(checkbox *c, int x, int y);
 void checkbox_select(checkbox *c, int select);
+void checkbox_set_hidden(checkbox *c, int hidden);
 
 int checkbox_touch_handler(touch_event *ev, void *data);
 
@@ -0,0 +1,785 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "cpio.h"
+#include "util.h"
+#include "log.h"
+
+#define CPIO_HDR_LEN 110
+#define CPIO_BUF_SIZE (64*1024)
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    ssize_t res;
+    while(len > 0)
+    {
+        res = write(fd, p, len);
+        if(res < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += res;
+        len -= res;
+    }
+    return 0;
+}
+
+static inline uint32_t cpio_pad4(uint64_t off)
+{
+    return (4 - (off & 3)) & 3;
+}
+
+static int parse_hex(const char *s, uint32_t *res)
+{
+    int i;
+    uint32_t v = 0;
+    for(i = 0; i < 8; ++i)
+    {
+        v <<= 4;
+        if(s[i] >= '0' && s[i] <= '9')      v |= s[i] - '0';
+        else if(s[i] >= 'a' && s[i] <= 'f') v |= s[i] - 'a' + 10;
+        else if(s[i] >= 'A' && s[i] <= 'F') v |= s[i] - 'A' + 10;
+        else return -1;
+    }
+    *res = v;
+    return 0;
+}
+
+const char *cpio_entry_path(const char *name)
+{
+    while(1)
+    {
+        if(name[0] == '.' && name[1] == '/')
+            name += 2;
+        else if(name[0] == '/')
+            ++name;
+        else
+            return name;
+    }
+}
+
+static int gz_read_full(struct cpio_reader *r, void *buf, size_t len)
+{
+    char *p = buf;
+    int res;
+    while(len > 0)
+    {
+        res = gzread(r->in, p, len > CPIO_BUF_SIZE ? CPIO_BUF_SIZE : len);
+        if(res <= 0)
+            return -1;
+        p += res;
+        len -= res;
+        r->offset += res;
+    }
+    return 0;
+}
+
+static int gz_skip(struct cpio_reader *r, size_t len)
+{
+    char buf[512];
+    size_t chunk;
+    while(len > 0)
+    {
+        chunk = len > sizeof(buf) ? sizeof(buf) : len;
+        if(gz_read_full(r, buf, chunk) < 0)
+            return -1;
+        len -= chunk;
+    }
+    return 0;
+}
+
+struct cpio_reader *cpio_reader_open(const char *path)
+{
+    gzFile in = gzopen(path, "rb");
+    if(!in)
+    {
+        ERROR("cpio: failed to open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    gzbuffer(in, CPIO_BUF_SIZE);
+
+    struct cpio_reader *r = mzalloc(sizeof(struct cpio_reader));
+    r->in = in;
+    return r;
+}
+
+void cpio_reader_close(struct cpio_reader *r)
+{
+    if(!r)
+        return;
+    gzclose(r->in);
+    free(r->entry.name);
+    free(r);
+}
+
+int cpio_reader_next(struct cpio_reader *r)
+{
+    char hdr[CPIO_HDR_LEN];
+    uint32_t f[13];
+    uint32_t namesize;
+    int i;
+
+    if(gz_skip(r, r->data_left + r->data_pad) < 0)
+        return -1;
+    r->data_left = 0;
+    r->data_pad = 0;
+
+    if(gz_read_full(r, hdr, sizeof(hdr)) < 0)
+    {
+        ERROR("cpio: unexpected end of archive\n");
+        return -1;
+    }
+
+    if(memcmp(hdr, CPIO_NEWC_MAGIC, 6) != 0)
+    {
+        ERROR("cpio: bad magic at offset %llu\n", (unsigned long long)(r->offset - sizeof(hdr)));
+        return -1;
+    }
+
+    for(i = 0; i < 13; ++i)
+    {
+        if(parse_hex(hdr + 6 + i*8, &f[i]) < 0)
+        {
+            ERROR("cpio: malformed header\n");
+            return -1;
+        }
+    }
+
+    // f[11] is namesize, f[12] is check
+    namesize = f[11];
+    if(namesize == 0 || namesize > 4096)
+    {
+        ERROR("cpio: invalid name size %u\n", namesize);
+        return -1;
+    }
+
+    free(r->entry.name);
+    r->entry.name = malloc(namesize);
+    if(gz_read_full(r, r->entry.name, namesize) < 0)
+        return -1;
+    r->entry.name[namesize-1] = 0;
+
+    if(gz_skip(r, cpio_pad4(r->offset)) < 0)
+        return -1;
+
+    r->entry.ino = f[0];
+    r->entry.mode = f[1];
+    r->entry.uid = f[2];
+    r->entry.gid = f[3];
+    r->entry.nlink = f[4];
+    r->entry.mtime = f[5];
+    r->entry.size = f[6];
+    r->entry.dev_major = f[7];
+    r->entry.dev_minor = f[8];
+    r->entry.rdev_major = f[9];
+    r->entry.rdev_minor = f[10];
+
+    if(strcmp(r->entry.name, CPIO_TRAILER) == 0)
+        return 0;
+
+    r->data_left = r->entry.size;
+    r->data_pad = cpio_pad4(r->offset + r->entry.size);
+    return 1;
+}
+
+ssize_t cpio_reader_read(struct cpio_reader *r, void *buf, size_t len)
+{
+    if(len > r->data_left)
+        len = r->data_left;
+    if(len == 0)
+        return 0;
+
+    int res = gzread(r->in, buf, len);
+    if(res <= 0)
+    {
+        ERROR("cpio: failed to read data of %s\n", r->entry.name);
+        return -1;
+    }
+
+    r->data_left -= res;
+    r->offset += res;
+    return res;
+}
+
+int cpio_buf_append(struct cpio_buf *b, const void *data, size_t len)
+{
+    if(b->size + len > b->alloc)
+    {
+        size_t alloc = b->alloc ? b->alloc : CPIO_BUF_SIZE;
+        while(alloc < b->size + len)
+            alloc *= 2;
+
+        unsigned char *n = realloc(b->data, alloc);
+        if(!n)
+            return -1;
+        b->data = n;
+        b->alloc = alloc;
+    }
+
+    memcpy(b->data + b->size, data, len);
+    b->size += len;
+    return 0;
+}
+
+int cpio_buf_load(struct cpio_buf *b, const char *path)
+{
+    struct stat info;
+    ssize_t len;
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+        return -1;
+
+    if(fstat(fd, &info) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    b->size = 0;
+    if(info.st_size > (off_t)b->alloc)
+    {
+        free(b->data);
+        b->data = malloc(info.st_size);
+        b->alloc = b->data ? info.st_size : 0;
+        if(!b->data)
+        {
+            close(fd);
+            return -1;
+        }
+    }
+
+    while(b->size < (size_t)info.st_size)
+    {
+        len = read(fd, b->data + b->size, info.st_size - b->size);
+        if(len <= 0)
+        {
+            if(len < 0 && errno == EINTR)
+                continue;
+            break;
+        }
+        b->size += len;
+    }
+
+    close(fd);
+    return b->size == (size_t)info.st_size ? 0 : -1;
+}
+
+int cpio_buf_save(const struct cpio_buf *b, const char *path)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+        return -1;
+
+    if(write_full(fd, b->data, b->size) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return close(fd);
+}
+
+void cpio_buf_free(struct cpio_buf *b)
+{
+    free(b->data);
+    b->data = NULL;
+    b->size = b->alloc = 0;
+}
+
+static int cpio_sink(struct cpio_writer *w, const void *buf, size_t len)
+{
+    if(w->mem)
+        return cpio_buf_append(w->mem, buf, len);
+    return write_full(w->fd, buf, len);
+}
+
+static int cpio_deflate(struct cpio_writer *w, int flush)
+{
+    int res;
+    do
+    {
+        w->zs->next_out = w->zbuf;
+        w->zs->avail_out = CPIO_BUF_SIZE;
+
+        res = deflate(w->zs, flush);
+        if(res == Z_STREAM_ERROR)
+            return -1;
+
+        if(cpio_sink(w, w->zbuf, CPIO_BUF_SIZE - w->zs->avail_out) < 0)
+            return -1;
+    } while(w->zs->avail_out == 0);
+    return 0;
+}
+
+static int cpio_out(struct cpio_writer *w, const void *buf, size_t len)
+{
+    w->written += len;
+
+    if(!w->zs)
+        return cpio_sink(w, buf, len);
+
+    w->zs->next_in = (Bytef*)buf;
+    w->zs->avail_in = len;
+    return cpio_deflate(w, Z_NO_FLUSH);
+}
+
+static int cpio_out_pad(struct cpio_writer *w, uint32_t pad)
+{
+    static const char zeros[4] = { 0 };
+    if(pad == 0)
+        return 0;
+    return cpio_out(w, zeros, pad);
+}
+
+static struct cpio_writer *cpio_writer_create(int fd, struct cpio_buf *mem, int compress)
+{
+    struct cpio_writer *w = mzalloc(sizeof(struct cpio_writer));
+    w->fd = fd;
+    w->mem = mem;
+    w->next_ino = 300000;
+
+    if(compress)
+    {
+        w->zs = mzalloc(sizeof(z_stream));
+        w->zbuf = malloc(CPIO_BUF_SIZE);
+        // 16+MAX_WBITS: gzip wrapper, which the kernel's initramfs unpacker accepts
+        if(deflateInit2(w->zs, Z_BEST_SPEED, Z_DEFLATED, 16+MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        {
+            ERROR("cpio: deflateInit2 failed\n");
+            free(w->zs);
+            free(w->zbuf);
+            if(fd >= 0)
+                close(fd);
+            free(w);
+            return NULL;
+        }
+    }
+    return w;
+}
+
+struct cpio_writer *cpio_writer_open(const char *path, int compress)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+    {
+        ERROR("cpio: failed to create %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    return cpio_writer_create(fd, NULL, compress);
+}
+
+struct cpio_writer *cpio_writer_open_mem(struct cpio_buf *buf, int compress)
+{
+    buf->size = 0;
+    return cpio_writer_create(-1, buf, compress);
+}
+
+int cpio_writer_add(struct cpio_writer *w, const struct cpio_entry *e)
+{
+    char hdr[CPIO_HDR_LEN+1];
+    size_t namesize = strlen(e->name) + 1;
+
+    if(w->data_left != 0)
+    {
+        ERROR("cpio: previous entry is missing %u bytes\n", w->data_left);
+        return -1;
+    }
+
+    snprintf(hdr, sizeof(hdr), CPIO_NEWC_MAGIC "%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X",
+            e->ino ? e->ino : w->next_ino++, e->mode, e->uid, e->gid, e->nlink ? e->nlink : 1,
+            e->mtime, e->size, e->dev_major, e->dev_minor, e->rdev_major, e->rdev_minor,
+            (uint32_t)namesize, 0);
+
+    if(cpio_out(w, hdr, CPIO_HDR_LEN) < 0 || cpio_out(w, e->name, namesize) < 0)
+        return -1;
+    if(cpio_out_pad(w, cpio_pad4(w->written)) < 0)
+        return -1;
+
+    w->data_left = e->size;
+    w->data_pad = cpio_pad4(w->written + e->size);
+    if(e->size == 0)
+        w->data_pad = 0;
+    return 0;
+}
+
+int cpio_writer_write(struct cpio_writer *w, const void *buf, size_t len)
+{
+    if(len > w->data_left)
+    {
+        ERROR("cpio: entry data overflow\n");
+        return -1;
+    }
+
+    if(cpio_out(w, buf, len) < 0)
+        return -1;
+
+    w->data_left -= len;
+    if(w->data_left == 0 && w->data_pad)
+    {
+        if(cpio_out_pad(w, w->data_pad) < 0)
+            return -1;
+        w->data_pad = 0;
+    }
+    return 0;
+}
+
+int cpio_copy_data(struct cpio_writer *w, struct cpio_reader *r)
+{
+    char buf[16*1024];
+    ssize_t len;
+
+    while(r->data_left > 0)
+    {
+        len = cpio_reader_read(r, buf, sizeof(buf));
+        if(len <= 0 || cpio_writer_write(w, buf, len) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+int cpio_writer_add_file(struct cpio_writer *w, const char *name, const char *src, uint32_t mode)
+{
+    struct stat info;
+    struct cpio_entry e;
+    char buf[16*1024];
+    ssize_t len;
+    int fd, res = -1;
+
+    memset(&e, 0, sizeof(e));
+    e.name = (char*)name;
+    e.mode = mode;
+
+    if(!src)
+        return cpio_writer_add(w, &e);
+
+    fd = open(src, O_RDONLY);
+    if(fd < 0 || fstat(fd, &info) < 0)
+    {
+        ERROR("cpio: failed to open %s: %s\n", src, strerror(errno));
+        goto exit;
+    }
+
+    e.size = info.st_size;
+    e.mtime = info.st_mtime;
+    if(cpio_writer_add(w, &e) < 0)
+        goto exit;
+
+    while((len = read(fd, buf, sizeof(buf))) > 0)
+        if(cpio_writer_write(w, buf, len) < 0)
+            goto exit;
+
+    res = (len == 0 && w->data_left == 0) ? 0 : -1;
+exit:
+    if(fd >= 0)
+        close(fd);
+    return res;
+}
+
+int cpio_writer_close(struct cpio_writer *w)
+{
+    struct cpio_entry e;
+    int res = 0;
+
+    memset(&e, 0, sizeof(e));
+    e.name = CPIO_TRAILER;
+    e.ino = 0xFFFFFFFF; // anything but 0, trailer does not get an inode
+
+    if(w->data_left != 0 || cpio_writer_add(w, &e) < 0)
+        res = -1;
+
+    if(w->zs)
+    {
+        w->zs->next_in = NULL;
+        w->zs->avail_in = 0;
+        if(res == 0 && cpio_deflate(w, Z_FINISH) < 0)
+            res = -1;
+        deflateEnd(w->zs);
+        free(w->zs);
+        free(w->zbuf);
+    }
+
+    if(w->fd >= 0 && close(w->fd) < 0)
+        res = -1;
+    free(w);
+    return res;
+}
+
+// names of hardlinked files seen before the entry which carries the data
+struct cpio_link
+{
+    uint32_t ino;
+    uint32_t dev_major;
+    uint32_t dev_minor;
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    char *name;
+    struct cpio_link *next;
+};
+
+// inode numbers are unique per device only
+static int cpio_link_match(struct cpio_link *l, struct cpio_entry *e)
+{
+    return l->ino == e->ino && l->dev_major == e->dev_major && l->dev_minor == e->dev_minor;
+}
+
+// a zero-length file has no data entry, create it from the first link
+static int cpio_extract_empty_links(struct cpio_link **links, int dfd)
+{
+    struct cpio_link *first, *l, **lp;
+    int fd, res = 0;
+
+    while((first = *links))
+    {
+        *links = first->next;
+
+        unlinkat(dfd, first->name, 0);
+        fd = openat(dfd, first->name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, first->mode);
+        if(fd < 0)
+        {
+            ERROR("cpio: failed to create %s: %s\n", first->name, strerror(errno));
+            res = -1;
+        }
+        else
+        {
+            fchown(fd, first->uid, first->gid);
+            fchmod(fd, first->mode);
+            close(fd);
+        }
+
+        for(lp = links; *lp; )
+        {
+            l = *lp;
+            if(l->ino != first->ino || l->dev_major != first->dev_major || l->dev_minor != first->dev_minor)
+            {
+                lp = &l->next;
+                continue;
+            }
+            if(fd >= 0)
+            {
+                unlinkat(dfd, l->name, 0);
+                linkat(dfd, first->name, dfd, l->name, 0);
+            }
+            *lp = l->next;
+            free(l->name);
+            free(l);
+        }
+
+        free(first->name);
+        free(first);
+    }
+    return res;
+}
+
+static int cpio_name_safe(const char *name)
+{
+    const char *p = name;
+    if(name[0] == 0 || strcmp(name, ".") == 0)
+        return 0;
+
+    // refuse to extract outside of dest
+    while(p)
+    {
+        if(p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == 0))
+            return 0;
+        p = strchr(p, '/');
+        if(p)
+            ++p;
+    }
+    return 1;
+}
+
+static int cpio_extract_file(struct cpio_reader *r, int dfd, const char *name, uint32_t mode)
+{
+    char buf[CPIO_BUF_SIZE];
+    ssize_t len;
+    int fd;
+
+    unlinkat(dfd, name, 0);
+    fd = openat(dfd, name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, mode);
+    if(fd < 0)
+        return -1;
+
+    while(r->data_left > 0)
+    {
+        len = cpio_reader_read(r, buf, sizeof(buf));
+        if(len <= 0 || write_full(fd, buf, len) < 0)
+        {
+            close(fd);
+            return -1;
+        }
+    }
+
+    // chown clears setuid bits, chmod after it
+    fchown(fd, r->entry.uid, r->entry.gid);
+    fchmod(fd, mode);
+    return close(fd);
+}
+
+static int cpio_extract_symlink(struct cpio_reader *r, int dfd, const char *name)
+{
+    char target[PATH_MAX];
+
+    if(r->entry.size >= sizeof(target))
+        return -1;
+
+    if(r->entry.size > 0 && cpio_reader_read(r, target, r->entry.size) != (ssize_t)r->entry.size)
+        return -1;
+    target[r->entry.size] = 0;
+
+    unlinkat(dfd, name, 0);
+    if(symlinkat(target, dfd, name) < 0)
+        return -1;
+    fchownat(dfd, name, r->entry.uid, r->entry.gid, AT_SYMLINK_NOFOLLOW);
+    return 0;
+}
+
+int cpio_extract(const char *path, const char *dest)
+{
+    struct cpio_reader *r;
+    struct cpio_link *links = NULL, *l, **lp;
+    const char *name;
+    uint32_t mode, type;
+    int dfd, res, cnt = 0;
+
+    dfd = open(dest, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(dfd < 0)
+    {
+        ERROR("cpio: failed to open %s: %s\n", dest, strerror(errno));
+        return -1;
+    }
+
+    r = cpio_reader_open(path);
+    if(!r)
+    {
+        close(dfd);
+        return -1;
+    }
+
+    while((res = cpio_reader_next(r)) == 1)
+    {
+        name = cpio_entry_path(r->entry.name);
+        if(!cpio_name_safe(name))
+            continue;
+
+        mode = r->entry.mode & 07777;
+        type = r->entry.mode & S_IFMT;
+
+        switch(type)
+        {
+            case S_IFDIR:
+                if(mkdirat(dfd, name, mode) < 0 && errno != EEXIST)
+                    res = -1;
+                else
+                {
+                    fchmodat(dfd, name, mode, 0);
+                    fchownat(dfd, name, r->entry.uid, r->entry.gid, AT_SYMLINK_NOFOLLOW);
+                }
+                break;
+            case S_IFREG:
+                // newc stores the data of hardlinked files with the last link
+                if(r->entry.nlink > 1 && r->entry.size == 0)
+                {
+                    l = mzalloc(sizeof(struct cpio_link));
+                    l->ino = r->entry.ino;
+                    l->dev_major = r->entry.dev_major;
+                    l->dev_minor = r->entry.dev_minor;
+                    l->mode = mode;
+                    l->uid = r->entry.uid;
+                    l->gid = r->entry.gid;
+                    l->name = strdup(name);
+                    l->next = links;
+                    links = l;
+                    break;
+                }
+
+                res = cpio_extract_file(r, dfd, name, mode);
+
+                for(lp = &links; res >= 0 && r->entry.nlink > 1 && *lp; )
+                {
+                    l = *lp;
+                    if(!cpio_link_match(l, &r->entry))
+                    {
+                        lp = &l->next;
+                        continue;
+                    }
+                    unlinkat(dfd, l->name, 0);
+                    linkat(dfd, name, dfd, l->name, 0);
+                    *lp = l->next;
+                    free(l->name);
+                    free(l);
+                }
+                break;
+            case S_IFLNK:
+                res = cpio_extract_symlink(r, dfd, name);
+                break;
+            case S_IFCHR:
+            case S_IFBLK:
+            case S_IFIFO:
+            case S_IFSOCK:
+                unlinkat(dfd, name, 0);
+                if(mknodat(dfd, name, r->entry.mode, makedev(r->entry.rdev_major, r->entry.rdev_minor)) < 0)
+                    res = -1;
+                else
+                    fchownat(dfd, name, r->entry.uid, r->entry.gid, AT_SYMLINK_NOFOLLOW);
+                break;
+            default:
+                ERROR("cpio: unknown type 0%o of %s\n", type, name);
+                break;
+        }
+
+        if(res < 0)
+        {
+            ERROR("cpio: failed to extract %s: %s\n", name, strerror(errno));
+            break;
+        }
+        ++cnt;
+    }
+
+    // hardlinks whose data never came are empty files
+    if(res == 0)
+        res = cpio_extract_empty_links(&links, dfd);
+
+    while(links)
+    {
+        l = links;
+        links = l->next;
+        free(l->name);
+        free(l);
+    }
+
+    cpio_reader_close(r);
+    close(dfd);
+
+    if(res < 0)
+        return -1;
+
+    INFO("cpio: extracted %d entries from %s\n", cnt, path);
+    return cnt;
+}
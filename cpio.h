@@ -0,0 +1,108 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CPIO_H
+#define CPIO_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <zlib.h>
+
+// "newc" (SVR4 without CRC) format, the only one the kernel
+// understands for initramfs
+#define CPIO_NEWC_MAGIC "070701"
+#define CPIO_TRAILER "TRAILER!!!"
+
+struct cpio_entry
+{
+    char *name;
+    uint32_t ino;
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t nlink;
+    uint32_t mtime;
+    uint32_t size;
+    uint32_t dev_major;
+    uint32_t dev_minor;
+    uint32_t rdev_major;
+    uint32_t rdev_minor;
+};
+
+struct cpio_reader
+{
+    gzFile in;
+    struct cpio_entry entry;
+    uint32_t data_left; // unread bytes of current entry's data
+    uint32_t data_pad;
+    uint64_t offset; // uncompressed bytes consumed
+};
+
+// growable memory buffer archives can be written to
+struct cpio_buf
+{
+    unsigned char *data;
+    size_t size;
+    size_t alloc;
+};
+
+struct cpio_writer
+{
+    int fd; // -1 when writing to mem
+    struct cpio_buf *mem;
+    z_stream *zs; // NULL when writing uncompressed archive
+    unsigned char *zbuf;
+    uint32_t data_left; // bytes of current entry's data still expected
+    uint32_t data_pad;
+    uint32_t next_ino;
+    uint64_t written; // uncompressed bytes written
+};
+
+// Reads both plain and gzip-compressed archives
+struct cpio_reader *cpio_reader_open(const char *path);
+void cpio_reader_close(struct cpio_reader *r);
+// returns 1 and fills r->entry, 0 at the trailer, -1 on error
+int cpio_reader_next(struct cpio_reader *r);
+ssize_t cpio_reader_read(struct cpio_reader *r, void *buf, size_t len);
+
+struct cpio_writer *cpio_writer_open(const char *path, int compress);
+// Appends the archive to buf
+struct cpio_writer *cpio_writer_open_mem(struct cpio_buf *buf, int compress);
+// Returns 0 on success and -1 on error, closes the writer in both cases
+int cpio_writer_close(struct cpio_writer *w);
+// e->ino of 0 means allocate one, e->size bytes must follow via cpio_writer_write
+int cpio_writer_add(struct cpio_writer *w, const struct cpio_entry *e);
+int cpio_writer_write(struct cpio_writer *w, const void *buf, size_t len);
+// Copies the rest of reader's current entry into writer's current entry
+int cpio_copy_data(struct cpio_writer *w, struct cpio_reader *r);
+int cpio_writer_add_file(struct cpio_writer *w, const char *name, const char *src, uint32_t mode);
+
+int cpio_buf_append(struct cpio_buf *b, const void *data, size_t len);
+// Reads whole file at path into b
+int cpio_buf_load(struct cpio_buf *b, const char *path);
+// Writes contents of b to a new file at path
+int cpio_buf_save(const struct cpio_buf *b, const char *path);
+void cpio_buf_free(struct cpio_buf *b);
+
+// Unpacks a plain or gzip-compressed archive into dest, keeping modes,
+// owners and symlinks. Returns number of entries or -1 on error
+int cpio_extract(const char *path, const char *dest);
+
+// strips leading "./" and "/" so names from `find . | cpio -o` compare equal
+const char *cpio_entry_path(const char *name);
+
+#endif
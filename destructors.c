@@ -92,6 +92,7 @@ void free_multirom_partition(struct multirom_partition *p)
     if(p->mount_path != NULL)
     {
         umount(p->mount_path);
+        multirom_untrack_mount(p->mount_path);
         free(p->mount_path);
     }
     free(p->uuid);
@@ -36,6 +36,7 @@
 #include "framebuffer.h"
 #include "iso_font.h"
 #include "util.h"
+#include "input.h"
 
 // only double-buffering is implemented, this define is just
 // for the code to know how many buffers we use
@@ -53,10 +54,20 @@
  */
 #define FB_MEM_ALIGN 0x1000
 
+// offscreen framebuffer size when there is no fb0 to take it from
+#define FB_OFFSCREEN_W 480
+#define FB_OFFSCREEN_H 854
+
+// input frames slower than this are counted as late, two draw thread periods
+#define FB_LATE_US 33000
+
 
 static struct FB framebuffers[NUM_BUFFERS];
 static int active_fb = 0;
 static int fb_frozen = 0;
+static int fb_offscreen = 0;
+static struct fb_stats fb_stats;
+static int64_t fb_last_report_us = 0;
 
 static fb_items_t fb_items = { NULL, NULL, NULL };
 static fb_items_t **inactive_ctx = NULL;
@@ -97,19 +108,27 @@ struct FB *get_active_fb()
     return &framebuffers[active_fb];
 }
 
-int fb_open(int rotation)
+static int fb_open_impl(int rotation, int offscreen)
 {
     fb_rotation = rotation;
+    fb_offscreen = offscreen;
 
     int i;
+    px_type *bits;
     int fd = open("/dev/graphics/fb0", O_RDWR);
-    if (fd < 0)
+    if (fd < 0 && !offscreen)
         return -1;
 
     struct fb_fix_screeninfo fi;
     struct fb_var_screeninfo vi;
 
-    if (ioctl(fd, FBIOGET_VSCREENINFO, &vi) < 0)
+    if (fd < 0)
+    {
+        memset(&vi, 0, sizeof(vi));
+        vi.xres = vi.xres_virtual = FB_OFFSCREEN_W;
+        vi.yres = FB_OFFSCREEN_H;
+    }
+    else if (ioctl(fd, FBIOGET_VSCREENINFO, &vi) < 0)
         goto fail;
 
     vi.bits_per_pixel = PIXEL_SIZE * 8;
@@ -155,19 +174,37 @@ int fb_open(int rotation)
     vi.vmode = FB_VMODE_NONINTERLACED;
     vi.activate = FB_ACTIVATE_NOW | FB_ACTIVATE_FORCE;
 
-    if (ioctl(fd, FBIOPUT_VSCREENINFO, &vi) < 0)
+    if (offscreen)
     {
-        ERROR("failed to set fb0 vi info");
-        goto fail;
+        // fb0 was only needed for the resolution, leave the display alone
+        if (fd >= 0)
+            close(fd);
+        fd = -1;
+
+        memset(&fi, 0, sizeof(fi));
+        fi.line_length = vi.xres_virtual * PIXEL_SIZE;
+        fi.smem_len = vi.yres * fi.line_length * NUM_BUFFERS;
+
+        bits = malloc(fi.smem_len);
+        if (!bits)
+            goto fail;
     }
+    else
+    {
+        if (ioctl(fd, FBIOPUT_VSCREENINFO, &vi) < 0)
+        {
+            ERROR("failed to set fb0 vi info");
+            goto fail;
+        }
 
-    if (ioctl(fd, FBIOGET_FSCREENINFO, &fi) < 0)
-        goto fail;
+        if (ioctl(fd, FBIOGET_FSCREENINFO, &fi) < 0)
+            goto fail;
 
-    px_type *bits = mmap(0, fi.smem_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        bits = mmap(0, fi.smem_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
 
-    if (bits == MAP_FAILED)
-        goto fail;
+        if (bits == MAP_FAILED)
+            goto fail;
+    }
 
 #ifdef RECOVERY_GRAPHICS_USE_LINELENGTH
     vi.xres_virtual = fi.line_length / PIXEL_SIZE;
@@ -191,7 +228,7 @@ int fb_open(int rotation)
     fb_memset(b_store, fb_convert_color(BLACK), vi.xres_virtual*vi.yres*PIXEL_SIZE);
 
     unsigned fb_size = vi.yres * fi.line_length;
-    if (fb_size % FB_MEM_ALIGN != 0) {
+    if (!offscreen && fb_size % FB_MEM_ALIGN != 0) {
         fb_size += FB_MEM_ALIGN - fb_size % FB_MEM_ALIGN;
     }
 
@@ -214,6 +251,9 @@ int fb_open(int rotation)
     fb_dump_info();
 #endif
 
+    memset(&fb_stats, 0, sizeof(fb_stats));
+    fb_last_report_us = input_last_report_us();
+
     fb_update();
 
     fb_draw_run = 1;
@@ -221,10 +261,21 @@ int fb_open(int rotation)
     return 0;
 
 fail:
-    close(fd);
+    if (fd >= 0)
+        close(fd);
     return -1;
 }
 
+int fb_open(int rotation)
+{
+    return fb_open_impl(rotation, 0);
+}
+
+int fb_open_offscreen(int rotation)
+{
+    return fb_open_impl(rotation, 1);
+}
+
 void fb_close(void)
 {
     fb_draw_run = 0;
@@ -233,9 +284,19 @@ void fb_close(void)
     free(fb_rot_helpers);
     fb_rot_helpers = NULL;
 
-    munmap(fb->mapped, fb->fi.smem_len);
-    close(fb->fd);
+    if(fb_offscreen)
+        free(fb->mapped);
+    else
+    {
+        munmap(fb->mapped, fb->fi.smem_len);
+        close(fb->fd);
+    }
     free(fb->bits);
+
+    ERROR("fb: %u frames, %u after input, input to frame avg %u us, max %u us, %u over %u ms\n",
+            fb_stats.frames, fb_stats.input_frames,
+            fb_stats.input_frames ? (uint32_t)(fb_stats.total_latency_us / fb_stats.input_frames) : 0,
+            fb_stats.max_latency_us, fb_stats.late_frames, FB_LATE_US/1000);
 }
 
 void fb_dump_info(void)
@@ -279,6 +340,9 @@ void fb_set_active_framebuffer(unsigned n)
     fb->vi.yres_virtual = fb->vi.yres * NUM_BUFFERS;
     fb->vi.yoffset = n * fb->vi.yres;
 
+    if (fb_offscreen)
+        return;
+
     if (ioctl(fb->fd, FBIOPUT_VSCREENINFO, &fb->vi) < 0)
         ERROR("active fb swap failed");
 }
@@ -531,6 +595,7 @@ static fb_text *fb_create_text_item(int x, int y, uint32_t color, int size, cons
     t->head.type = FB_TEXT;
     t->head.x = x;
     t->head.y = y;
+    t->head.hidden = 0;
 
     t->color = color;
     t->size = size;
@@ -570,6 +635,7 @@ fb_rect *fb_add_rect(int x, int y, int w, int h, uint32_t color)
     r->head.type = FB_RECT;
     r->head.x = x;
     r->head.y = y;
+    r->head.hidden = 0;
 
     r->w = w;
     r->h = h;
@@ -612,6 +678,26 @@ void fb_rm_text(fb_text *t)
     pthread_mutex_unlock(&fb_mutex);
 }
 
+// keeps the buffer if the new text fits into it, returns 1 if it did not
+int fb_text_set(fb_text *t, const char *text)
+{
+    size_t len = strlen(text);
+    int grow = (len > strlen(t->text));
+
+    pthread_mutex_lock(&fb_mutex);
+    if(grow)
+        t->text = realloc(t->text, len+1);
+    memcpy(t->text, text, len+1);
+    pthread_mutex_unlock(&fb_mutex);
+    return grow;
+}
+
+void fb_item_set_hidden(void *item, int hidden)
+{
+    if(item)
+        ((fb_item_header*)item)->hidden = hidden;
+}
+
 void fb_rm_rect(fb_rect *r)
 {
     if(!r)
@@ -778,6 +864,31 @@ void fb_draw_overlay(void)
 #endif // MR_DISABLE_ALPHA
 }
 
+// expects locked fb_mutex. The first frame finished after an input report
+// is taken as the response to it.
+static void fb_account_frame(void)
+{
+    int64_t report, latency;
+
+    fb_stats.frames++;
+
+    report = input_last_report_us();
+    if(report == fb_last_report_us)
+        return;
+    fb_last_report_us = report;
+
+    latency = get_mono_us() - report;
+    if(latency < 0)
+        latency = 0;
+
+    fb_stats.input_frames++;
+    fb_stats.total_latency_us += latency;
+    if(latency > fb_stats.max_latency_us)
+        fb_stats.max_latency_us = latency;
+    if(latency > FB_LATE_US)
+        fb_stats.late_frames++;
+}
+
 void fb_draw(void)
 {
     if(fb_frozen)
@@ -790,11 +901,13 @@ void fb_draw(void)
 
     // rectangles
     for(i = 0; fb_items.rects && fb_items.rects[i]; ++i)
-        fb_draw_rect(fb_items.rects[i]);
+        if(!fb_items.rects[i]->head.hidden)
+            fb_draw_rect(fb_items.rects[i]);
 
     // texts
     for(i = 0; fb_items.texts && fb_items.texts[i]; ++i)
-        fb_draw_text(fb_items.texts[i]);
+        if(!fb_items.texts[i]->head.hidden)
+            fb_draw_text(fb_items.texts[i]);
 
     // msg box
     if(fb_items.msgbox)
@@ -811,7 +924,15 @@ void fb_draw(void)
     }
 
     fb_update();
+    fb_account_frame();
+
+    pthread_mutex_unlock(&fb_mutex);
+}
 
+void fb_get_stats(struct fb_stats *st)
+{
+    pthread_mutex_lock(&fb_mutex);
+    *st = fb_stats;
     pthread_mutex_unlock(&fb_mutex);
 }
 
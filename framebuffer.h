@@ -78,8 +78,20 @@ extern uint32_t fb_width;
 extern uint32_t fb_height;
 extern int fb_rotation;
 
+struct fb_stats
+{
+    uint32_t frames;
+    uint32_t input_frames;      // first frames drawn after an input report
+    uint64_t total_latency_us;  // input report -> frame flipped
+    uint32_t max_latency_us;
+    uint32_t late_frames;
+};
+
 int fb_open(int rotation);
+// draws only into memory, for headless input replays
+int fb_open_offscreen(int rotation);
 void fb_close(void);
+void fb_get_stats(struct fb_stats *st);
 void fb_update(void);
 void fb_switch(int n_sig);
 inline struct FB *get_active_fb();
@@ -99,6 +111,7 @@ typedef struct
     int type;
     int x;
     int y;
+    int hidden; // stays in the lists, but is not drawn
 } fb_item_header;
 
 typedef struct
@@ -146,6 +159,8 @@ fb_text *fb_msgbox_add_text(int x, int y, int size, char *txt, ...);
 void fb_msgbox_rm_text(fb_text *text);
 void fb_destroy_msgbox(void);
 void fb_rm_text(fb_text *t);
+int fb_text_set(fb_text *t, const char *text);
+void fb_item_set_hidden(void *item, int hidden);
 void fb_rm_rect(fb_rect *r);
 px_type fb_convert_color(uint32_t c);
 
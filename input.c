@@ -17,11 +17,16 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/poll.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <errno.h>
 #include <linux/input.h>
 #include <linux/kd.h>
 #include <pthread.h>
@@ -39,23 +44,49 @@
 int mt_screen_res[2] = { 0 };
 touch_event mt_events[MAX_FINGERS];
 int mt_slot = 0;
-int mt_switch_xy = 0;
-int mt_range_x[2] = { 0 };
-int mt_range_y[2] = { 0 };
 
-static struct pollfd ev_fds[MAX_DEVICES];
-static unsigned ev_count = 0;
+#define INPUT_DIR "/dev/input"
+// input_event structs read with one syscall
+#define EV_READ_BATCH 64
+// epoll data of the shutdown eventfd and inotify, devices use their slot
+#define EV_WAKE_ID    0xFFFFFFFF
+#define EV_INOTIFY_ID 0xFFFFFFFE
+
+static struct input_device *ev_devs[MAX_DEVICES];
+static int ev_epoll_fd = -1;
+static int ev_inotify_fd = -1;
+static int ev_dir_watch = -1;
+static int ev_parent_watch = -1; // on /dev until /dev/input exists
+static int ev_wake_fd = -1;
 static volatile int input_run = 0;
 
-static int key_queue[10];
-static int8_t key_itr = 10;
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct input_stats input_stats;
+static int64_t last_report_us = 0;
+
+// released keys, oldest is dropped when full
+#define KEY_QUEUE_SIZE 16
+
+static struct input_key key_queue[KEY_QUEUE_SIZE];
+static uint32_t key_head = 0; // next to pop
+static uint32_t key_cnt = 0;
+static uint32_t key_overflows = 0;
+static struct timeval key_pressed[KEY_POWER - KEY_VOLUMEDOWN + 1];
 static pthread_mutex_t key_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t key_cond = PTHREAD_COND_INITIALIZER;
 static pthread_mutex_t touch_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_t input_thread;
 
-static handler_list_it *mt_handlers = NULL;
+static handlers_ctx *mt_ctx = NULL;
 static handlers_ctx **inactive_ctx = NULL;
-static int mt_handlers_mode = HANDLERS_FIRST;
+static uint32_t mt_handlers_seq = 0;
+// changes when handlers are removed or the context is switched
+static uint32_t mt_handlers_gen = 0;
+// number of running touch_dispatch_event() calls, handlers and contexts
+// removed meanwhile are freed once it drops to zero
+static int mt_dispatching = 0;
+static touch_handler **mt_removed = NULL;
+static handlers_ctx **mt_removed_ctx = NULL;
 
 #define DIV_ROUND_UP(n,d)  (((n) + (d) - 1) / (d))
 #define BIT(nr)            (1UL << (nr))
@@ -65,99 +96,270 @@ static int mt_handlers_mode = HANDLERS_FIRST;
 #define BITS_PER_LONG      (sizeof(long) * BITS_PER_BYTE)
 #define BITS_TO_LONGS(nr)  DIV_ROUND_UP(nr, BITS_PER_BYTE * sizeof(long))
 
-static void get_abs_min_max(int fd)
+static int test_bit(int nr, long *bits)
+{
+    return (bits[BIT_WORD(nr)] & BIT_MASK(nr)) != 0;
+}
+
+static void get_abs_min_max(struct input_device *dev)
 {
     int abs[5];
-    if(ioctl(fd, EVIOCGABS(ABS_MT_POSITION_X), abs) >= 0)
-        memcpy(mt_range_x, abs+1, 2*sizeof(int));
+    if(ioctl(dev->fd, EVIOCGABS(ABS_MT_POSITION_X), abs) >= 0)
+        memcpy(dev->range_x, abs+1, 2*sizeof(int));
 
-    if(ioctl(fd, EVIOCGABS(ABS_MT_POSITION_Y), abs) >= 0)
-        memcpy(mt_range_y, abs+1, 2*sizeof(int));
+    if(ioctl(dev->fd, EVIOCGABS(ABS_MT_POSITION_Y), abs) >= 0)
+        memcpy(dev->range_y, abs+1, 2*sizeof(int));
 
 
-    mt_switch_xy = (mt_range_x[1] > mt_range_y[1]);
-    if(mt_switch_xy)
+    dev->switch_xy = (dev->range_x[1] > dev->range_y[1]);
+    if(dev->switch_xy)
     {
-        memcpy(abs, mt_range_x, 2*sizeof(int));
-        memcpy(mt_range_x, mt_range_y, 2*sizeof(int));
-        memcpy(mt_range_y, abs, 2*sizeof(int));
+        memcpy(abs, dev->range_x, 2*sizeof(int));
+        memcpy(dev->range_x, dev->range_y, 2*sizeof(int));
+        memcpy(dev->range_y, abs, 2*sizeof(int));
     }
 }
 
-static int ev_init(void)
+static void ev_add_device(const char *name)
 {
-    DIR *dir;
-    struct dirent *de;
-    int fd;
+    struct input_device *dev;
+    struct epoll_event ev;
+    long evbit[BITS_TO_LONGS(EV_CNT)];
     long absbit[BITS_TO_LONGS(ABS_CNT)];
+    char path[64];
+    int i, slot = -1;
 
-    ev_count = 0;
-    mt_screen_res[0] = fb->vi.xres;
-    mt_screen_res[1] = fb->vi.yres;
+    if(strncmp(name, "event", 5))
+        return;
 
-    init_touch_specifics();
+    for(i = 0; i < MAX_DEVICES; ++i)
+    {
+        if(!ev_devs[i])
+        {
+            if(slot == -1)
+                slot = i;
+        }
+        else if(strcmp(ev_devs[i]->name, name) == 0)
+            return;
+    }
+
+    if(slot == -1)
+    {
+        ERROR("input: too many devices, ignoring %s\n", name);
+        return;
+    }
+
+    dev = mzalloc(sizeof(struct input_device));
+    snprintf(dev->name, sizeof(dev->name), "%s", name);
+    snprintf(path, sizeof(path), INPUT_DIR"/%s", name);
+
+    dev->fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if(dev->fd < 0)
+        goto fail;
+
+    memset(evbit, 0, sizeof(evbit));
+    memset(absbit, 0, sizeof(absbit));
+    ioctl(dev->fd, EVIOCGBIT(0, EV_CNT), evbit);
+
+    if(test_bit(EV_ABS, evbit) && ioctl(dev->fd, EVIOCGBIT(EV_ABS, ABS_CNT), absbit) >= 0 &&
+        test_bit(ABS_MT_POSITION_X, absbit) && test_bit(ABS_MT_POSITION_Y, absbit))
+    {
+        dev->is_touch = 1;
+        get_abs_min_max(dev);
+    }
+
+    // nothing MultiROM would use
+    if(!dev->is_touch && !test_bit(EV_KEY, evbit))
+        goto fail;
+
+    ev.events = EPOLLIN;
+    ev.data.u32 = slot;
+    if(epoll_ctl(ev_epoll_fd, EPOLL_CTL_ADD, dev->fd, &ev) < 0)
+        goto fail;
+
+    INFO("input: added %s%s, x %d-%d y %d-%d\n", name, dev->is_touch ? " (touch)" : "",
+            dev->range_x[0], dev->range_x[1], dev->range_y[0], dev->range_y[1]);
+    ev_devs[slot] = dev;
+    input_record_device(slot, dev);
+    return;
+
+fail:
+    if(dev->fd >= 0)
+        close(dev->fd);
+    free(dev);
+}
+
+static void ev_remove_device(int slot)
+{
+    struct input_device *dev = ev_devs[slot];
+    if(!dev)
+        return;
+
+    INFO("input: removed %s\n", dev->name);
+    input_record_remove(slot);
+    epoll_ctl(ev_epoll_fd, EPOLL_CTL_DEL, dev->fd, NULL);
+    close(dev->fd);
+    free(dev);
+    ev_devs[slot] = NULL;
+}
+
+static void ev_scan_devices(void)
+{
+    DIR *dir;
+    struct dirent *de;
 
-    dir = opendir("/dev/input");
+    dir = opendir(INPUT_DIR);
     if(!dir)
-        return -1;
+        return;
 
     while((de = readdir(dir)))
-    {
-        if(strncmp(de->d_name,"event",5))
-            continue;
+        ev_add_device(de->d_name);
+    closedir(dir);
+}
 
-        fd = openat(dirfd(dir), de->d_name, O_RDONLY);
-        if(fd < 0)
-            continue;
+static void ev_watch_dir(void)
+{
+    if(ev_inotify_fd < 0 || ev_dir_watch >= 0)
+        return;
+
+    ev_dir_watch = inotify_add_watch(ev_inotify_fd, INPUT_DIR, IN_CREATE | IN_DELETE | IN_ATTRIB);
+    if(ev_dir_watch < 0)
+        return;
+
+    if(ev_parent_watch >= 0)
+    {
+        inotify_rm_watch(ev_inotify_fd, ev_parent_watch);
+        ev_parent_watch = -1;
+    }
+    ev_scan_devices(); // might have appeared before the watch
+}
 
-        ev_fds[ev_count].fd = fd;
-        ev_fds[ev_count].events = POLLIN;
+static void ev_handle_inotify(void)
+{
+    char buf[1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *e;
+    ssize_t len;
+    char *p;
+    int i;
 
-        if (ioctl(fd, EVIOCGBIT(EV_ABS, ABS_CNT), absbit) >= 0)
+    while((len = read(ev_inotify_fd, buf, sizeof(buf))) > 0)
+    {
+        for(p = buf; p < buf + len; p += sizeof(struct inotify_event) + e->len)
         {
-             if ((absbit[BIT_WORD(ABS_MT_POSITION_X)] & BIT_MASK(ABS_MT_POSITION_X)) &&
-                (absbit[BIT_WORD(ABS_MT_POSITION_Y)] & BIT_MASK(ABS_MT_POSITION_Y)))
-             {
-                 get_abs_min_max(fd);
-             }
+            e = (struct inotify_event *)p;
+
+            if(e->wd == ev_parent_watch)
+            {
+                // /dev/input itself was created
+                if((e->mask & IN_CREATE) && e->len && strcmp(e->name, "input") == 0)
+                    ev_watch_dir();
+                continue;
+            }
+
+            if(e->wd != ev_dir_watch)
+                continue;
+
+            if(e->mask & IN_IGNORED)
+            {
+                ev_dir_watch = -1;
+                continue;
+            }
+
+            if(!e->len)
+                continue;
+
+            // IN_ATTRIB: ueventd chmods the node after creating it
+            if(e->mask & (IN_CREATE | IN_ATTRIB))
+                ev_add_device(e->name);
+            else if(e->mask & IN_DELETE)
+            {
+                for(i = 0; i < MAX_DEVICES; ++i)
+                    if(ev_devs[i] && strcmp(ev_devs[i]->name, e->name) == 0)
+                        ev_remove_device(i);
+            }
         }
+    }
+}
+
+static int ev_init(void)
+{
+    struct epoll_event ev;
+
+    mt_screen_res[0] = fb->vi.xres;
+    mt_screen_res[1] = fb->vi.yres;
+
+    init_touch_specifics();
+    input_record_open();
 
-        ev_count++;
-        if(ev_count == MAX_DEVICES) break;
+    ev_epoll_fd = epoll_create(MAX_DEVICES + 2);
+    if(ev_epoll_fd < 0)
+    {
+        ERROR("input: epoll_create failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if(ev_wake_fd >= 0)
+    {
+        ev.events = EPOLLIN;
+        ev.data.u32 = EV_WAKE_ID;
+        epoll_ctl(ev_epoll_fd, EPOLL_CTL_ADD, ev_wake_fd, &ev);
+    }
+
+    // devices which show up later, e.g. OTG keyboards or late touchscreens
+    ev_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(ev_inotify_fd >= 0)
+    {
+        ev.events = EPOLLIN;
+        ev.data.u32 = EV_INOTIFY_ID;
+        epoll_ctl(ev_epoll_fd, EPOLL_CTL_ADD, ev_inotify_fd, &ev);
+        ev_watch_dir();
+        if(ev_dir_watch < 0)
+            ev_parent_watch = inotify_add_watch(ev_inotify_fd, "/dev", IN_CREATE | IN_ONLYDIR);
     }
-    closedir(dir);
 
+    ev_scan_devices();
     return 0;
 }
 
 static void ev_exit(void)
 {
-    destroy_touch_specifics();
+    int i;
 
-    while (ev_count > 0) {
-        close(ev_fds[--ev_count].fd);
-    }
-}
+    destroy_touch_specifics();
 
-static int ev_get(struct input_event *ev, unsigned dont_wait)
-{
-    int r;
-    unsigned n;
+    for(i = 0; i < MAX_DEVICES; ++i)
+        ev_remove_device(i);
+    input_record_close();
 
-    do {
-        r = poll(ev_fds, ev_count, dont_wait ? 0 : -1);
+    if(ev_inotify_fd >= 0)
+        close(ev_inotify_fd);
+    ev_inotify_fd = -1;
+    ev_dir_watch = -1;
+    ev_parent_watch = -1;
 
-        if(r > 0) {
-            for(n = 0; n < ev_count; n++) {
-                if(ev_fds[n].revents & POLLIN) {
-                    r = read(ev_fds[n].fd, ev, sizeof(*ev));
-                    if(r == sizeof(*ev)) return 0;
-                }
-            }
-        }
-    } while(dont_wait == 0);
+    if(ev_epoll_fd >= 0)
+        close(ev_epoll_fd);
+    ev_epoll_fd = -1;
+}
 
-    return -1;
+// kernel timestamps input events with gettimeofday
+static void ev_report_arrived(struct input_event *ev)
+{
+    struct timeval now;
+    int64_t delay;
+
+    gettimeofday(&now, NULL);
+    delay = ((int64_t)(now.tv_sec - ev->time.tv_sec))*1000000 + (now.tv_usec - ev->time.tv_usec);
+    if(delay < 0)
+        delay = 0;
+
+    pthread_mutex_lock(&stats_mutex);
+    last_report_us = get_mono_us();
+    input_stats.reports++;
+    input_stats.total_delay_us += delay;
+    if(delay > input_stats.max_delay_us)
+        input_stats.max_delay_us = delay;
+    pthread_mutex_unlock(&stats_mutex);
 }
 
 #define IS_KEY_HANDLED(key) (key >= KEY_VOLUMEDOWN && key <= KEY_POWER)
@@ -170,12 +372,28 @@ static void handle_key_event(struct input_event *ev)
     if(keyaction_handle_keyevent(ev->code, (ev->value != 0)) != -1)
         return;
 
+    pthread_mutex_lock(&key_mutex);
     if(ev->value != 0)
+    {
+        key_pressed[ev->code - KEY_VOLUMEDOWN] = ev->time;
+        pthread_mutex_unlock(&key_mutex);
         return;
+    }
 
-    pthread_mutex_lock(&key_mutex);
-    if(key_itr > 0)
-        key_queue[--key_itr] = ev->code;
+    if(key_cnt == KEY_QUEUE_SIZE)
+    {
+        key_head = (key_head + 1) % KEY_QUEUE_SIZE;
+        --key_cnt;
+        ++key_overflows;
+    }
+
+    struct input_key *k = &key_queue[(key_head + key_cnt) % KEY_QUEUE_SIZE];
+    k->code = ev->code;
+    k->pressed = key_pressed[ev->code - KEY_VOLUMEDOWN];
+    k->released = ev->time;
+    ++key_cnt;
+
+    pthread_cond_signal(&key_cond);
     pthread_mutex_unlock(&key_mutex);
 }
 
@@ -219,18 +437,190 @@ static void mt_recalc_pos_rotation(touch_event *ev)
     }
 }
 
+static handlers_ctx *touch_ctx_create(void)
+{
+    handlers_ctx *ctx = mzalloc(sizeof(handlers_ctx));
+    ctx->handlers_mode = HANDLERS_FIRST;
+    return ctx;
+}
+
+static void touch_ctx_destroy(void *data)
+{
+    handlers_ctx *ctx = data;
+    int i;
+
+    list_clear(&ctx->handlers, &free);
+    list_clear(&ctx->global, NULL);
+    for(i = 0; i < TOUCH_GRID_ROWS*TOUCH_GRID_COLS; ++i)
+        list_clear(&ctx->cells[i], NULL);
+    free(ctx);
+}
+
+// expects locked touch_mutex
+static int touch_handler_registered(handlers_ctx *ctx, touch_handler *h)
+{
+    int i;
+    for(i = 0; ctx && ctx->handlers && ctx->handlers[i]; ++i)
+        if(ctx->handlers[i] == h)
+            return 1;
+    return 0;
+}
+
+// expects locked touch_mutex
+static struct touch_capture *touch_get_capture(handlers_ctx *ctx, int id, int create)
+{
+    int i;
+    struct touch_capture *free_cap = NULL;
+
+    for(i = 0; i < MAX_FINGERS; ++i)
+    {
+        if(ctx->captures[i].cnt == 0)
+        {
+            if(!free_cap)
+                free_cap = &ctx->captures[i];
+        }
+        else if(ctx->captures[i].id == id)
+            return &ctx->captures[i];
+    }
+
+    if(create && free_cap)
+    {
+        free_cap->id = id;
+        return free_cap;
+    }
+    return NULL;
+}
+
+// expects locked touch_mutex, returns number of handlers put into res
+static int touch_collect_handlers(handlers_ctx *ctx, touch_event *ev, touch_handler **res, int max)
+{
+    int i, j, cnt = 0;
+    touch_handler *h;
+    struct touch_capture *cap;
+
+    for(i = 0; ctx->global && ctx->global[i] && cnt < max; ++i)
+        res[cnt++] = ctx->global[i];
+
+    if(ev->changed & TCHNG_ADDED)
+    {
+        // a new finger goes only to handlers under it
+        int col = imin(imax(ev->x, 0) / ctx->cell_w, TOUCH_GRID_COLS-1);
+        int row = imin(imax(ev->y, 0) / ctx->cell_h, TOUCH_GRID_ROWS-1);
+        touch_handler **cell = ctx->cells[row*TOUCH_GRID_COLS + col];
+
+        for(i = 0; cell && cell[i] && cnt < max; ++i)
+        {
+            h = cell[i];
+            if(in_rect(ev->x, ev->y, h->x, h->y, h->w, h->h))
+                res[cnt++] = h;
+        }
+    }
+    else if((cap = touch_get_capture(ctx, ev->id, 0)))
+    {
+        // the rest of its events go to the handlers which took it
+        for(i = 0; i < cap->cnt && cnt < max; ++i)
+            res[cnt++] = cap->handlers[i];
+    }
+
+    // keep the order in which the handlers were added
+    for(i = 1; i < cnt; ++i)
+    {
+        h = res[i];
+        for(j = i; j > 0 && res[j-1]->seq > h->seq; --j)
+            res[j] = res[j-1];
+        res[j] = h;
+    }
+    return cnt;
+}
+
+static void touch_dispatch_event(touch_event *ev)
+{
+    touch_handler *handlers[64];
+    touch_handler *h;
+    touch_handler **removed = NULL;
+    struct touch_capture *cap;
+    handlers_ctx *ctx;
+    handlers_ctx **removed_ctx = NULL;
+    uint32_t gen;
+    int i, cnt, mode, res;
+
+    pthread_mutex_lock(&touch_mutex);
+    ctx = mt_ctx;
+    if(!ctx)
+    {
+        pthread_mutex_unlock(&touch_mutex);
+        return;
+    }
+
+    if(ev->changed & TCHNG_ADDED)
+    {
+        cap = touch_get_capture(ctx, ev->id, 0);
+        if(cap)
+            cap->cnt = 0;
+    }
+
+    cnt = touch_collect_handlers(ctx, ev, handlers, ARRAY_SIZE(handlers));
+    mode = ctx->handlers_mode;
+    gen = mt_handlers_gen;
+    ++mt_dispatching;
+    pthread_mutex_unlock(&touch_mutex);
+
+    for(i = 0; i < cnt; ++i)
+    {
+        h = handlers[i];
+
+        // a previous handler or another thread might have removed this one,
+        // it stays allocated until the dispatch ends
+        pthread_mutex_lock(&touch_mutex);
+        res = (gen == mt_handlers_gen || (ctx == mt_ctx && touch_handler_registered(ctx, h)));
+        pthread_mutex_unlock(&touch_mutex);
+        if(!res)
+            continue;
+
+        res = (*h->callback)(ev, h->data);
+
+        if(res == 0 && h->has_rect && (ev->changed & TCHNG_ADDED))
+        {
+            pthread_mutex_lock(&touch_mutex);
+            if(ctx == mt_ctx && touch_handler_registered(ctx, h) &&
+                (cap = touch_get_capture(ctx, ev->id, 1)) && cap->cnt < TOUCH_CAPTURE_MAX)
+            {
+                cap->handlers[cap->cnt++] = h;
+            }
+            pthread_mutex_unlock(&touch_mutex);
+        }
+
+        if(res == 0 && mode == HANDLERS_FIRST)
+            break;
+    }
+
+    pthread_mutex_lock(&touch_mutex);
+    if((ev->changed & TCHNG_REMOVED) && ctx == mt_ctx && (cap = touch_get_capture(ctx, ev->id, 0)))
+        cap->cnt = 0;
+
+    if(--mt_dispatching == 0)
+    {
+        removed = mt_removed;
+        removed_ctx = mt_removed_ctx;
+        mt_removed = NULL;
+        mt_removed_ctx = NULL;
+    }
+    pthread_mutex_unlock(&touch_mutex);
+
+    list_clear(&removed, &free);
+    list_clear(&removed_ctx, &touch_ctx_destroy);
+}
+
 void touch_commit_events(struct timeval ev_time)
 {
     pthread_mutex_lock(&touch_mutex);
-    int has_handlers = (mt_handlers != NULL);
+    int has_handlers = (mt_ctx != NULL && mt_ctx->handlers != NULL);
     pthread_mutex_unlock(&touch_mutex);
 
     if(!has_handlers)
         return;
 
     uint32_t i;
-    touch_handler *h;
-    handler_list_it *it;
 
     for(i = 0; i < ARRAY_SIZE(mt_events); ++i)
     {
@@ -243,72 +633,183 @@ void touch_commit_events(struct timeval ev_time)
         if(mt_events[i].changed & TCHNG_POS)
             mt_recalc_pos_rotation(&mt_events[i]);
 
-        it = mt_handlers;
-        while(it)
-        {
-            h = it->handler;
-            if((*h->callback)(&mt_events[i], h->data) == 0 && mt_handlers_mode == HANDLERS_FIRST)
-                break;
-            it = it->next;
-        }
+        touch_dispatch_event(&mt_events[i]);
 
         mt_events[i].changed = 0;
     }
 }
 
+void handle_input_event(struct input_device *dev, struct input_event *ev)
+{
+    switch(ev->type)
+    {
+        case EV_KEY:
+            handle_key_event(ev);
+            break;
+        case EV_ABS:
+            if(dev->is_touch)
+                handle_abs_event(dev, ev);
+            break;
+        case EV_SYN:
+            if(ev->code == SYN_REPORT)
+                ev_report_arrived(ev);
+            handle_syn_event(ev);
+            break;
+    }
+}
+
+// reads everything the device has queued, EV_READ_BATCH events at a time.
+// Returns -1 if the device is gone.
+static int ev_drain(int slot)
+{
+    struct input_device *dev = ev_devs[slot];
+    struct input_event evs[EV_READ_BATCH];
+    ssize_t r;
+    int i, cnt;
+
+    do
+    {
+        r = read(dev->fd, evs, sizeof(evs));
+        if(r < 0 && errno == EINTR)
+            continue;
+        if(r < 0 && errno == ENODEV)
+            return -1;
+        if(r < (ssize_t)sizeof(struct input_event))
+            break;
+
+        cnt = r / sizeof(struct input_event);
+        input_record_events(slot, evs, cnt);
+        for(i = 0; i < cnt; ++i)
+            handle_input_event(dev, &evs[i]);
+
+        pthread_mutex_lock(&stats_mutex);
+        input_stats.reads++;
+        input_stats.events += cnt;
+        pthread_mutex_unlock(&stats_mutex);
+    }
+    while(r == sizeof(evs));
+    return 0;
+}
+
 static void *input_thread_work(void *cookie)
 {
-    ev_init();
-    struct input_event ev;
+    struct epoll_event evs[MAX_DEVICES + 1];
+    int i, cnt;
 
     memset(mt_events, 0, sizeof(mt_events));
 
-    key_itr = 10;
+    pthread_mutex_lock(&key_mutex);
+    key_head = key_cnt = 0;
+    pthread_mutex_unlock(&key_mutex);
     mt_slot = 0;
 
-    int res;
+    if(input_replay_pending())
+    {
+        mt_screen_res[0] = fb->vi.xres;
+        mt_screen_res[1] = fb->vi.yres;
+        init_touch_specifics();
+        input_replay_run(ev_wake_fd, &input_run);
+        destroy_touch_specifics();
+
+        // real devices take over from here
+        memset(mt_events, 0, sizeof(mt_events));
+        mt_slot = 0;
+        if(!input_run)
+            return NULL;
+    }
+
+    if(ev_init() < 0)
+    {
+        ERROR("input: failed to init devices\n");
+        ev_exit();
+        return NULL;
+    }
+
+    // sleeps until a device or stop_input_thread() wakes it up
     while(input_run)
     {
-        while(ev_get(&ev, 1) == 0)
+        cnt = epoll_wait(ev_epoll_fd, evs, ARRAY_SIZE(evs), ev_wake_fd >= 0 ? -1 : 100);
+        if(cnt < 0 && errno != EINTR)
+        {
+            ERROR("input: epoll_wait failed: %s\n", strerror(errno));
+            break;
+        }
+
+        for(i = 0; i < cnt; ++i)
         {
-            switch(ev.type)
+            if(evs[i].data.u32 == EV_WAKE_ID)
+            {
+                uint64_t val;
+                read(ev_wake_fd, &val, sizeof(val));
+            }
+            else if(evs[i].data.u32 == EV_INOTIFY_ID)
+            {
+                ev_handle_inotify();
+            }
+            else if(evs[i].data.u32 < MAX_DEVICES && ev_devs[evs[i].data.u32])
             {
-                case EV_KEY:
-                    handle_key_event(&ev);
-                    break;
-                case EV_ABS:
-                    handle_abs_event(&ev);
-                    break;
-                case EV_SYN:
-                    handle_syn_event(&ev);
-                    break;
+                if(ev_drain(evs[i].data.u32) < 0)
+                    ev_remove_device(evs[i].data.u32);
             }
         }
-        usleep(10000);
     }
     ev_exit();
-    pthread_exit(NULL);
     return NULL;
 }
 
-int get_last_key(void)
+int input_pop_key(struct input_key *key, int timeout_ms)
 {
+    struct timespec deadline;
     int res = -1;
+
     pthread_mutex_lock(&key_mutex);
-    if(key_itr != 10)
-        res = key_queue[key_itr++];
+    if(key_cnt == 0 && timeout_ms > 0)
+    {
+        cond_deadline(&deadline, timeout_ms);
+
+        while(key_cnt == 0)
+            if(pthread_cond_timedwait(&key_cond, &key_mutex, &deadline) == ETIMEDOUT)
+                break;
+    }
+    else if(timeout_ms < 0)
+    {
+        while(key_cnt == 0)
+            pthread_cond_wait(&key_cond, &key_mutex);
+    }
+
+    if(key_cnt != 0)
+    {
+        if(key)
+            *key = key_queue[key_head];
+        res = key_queue[key_head].code;
+        key_head = (key_head + 1) % KEY_QUEUE_SIZE;
+        --key_cnt;
+    }
     pthread_mutex_unlock(&key_mutex);
     return res;
 }
 
+int get_last_key(void)
+{
+    return input_pop_key(NULL, 0);
+}
+
 int wait_for_key(void)
 {
-    int res = -1;
-    while(res == -1)
-    {
-        res = get_last_key();
-        usleep(10000);
-    }
+    return input_pop_key(NULL, -1);
+}
+
+int wait_for_key_timeout(int timeout_ms)
+{
+    return input_pop_key(NULL, timeout_ms);
+}
+
+uint32_t input_key_overflows(void)
+{
+    uint32_t res;
+    pthread_mutex_lock(&key_mutex);
+    res = key_overflows;
+    pthread_mutex_unlock(&key_mutex);
     return res;
 }
 
@@ -317,111 +818,246 @@ void start_input_thread(void)
     if(input_run)
         return;
 
+    // without eventfd, the thread wakes up every 100ms to check input_run
+    ev_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
     input_run = 1;
     pthread_create(&input_thread, NULL, input_thread_work, NULL);
 }
 
 void stop_input_thread(void)
 {
+    uint64_t one = 1;
+    struct input_stats st;
+
     if(!input_run)
         return;
     input_run = 0;
+    if(ev_wake_fd >= 0)
+        write(ev_wake_fd, &one, sizeof(one));
     pthread_join(input_thread, NULL);
+
+    if(ev_wake_fd >= 0)
+        close(ev_wake_fd);
+    ev_wake_fd = -1;
+
+    input_get_stats(&st);
+    ERROR("input: %u events in %u reads, %u reports, avg delay %u us, max %u us, %u keys dropped\n",
+            st.events, st.reads, st.reports,
+            st.reports ? (uint32_t)(st.total_delay_us / st.reports) : 0, st.max_delay_us,
+            input_key_overflows());
 }
 
-void add_touch_handler(touch_callback callback, void *data)
+void input_get_stats(struct input_stats *st)
+{
+    pthread_mutex_lock(&stats_mutex);
+    *st = input_stats;
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+int64_t input_last_report_us(void)
+{
+    int64_t res;
+    pthread_mutex_lock(&stats_mutex);
+    res = last_report_us;
+    pthread_mutex_unlock(&stats_mutex);
+    return res;
+}
+
+// expects locked touch_mutex
+static void touch_grid_insert(handlers_ctx *ctx, touch_handler *h)
+{
+    int c, r;
+
+    // the grid is sized when the first handler is added, positions outside of it
+    // are clamped to the edge cells, so the mapping stays consistent anyway
+    if(ctx->cell_w == 0)
+    {
+        ctx->cell_w = imax(1, DIV_ROUND_UP(fb_width, TOUCH_GRID_COLS));
+        ctx->cell_h = imax(1, DIV_ROUND_UP(fb_height, TOUCH_GRID_ROWS));
+    }
+
+    h->col[0] = imin(imax(h->x, 0) / ctx->cell_w, TOUCH_GRID_COLS-1);
+    // in_rect() includes the right and bottom edge
+    h->col[1] = imin(imax(h->x + h->w, 0) / ctx->cell_w, TOUCH_GRID_COLS-1);
+    h->row[0] = imin(imax(h->y, 0) / ctx->cell_h, TOUCH_GRID_ROWS-1);
+    h->row[1] = imin(imax(h->y + h->h, 0) / ctx->cell_h, TOUCH_GRID_ROWS-1);
+
+    for(r = h->row[0]; r <= h->row[1]; ++r)
+        for(c = h->col[0]; c <= h->col[1]; ++c)
+            list_add(h, &ctx->cells[r*TOUCH_GRID_COLS + c]);
+}
+
+// expects locked touch_mutex
+static void touch_grid_remove(handlers_ctx *ctx, touch_handler *h)
+{
+    int c, r;
+    for(r = h->row[0]; r <= h->row[1]; ++r)
+        for(c = h->col[0]; c <= h->col[1]; ++c)
+            list_rm_noreorder(h, &ctx->cells[r*TOUCH_GRID_COLS + c], NULL);
+}
+
+// expects locked touch_mutex
+static touch_handler *touch_find_handler(handlers_ctx *ctx, touch_callback callback, void *data)
 {
-    touch_handler *handler = malloc(sizeof(touch_handler));
+    int i;
+    for(i = 0; ctx && ctx->handlers && ctx->handlers[i]; ++i)
+        if(ctx->handlers[i]->callback == callback && ctx->handlers[i]->data == data)
+            return ctx->handlers[i];
+    return NULL;
+}
+
+static void add_touch_handler_impl(touch_callback callback, void *data, int has_rect,
+        int x, int y, int w, int h)
+{
+    touch_handler *handler = mzalloc(sizeof(touch_handler));
     handler->data = data;
     handler->callback = callback;
-
-    handler_list_it *new_it = malloc(sizeof(handler_list_it));
-    memset(new_it, 0, sizeof(handler_list_it));
-    new_it->handler = handler;
+    handler->has_rect = has_rect;
+    handler->x = x;
+    handler->y = y;
+    handler->w = w;
+    handler->h = h;
 
     pthread_mutex_lock(&touch_mutex);
 
-    handler_list_it **it = &mt_handlers;
-    while(*it)
-    {
-        if(!(*it)->next)
-            new_it->prev = *it;
+    if(!mt_ctx)
+        mt_ctx = touch_ctx_create();
 
-        it = &((*it)->next);
-    }
-    *it = new_it;
+    handler->seq = mt_handlers_seq++;
+    list_add(handler, &mt_ctx->handlers);
+    if(has_rect)
+        touch_grid_insert(mt_ctx, handler);
+    else
+        list_add(handler, &mt_ctx->global);
 
     pthread_mutex_unlock(&touch_mutex);
 }
 
+void add_touch_handler(touch_callback callback, void *data)
+{
+    add_touch_handler_impl(callback, data, 0, 0, 0, 0, 0);
+}
+
+void add_touch_handler_rect(touch_callback callback, void *data, int x, int y, int w, int h)
+{
+    add_touch_handler_impl(callback, data, 1, x, y, w, h);
+}
+
+void move_touch_handler(touch_callback callback, void *data, int x, int y, int w, int h)
+{
+    touch_handler *handler;
+
+    pthread_mutex_lock(&touch_mutex);
+    handler = touch_find_handler(mt_ctx, callback, data);
+    if(handler && handler->has_rect)
+    {
+        touch_grid_remove(mt_ctx, handler);
+        handler->x = x;
+        handler->y = y;
+        handler->w = w;
+        handler->h = h;
+        touch_grid_insert(mt_ctx, handler);
+    }
+    pthread_mutex_unlock(&touch_mutex);
+}
+
 void rm_touch_handler(touch_callback callback, void *data)
 {
+    touch_handler *handler;
+    struct touch_capture *cap;
+    int i, j;
+
     pthread_mutex_lock(&touch_mutex);
 
-    handler_list_it *it = mt_handlers;
-    while(it)
+    handler = touch_find_handler(mt_ctx, callback, data);
+    if(handler)
     {
-        if(it->handler->callback != callback || it->handler->data != data)
+        if(handler->has_rect)
+            touch_grid_remove(mt_ctx, handler);
+        else
+            list_rm_noreorder(handler, &mt_ctx->global, NULL);
+
+        for(i = 0; i < MAX_FINGERS; ++i)
         {
-            it = it->next;
-            continue;
+            cap = &mt_ctx->captures[i];
+            for(j = 0; j < cap->cnt; )
+            {
+                if(cap->handlers[j] == handler)
+                    cap->handlers[j] = cap->handlers[--cap->cnt];
+                else
+                    ++j;
+            }
         }
 
-        if(it->prev)
-            it->prev->next = it->next;
-        if(it->next)
-            it->next->prev = it->prev;
-
-        if(it == mt_handlers)
-            mt_handlers = it->next;
+        list_rm_noreorder(handler, &mt_ctx->handlers, NULL);
+        ++mt_handlers_gen;
 
-        free(it->handler);
-        free(it);
-        break;
+        if(mt_dispatching)
+        {
+            list_add(handler, &mt_removed);
+            handler = NULL;
+        }
     }
 
     pthread_mutex_unlock(&touch_mutex);
+
+    free(handler);
 }
 
 void set_touch_handlers_mode(int mode)
 {
-    mt_handlers_mode = mode;
+    pthread_mutex_lock(&touch_mutex);
+    if(!mt_ctx)
+        mt_ctx = touch_ctx_create();
+    mt_ctx->handlers_mode = mode;
+    pthread_mutex_unlock(&touch_mutex);
 }
 
 void input_push_context(void)
 {
-    handlers_ctx *ctx = malloc(sizeof(handlers_ctx));
-    memset(ctx, 0, sizeof(handlers_ctx));
+    handlers_ctx *ctx = touch_ctx_create();
 
     pthread_mutex_lock(&touch_mutex);
 
-    ctx->handlers_mode = mt_handlers_mode;
-    ctx->handlers = mt_handlers;
+    if(!mt_ctx)
+        mt_ctx = touch_ctx_create();
 
-    mt_handlers_mode = HANDLERS_FIRST;
-    mt_handlers = NULL;
+    list_add(mt_ctx, &inactive_ctx);
+    mt_ctx = ctx;
+    ++mt_handlers_gen;
 
     pthread_mutex_unlock(&touch_mutex);
-
-    list_add(ctx, &inactive_ctx);
 }
 
 void input_pop_context(void)
 {
+    handlers_ctx *old;
+
+    pthread_mutex_lock(&touch_mutex);
+
     if(!inactive_ctx)
+    {
+        pthread_mutex_unlock(&touch_mutex);
         return;
+    }
 
     int idx = list_item_count(inactive_ctx)-1;
-    handlers_ctx *ctx = inactive_ctx[idx];
-
-    pthread_mutex_lock(&touch_mutex);
+    old = mt_ctx;
+    mt_ctx = inactive_ctx[idx];
+    list_rm_noreorder(mt_ctx, &inactive_ctx, NULL);
+    ++mt_handlers_gen;
 
-    mt_handlers_mode = ctx->handlers_mode;
-    mt_handlers = ctx->handlers;
+    if(old && mt_dispatching)
+    {
+        list_add(old, &mt_removed_ctx);
+        old = NULL;
+    }
 
     pthread_mutex_unlock(&touch_mutex);
 
-    list_rm_noreorder(ctx, &inactive_ctx, &free);
+    if(old)
+        touch_ctx_destroy(old);
 }
 
 struct keyaction
@@ -569,9 +1205,10 @@ static void keyaction_call_cur_act(struct keyaction_ctx *c, int action)
     ERROR("keyaction_call_cur_act: current action not found in actions!\n");
 }
 
-static void keyaction_repeat_worker(uint32_t diff, void *data)
+static uint32_t keyaction_repeat_worker(uint32_t diff, void *data)
 {
     struct keyaction_ctx *c = data;
+    uint32_t next = WORKER_IDLE;
 
     pthread_mutex_lock(&c->lock);
     if(c->repeat != KEYACT_NONE)
@@ -583,8 +1220,13 @@ static void keyaction_repeat_worker(uint32_t diff, void *data)
         }
         else
             c->repeat_timer -= diff;
+
+        // the key might have been released during the call
+        if(c->repeat != KEYACT_NONE)
+            next = c->repeat_timer;
     }
     pthread_mutex_unlock(&c->lock);
+    return next;
 }
 
 int keyaction_handle_keyevent(int key, int press)
@@ -633,6 +1275,7 @@ int keyaction_handle_keyevent(int key, int press)
         {
             keyaction_ctx.repeat = act;
             keyaction_ctx.repeat_timer = REPEAT_TIME_FIRST;
+            workers_wake(&keyaction_repeat_worker, &keyaction_ctx);
         }
     }
 
@@ -643,16 +1286,21 @@ exit:
 
 void keyaction_enable(int enable)
 {
+    int changed;
+
     pthread_mutex_lock(&keyaction_ctx.lock);
-    if(enable != keyaction_ctx.enable)
-    {
-        keyaction_ctx.enable = enable;
-        if(enable)
-            workers_add(&keyaction_repeat_worker, &keyaction_ctx);
-        else
-            workers_remove(&keyaction_repeat_worker, &keyaction_ctx);
-    }
+    changed = (enable != keyaction_ctx.enable);
+    keyaction_ctx.enable = enable;
     pthread_mutex_unlock(&keyaction_ctx.lock);
+
+    // workers_remove() waits for a running call, which takes the lock
+    if(!changed)
+        return;
+
+    if(enable)
+        workers_add(&keyaction_repeat_worker, &keyaction_ctx);
+    else
+        workers_remove(&keyaction_repeat_worker, &keyaction_ctx);
 }
 
 void keyaction_set_destroy_msgbox_handle(int (*handler)(void))
@@ -19,6 +19,7 @@
 #define INPUT_H
 
 #include <sys/time.h>
+#include <stdint.h>
 
 #define KEY_VOLUMEUP 115
 #define KEY_VOLUMEDOWN 114
@@ -51,13 +52,50 @@ typedef struct
 
 typedef int (*touch_callback)(touch_event*, void*); // event, data
 
+struct input_key
+{
+    int code;
+    struct timeval pressed;     // kernel timestamps
+    struct timeval released;
+};
+
+struct input_stats
+{
+    uint32_t events;
+    uint32_t reads;             // read() calls which returned events
+    uint32_t reports;           // SYN_REPORTs
+    uint64_t total_delay_us;    // kernel timestamp -> read by input thread
+    uint32_t max_delay_us;
+};
+
 void start_input_thread(void);
 void stop_input_thread(void);
 
+void input_get_stats(struct input_stats *st);
+// CLOCK_MONOTONIC time when the last SYN_REPORT was read, in us
+int64_t input_last_report_us(void);
+
+// Keys are queued on release. These return the key code or -1.
+// timeout_ms < 0 waits forever, 0 does not wait at all
+int input_pop_key(struct input_key *key, int timeout_ms);
 int get_last_key(void);
 int wait_for_key(void);
-
+int wait_for_key_timeout(int timeout_ms);
+// keys dropped because nobody was reading them
+uint32_t input_key_overflows(void);
+
+// Record/replay raw evdev events, takes effect with the next
+// start_input_thread(). A replay runs before the real devices are opened,
+// speed_pct 100 keeps the recorded timing, 0 replays as fast as possible.
+void input_record_set(const char *path);
+void input_replay_set(const char *path, int speed_pct);
+int input_replay_done(void);
+
+// Handlers without a rect get every touch event. Handlers with a rect only
+// get new fingers inside it and then the fingers they returned 0 for.
 void add_touch_handler(touch_callback callback, void *data);
+void add_touch_handler_rect(touch_callback callback, void *data, int x, int y, int w, int h);
+void move_touch_handler(touch_callback callback, void *data, int x, int y, int w, int h);
 void rm_touch_handler(touch_callback callback, void *data);
 void set_touch_handlers_mode(int mode);
 
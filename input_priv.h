@@ -19,6 +19,7 @@
 #define INPUT_PRIV_H
 
 #include <sys/time.h>
+#include <stdint.h>
 #include "input.h"
 
 #define MAX_DEVICES 16
@@ -28,40 +29,70 @@
 extern int mt_screen_res[2];
 extern touch_event mt_events[MAX_FINGERS];
 extern int mt_slot;
-extern int mt_switch_xy;
-extern int mt_range_x[2];
-extern int mt_range_y[2];
+
+// one opened /dev/input/event*, ranges are already swapped if switch_xy
+struct input_device
+{
+    int fd;
+    char name[16];
+    int is_touch;
+    int switch_xy;
+    int range_x[2];
+    int range_y[2];
+};
+
+// touch handlers with a rect are indexed in a uniform grid over the screen
+#define TOUCH_GRID_COLS 8
+#define TOUCH_GRID_ROWS 16
+// handlers which can capture one finger
+#define TOUCH_CAPTURE_MAX 8
 
 typedef struct
 {
     void *data;
     touch_callback callback;
+    uint32_t seq;           // dispatch order, same as order of adding
+    int has_rect;
+    int x, y, w, h;
+    int col[2], row[2];     // grid cells the rect spans
 } touch_handler;
 
-struct handler_list_it
+// handlers which returned 0 to TCHNG_ADDED of finger `id`
+struct touch_capture
 {
-    touch_handler *handler;
-
-    struct handler_list_it *prev;
-    struct handler_list_it *next;
+    int id;
+    int cnt;
+    touch_handler *handlers[TOUCH_CAPTURE_MAX];
 };
 
-typedef struct handler_list_it handler_list_it;
-
 typedef struct
 {
     int handlers_mode;
-    handler_list_it *handlers;
+    touch_handler **handlers;   // all of them, list from util.h
+    touch_handler **global;     // no rect, get every event
+    touch_handler **cells[TOUCH_GRID_ROWS*TOUCH_GRID_COLS];
+    int cell_w, cell_h;
+    struct touch_capture captures[MAX_FINGERS];
 } handlers_ctx;
 
 void touch_commit_events(struct timeval ev_time);
+void handle_input_event(struct input_device *dev, struct input_event *ev);
 inline int calc_mt_pos(int val, int *range, int d_max);
 
 // Implemented in input_touch*.c files
-void handle_abs_event(struct input_event *ev);
+void handle_abs_event(struct input_device *dev, struct input_event *ev);
 void handle_syn_event(struct input_event *ev);
 void init_touch_specifics(void);
 void destroy_touch_specifics(void);
 
+// Implemented in input_record.c, called from the input thread
+int input_record_open(void);
+void input_record_close(void);
+void input_record_device(int slot, struct input_device *dev);
+void input_record_remove(int slot);
+void input_record_events(int slot, struct input_event *evs, int cnt);
+int input_replay_pending(void);
+void input_replay_run(int wake_fd, volatile int *run);
+
 
 #endif
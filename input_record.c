@@ -0,0 +1,330 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Records raw evdev events into a file and replays them through the same
+// handle_input_event() the input thread uses for real devices.
+//
+// File format (native endianness, tools/input_script.py writes it too):
+//   struct input_rec_header
+//   struct input_rec * N, INPUT_REC_DEVICE records are followed
+//                         by struct input_rec_device
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/poll.h>
+#include <sys/time.h>
+#include <linux/input.h>
+
+#include "input.h"
+#include "input_priv.h"
+#include "util.h"
+#include "log.h"
+
+#define INPUT_REC_MAGIC "MRIR"
+#define INPUT_REC_VERSION 1
+
+enum
+{
+    INPUT_REC_EVENT   = 0,
+    INPUT_REC_DEVICE  = 1,
+    INPUT_REC_REMOVE  = 2,
+};
+
+struct input_rec_header
+{
+    char magic[4];
+    uint32_t version;
+};
+
+struct input_rec
+{
+    uint32_t dt_us;     // since the previous event, from kernel timestamps
+    uint8_t kind;
+    uint8_t dev;        // slot of the device
+    uint16_t type;
+    uint16_t code;
+    uint16_t reserved;
+    int32_t value;
+};
+
+struct input_rec_device
+{
+    int32_t is_touch;
+    int32_t switch_xy;
+    int32_t range_x[2];
+    int32_t range_y[2];
+    char name[16];
+};
+
+static char *record_path = NULL;
+static FILE *record_file = NULL;
+static struct timeval record_last;
+static int record_has_last = 0;
+
+static char *replay_path = NULL;
+static int replay_speed = 100;
+static volatile int replay_done = 0;
+
+void input_record_set(const char *path)
+{
+    free(record_path);
+    record_path = path ? strdup(path) : NULL;
+}
+
+void input_replay_set(const char *path, int speed_pct)
+{
+    free(replay_path);
+    replay_path = path ? strdup(path) : NULL;
+    replay_speed = imax(speed_pct, 0);
+    replay_done = 0;
+}
+
+int input_replay_done(void)
+{
+    return replay_done;
+}
+
+int input_replay_pending(void)
+{
+    return replay_path != NULL && !replay_done;
+}
+
+static void record_write(struct input_rec *rec, const void *extra, size_t extra_len)
+{
+    if(fwrite(rec, sizeof(*rec), 1, record_file) != 1 ||
+        (extra_len && fwrite(extra, extra_len, 1, record_file) != 1))
+    {
+        ERROR("input: failed to write recording: %s\n", strerror(errno));
+        fclose(record_file);
+        record_file = NULL;
+    }
+}
+
+int input_record_open(void)
+{
+    struct input_rec_header hdr;
+
+    if(!record_path || record_file)
+        return 0;
+
+    record_file = fopen(record_path, "we");
+    if(!record_file)
+    {
+        ERROR("input: failed to open recording %s: %s\n", record_path, strerror(errno));
+        return -1;
+    }
+
+    memcpy(hdr.magic, INPUT_REC_MAGIC, sizeof(hdr.magic));
+    hdr.version = INPUT_REC_VERSION;
+    fwrite(&hdr, sizeof(hdr), 1, record_file);
+    record_has_last = 0;
+
+    INFO("input: recording into %s\n", record_path);
+    return 0;
+}
+
+void input_record_close(void)
+{
+    if(!record_file)
+        return;
+    fclose(record_file);
+    record_file = NULL;
+}
+
+void input_record_device(int slot, struct input_device *dev)
+{
+    struct input_rec rec;
+    struct input_rec_device info;
+
+    if(!record_file)
+        return;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.kind = INPUT_REC_DEVICE;
+    rec.dev = slot;
+
+    memset(&info, 0, sizeof(info));
+    info.is_touch = dev->is_touch;
+    info.switch_xy = dev->switch_xy;
+    memcpy(info.range_x, dev->range_x, sizeof(info.range_x));
+    memcpy(info.range_y, dev->range_y, sizeof(info.range_y));
+    memcpy(info.name, dev->name, sizeof(info.name));
+
+    record_write(&rec, &info, sizeof(info));
+}
+
+void input_record_remove(int slot)
+{
+    struct input_rec rec;
+
+    if(!record_file)
+        return;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.kind = INPUT_REC_REMOVE;
+    rec.dev = slot;
+    record_write(&rec, NULL, 0);
+}
+
+void input_record_events(int slot, struct input_event *evs, int cnt)
+{
+    struct input_rec rec;
+    int64_t dt;
+    int i;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.kind = INPUT_REC_EVENT;
+    rec.dev = slot;
+
+    for(i = 0; i < cnt && record_file; ++i)
+    {
+        dt = 0;
+        if(record_has_last)
+        {
+            dt = ((int64_t)(evs[i].time.tv_sec - record_last.tv_sec))*1000000 +
+                    (evs[i].time.tv_usec - record_last.tv_usec);
+            dt = dt < 0 ? 0 : dt;
+            dt = dt > UINT32_MAX ? UINT32_MAX : dt;
+        }
+        record_last = evs[i].time;
+        record_has_last = 1;
+
+        rec.dt_us = dt;
+        rec.type = evs[i].type;
+        rec.code = evs[i].code;
+        rec.value = evs[i].value;
+        record_write(&rec, NULL, 0);
+    }
+}
+
+// returns -1 if stop_input_thread() was called meanwhile
+static int replay_sleep_until(int64_t due, int wake_fd, volatile int *run)
+{
+    struct pollfd pfd;
+    int64_t now;
+
+    pfd.fd = wake_fd;
+    pfd.events = POLLIN;
+
+    while(*run && (now = get_mono_us()) < due)
+    {
+        if(wake_fd >= 0)
+            poll(&pfd, 1, (due - now + 999)/1000);
+        else
+            usleep(due - now);
+    }
+    return *run ? 0 : -1;
+}
+
+// Runs in the input thread instead of reading the real devices. Events get
+// timestamps with the recorded spacing, regardless of the replay speed,
+// so that the touch code sees the same session every time.
+void input_replay_run(int wake_fd, volatile int *run)
+{
+    struct input_device *devs[MAX_DEVICES];
+    struct input_rec_header hdr;
+    struct input_rec_device info;
+    struct input_rec rec;
+    struct input_event ev;
+    struct timeval base;
+    int64_t start, t = 0;
+    uint32_t events = 0;
+    int i;
+    FILE *f;
+
+    memset(devs, 0, sizeof(devs));
+
+    f = fopen(replay_path, "re");
+    if(!f)
+    {
+        ERROR("input: failed to open replay %s: %s\n", replay_path, strerror(errno));
+        goto exit;
+    }
+
+    if(fread(&hdr, sizeof(hdr), 1, f) != 1 || memcmp(hdr.magic, INPUT_REC_MAGIC, sizeof(hdr.magic)) ||
+        hdr.version != INPUT_REC_VERSION)
+    {
+        ERROR("input: %s is not an input recording\n", replay_path);
+        goto exit;
+    }
+
+    INFO("input: replaying %s at %d%% speed\n", replay_path, replay_speed);
+
+    gettimeofday(&base, NULL);
+    start = get_mono_us();
+
+    while(*run && fread(&rec, sizeof(rec), 1, f) == 1)
+    {
+        t += rec.dt_us;
+
+        if(rec.dev >= MAX_DEVICES)
+        {
+            ERROR("input: bad device %u in replay\n", rec.dev);
+            break;
+        }
+
+        switch(rec.kind)
+        {
+            case INPUT_REC_DEVICE:
+                if(fread(&info, sizeof(info), 1, f) != 1)
+                    goto done;
+                if(!devs[rec.dev])
+                    devs[rec.dev] = mzalloc(sizeof(struct input_device));
+                devs[rec.dev]->fd = -1;
+                devs[rec.dev]->is_touch = info.is_touch;
+                devs[rec.dev]->switch_xy = info.switch_xy;
+                memcpy(devs[rec.dev]->range_x, info.range_x, sizeof(info.range_x));
+                memcpy(devs[rec.dev]->range_y, info.range_y, sizeof(info.range_y));
+                memcpy(devs[rec.dev]->name, info.name, sizeof(info.name));
+                devs[rec.dev]->name[sizeof(info.name)-1] = 0;
+                break;
+            case INPUT_REC_REMOVE:
+                free(devs[rec.dev]);
+                devs[rec.dev] = NULL;
+                break;
+            case INPUT_REC_EVENT:
+                if(!devs[rec.dev])
+                    break;
+
+                if(replay_speed != 0 && replay_sleep_until(start + t*100/replay_speed, wake_fd, run) < 0)
+                    goto done;
+
+                ev.time.tv_sec = base.tv_sec + (base.tv_usec + t) / 1000000;
+                ev.time.tv_usec = (base.tv_usec + t) % 1000000;
+                ev.type = rec.type;
+                ev.code = rec.code;
+                ev.value = rec.value;
+                handle_input_event(devs[rec.dev], &ev);
+                ++events;
+                break;
+        }
+    }
+
+done:
+    INFO("input: replayed %u events in %u ms, recorded session took %u ms\n",
+            events, (uint32_t)((get_mono_us() - start)/1000), (uint32_t)(t/1000));
+exit:
+    for(i = 0; i < MAX_DEVICES; ++i)
+        free(devs[i]);
+    if(f)
+        fclose(f);
+    replay_done = 1;
+}
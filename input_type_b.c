@@ -33,7 +33,7 @@ void destroy_touch_specifics(void)
 
 }
 
-void handle_abs_event(struct input_event *ev)
+void handle_abs_event(struct input_device *dev, struct input_event *ev)
 {
     switch(ev->code)
     {
@@ -55,14 +55,14 @@ void handle_abs_event(struct input_event *ev)
         case ABS_MT_POSITION_X:
         case ABS_MT_POSITION_Y:
         {
-            if((ev->code == ABS_MT_POSITION_X) ^ (mt_switch_xy != 0))
+            if((ev->code == ABS_MT_POSITION_X) ^ (dev->switch_xy != 0))
             {
-                mt_events[mt_slot].orig_x = calc_mt_pos(ev->value, mt_range_x, mt_screen_res[0]);
-                if(mt_switch_xy)
+                mt_events[mt_slot].orig_x = calc_mt_pos(ev->value, dev->range_x, mt_screen_res[0]);
+                if(dev->switch_xy)
                     mt_events[mt_slot].orig_x = mt_screen_res[0] - mt_events[mt_slot].orig_x;
             }
             else
-                mt_events[mt_slot].orig_y = calc_mt_pos(ev->value, mt_range_y, mt_screen_res[1]);
+                mt_events[mt_slot].orig_y = calc_mt_pos(ev->value, dev->range_y, mt_screen_res[1]);
 
             mt_events[mt_slot].changed |= TCHNG_POS;
             break;
@@ -0,0 +1,658 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "jobs.h"
+#include "util.h"
+#include "log.h"
+
+enum
+{
+    JOB_QUEUED,
+    JOB_RUNNING,
+    JOB_DONE,
+};
+
+struct job
+{
+    job_call call;
+    void *data;
+    job_done_call done;
+    int prio;
+    volatile int cancel;
+
+    // protected by jobs.mutex
+    int state;
+    int res;
+    int refs;
+    struct job *next_done;
+};
+
+// ring buffer, the owner takes from the tail, thieves from the head
+struct job_queue
+{
+    struct job **items;
+    int head;
+    int cnt;
+    int alloc;
+};
+
+struct jobs_thread
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    struct job_queue queues[JOB_PRIO_CNT];
+    struct job *running;
+    int started;
+    pid_t tid;
+    uint32_t executed;
+    uint32_t stolen;
+};
+
+struct jobs_pool
+{
+    struct jobs_thread *threads;
+    int threads_cnt;
+    volatile int run;
+    unsigned int next_thread;
+
+    // guards pending, job states and the completions
+    pthread_mutex_t mutex;
+    pthread_cond_t idle_cond;
+    pthread_cond_t done_cond;
+    pthread_cond_t compl_cond;
+    int pending;
+    struct job *compl_head;
+    struct job *compl_tail;
+};
+
+static struct jobs_pool jobs = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .idle_cond = PTHREAD_COND_INITIALIZER,
+    .done_cond = PTHREAD_COND_INITIALIZER,
+    .compl_cond = PTHREAD_COND_INITIALIZER,
+    .run = 0,
+};
+
+static void queue_push(struct job_queue *q, struct job *j)
+{
+    int i;
+    if(q->cnt == q->alloc)
+    {
+        int alloc = imax(16, q->alloc*2);
+        struct job **items = malloc(alloc*sizeof(struct job*));
+        for(i = 0; i < q->cnt; ++i)
+            items[i] = q->items[(q->head + i) % q->alloc];
+        free(q->items);
+        q->items = items;
+        q->alloc = alloc;
+        q->head = 0;
+    }
+    q->items[(q->head + q->cnt++) % q->alloc] = j;
+}
+
+static struct job *queue_pop_tail(struct job_queue *q)
+{
+    if(q->cnt == 0)
+        return NULL;
+    return q->items[(q->head + --q->cnt) % q->alloc];
+}
+
+static struct job *queue_pop_head(struct job_queue *q)
+{
+    struct job *j;
+    if(q->cnt == 0)
+        return NULL;
+    j = q->items[q->head];
+    q->head = (q->head + 1) % q->alloc;
+    --q->cnt;
+    return j;
+}
+
+static int queue_remove(struct job_queue *q, struct job *j)
+{
+    int i;
+    for(i = 0; i < q->cnt; ++i)
+    {
+        if(q->items[(q->head + i) % q->alloc] != j)
+            continue;
+
+        for(; i < q->cnt-1; ++i)
+            q->items[(q->head + i) % q->alloc] = q->items[(q->head + i + 1) % q->alloc];
+        --q->cnt;
+        return 1;
+    }
+    return 0;
+}
+
+// returns index of the calling thread in the pool or -1
+static int jobs_self(void)
+{
+    int i;
+    pthread_t self = pthread_self();
+    for(i = 0; i < jobs.threads_cnt; ++i)
+        if(jobs.threads[i].started && pthread_equal(self, jobs.threads[i].thread))
+            return i;
+    return -1;
+}
+
+static void job_put(struct job *j)
+{
+    if(__sync_sub_and_fetch(&j->refs, 1) == 0)
+        free(j);
+}
+
+static void job_finish(struct job *j, int res)
+{
+    pthread_mutex_lock(&jobs.mutex);
+    j->state = JOB_DONE;
+    j->res = res;
+    pthread_cond_broadcast(&jobs.done_cond);
+
+    if(j->done)
+    {
+        __sync_fetch_and_add(&j->refs, 1);
+        j->next_done = NULL;
+        if(jobs.compl_tail)
+            jobs.compl_tail->next_done = j;
+        else
+            jobs.compl_head = j;
+        jobs.compl_tail = j;
+        pthread_cond_signal(&jobs.compl_cond);
+    }
+    pthread_mutex_unlock(&jobs.mutex);
+
+    // the pool's reference
+    job_put(j);
+}
+
+// Own queue first, then steal from the others, higher priorities first.
+static struct job *jobs_take(int self)
+{
+    struct jobs_thread *t;
+    struct job *j = NULL;
+    int prio, i, idx;
+
+    for(prio = 0; prio < JOB_PRIO_CNT && !j; ++prio)
+    {
+        if(self >= 0)
+        {
+            t = &jobs.threads[self];
+            pthread_mutex_lock(&t->lock);
+            j = queue_pop_tail(&t->queues[prio]);
+            pthread_mutex_unlock(&t->lock);
+        }
+
+        for(i = 1; i <= jobs.threads_cnt && !j; ++i)
+        {
+            idx = (self + i) % jobs.threads_cnt;
+            if(idx == self || idx < 0)
+                continue;
+
+            t = &jobs.threads[idx];
+            pthread_mutex_lock(&t->lock);
+            j = queue_pop_head(&t->queues[prio]);
+            pthread_mutex_unlock(&t->lock);
+
+            if(j && self >= 0)
+                ++jobs.threads[self].stolen;
+        }
+    }
+
+    if(j)
+    {
+        pthread_mutex_lock(&jobs.mutex);
+        --jobs.pending;
+        j->state = JOB_RUNNING;
+        pthread_mutex_unlock(&jobs.mutex);
+    }
+    return j;
+}
+
+static void jobs_run_one(struct jobs_thread *t, struct job *j)
+{
+    struct job *prev;
+    int res;
+
+    if(j->cancel)
+    {
+        job_finish(j, JOB_CANCELLED);
+        return;
+    }
+
+    // job_wait() inside a job runs other jobs in the same thread
+    pthread_mutex_lock(&t->lock);
+    prev = t->running;
+    t->running = j;
+    pthread_mutex_unlock(&t->lock);
+
+    if(j->prio == JOB_PRIO_LOW)
+        setpriority(PRIO_PROCESS, t->tid, JOBS_LOW_NICE);
+
+    res = j->call(j->data, &j->cancel);
+
+    if(j->prio == JOB_PRIO_LOW)
+        setpriority(PRIO_PROCESS, t->tid, (prev && prev->prio == JOB_PRIO_LOW) ? JOBS_LOW_NICE : 0);
+
+    pthread_mutex_lock(&t->lock);
+    t->running = prev;
+    ++t->executed;
+    pthread_mutex_unlock(&t->lock);
+
+    job_finish(j, res);
+}
+
+static void *jobs_thread_work(void *data)
+{
+    struct jobs_thread *t = data;
+    const int self = t - jobs.threads;
+    struct job *j;
+
+    t->tid = gettid();
+
+    while(jobs.run)
+    {
+        j = jobs_take(self);
+        if(j)
+        {
+            jobs_run_one(t, j);
+            continue;
+        }
+
+        pthread_mutex_lock(&jobs.mutex);
+        while(jobs.run && jobs.pending <= 0)
+            pthread_cond_wait(&jobs.idle_cond, &jobs.mutex);
+        pthread_mutex_unlock(&jobs.mutex);
+    }
+    return NULL;
+}
+
+void jobs_start(int threads)
+{
+    int i, started;
+
+    if(jobs.run)
+        return;
+
+    if(threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = imax(1, imin(threads, JOBS_MAX_THREADS));
+
+    jobs.threads = mzalloc(threads*sizeof(struct jobs_thread));
+    jobs.threads_cnt = threads;
+    jobs.pending = 0;
+    jobs.run = 1;
+
+    // threads steal from each other right away
+    for(i = 0; i < threads; ++i)
+        pthread_mutex_init(&jobs.threads[i].lock, NULL);
+
+    // queues of threads which failed to start are emptied by the others
+    for(i = 0, started = 0; i < threads; ++i)
+    {
+        jobs.threads[i].started = (pthread_create(&jobs.threads[i].thread, NULL,
+                jobs_thread_work, &jobs.threads[i]) == 0);
+        if(jobs.threads[i].started)
+            ++started;
+        else
+            ERROR("jobs: failed to create thread %d\n", i);
+    }
+
+    if(started == 0)
+    {
+        jobs.run = 0;
+        for(i = 0; i < threads; ++i)
+            pthread_mutex_destroy(&jobs.threads[i].lock);
+        free(jobs.threads);
+        jobs.threads = NULL;
+        jobs.threads_cnt = 0;
+        return;
+    }
+    INFO("jobs: started %d threads\n", started);
+}
+
+void jobs_stop(void)
+{
+    struct jobs_thread *t;
+    struct job *j;
+    int i, prio;
+
+    if(!jobs.run)
+        return;
+
+    pthread_mutex_lock(&jobs.mutex);
+    jobs.run = 0;
+    pthread_cond_broadcast(&jobs.idle_cond);
+    pthread_mutex_unlock(&jobs.mutex);
+
+    for(i = 0; i < jobs.threads_cnt; ++i)
+    {
+        t = &jobs.threads[i];
+        pthread_mutex_lock(&t->lock);
+        if(t->running)
+            t->running->cancel = 1;
+        pthread_mutex_unlock(&t->lock);
+    }
+
+    for(i = 0; i < jobs.threads_cnt; ++i)
+        if(jobs.threads[i].started)
+            pthread_join(jobs.threads[i].thread, NULL);
+
+    for(i = 0; i < jobs.threads_cnt; ++i)
+    {
+        t = &jobs.threads[i];
+        for(prio = 0; prio < JOB_PRIO_CNT; ++prio)
+        {
+            while((j = queue_pop_head(&t->queues[prio])))
+                job_finish(j, JOB_CANCELLED);
+            free(t->queues[prio].items);
+        }
+        pthread_mutex_destroy(&t->lock);
+        INFO("jobs: thread %d ran %u jobs, %u stolen\n", i, t->executed, t->stolen);
+    }
+
+    // nobody is going to run these anymore
+    pthread_mutex_lock(&jobs.mutex);
+    while((j = jobs.compl_head))
+    {
+        jobs.compl_head = j->next_done;
+        job_put(j);
+    }
+    jobs.compl_tail = NULL;
+    pthread_mutex_unlock(&jobs.mutex);
+
+    free(jobs.threads);
+    jobs.threads = NULL;
+    jobs.threads_cnt = 0;
+}
+
+int jobs_thread_count(void)
+{
+    return jobs.run ? jobs.threads_cnt : 0;
+}
+
+struct job *job_submit(job_call call, void *data, int prio, job_done_call done)
+{
+    struct jobs_thread *t;
+    struct job *j;
+    int self;
+
+    if(!jobs.run)
+        return NULL;
+
+    j = mzalloc(sizeof(struct job));
+    j->call = call;
+    j->data = data;
+    j->done = done;
+    j->prio = imax(0, imin(prio, JOB_PRIO_CNT-1));
+    j->state = JOB_QUEUED;
+    j->refs = 2; // the pool and the caller
+
+    // jobs spawned by jobs stay on the same thread unless stolen
+    self = jobs_self();
+    if(self < 0)
+        self = __sync_fetch_and_add(&jobs.next_thread, 1) % jobs.threads_cnt;
+
+    t = &jobs.threads[self];
+    pthread_mutex_lock(&t->lock);
+    queue_push(&t->queues[j->prio], j);
+    pthread_mutex_unlock(&t->lock);
+
+    pthread_mutex_lock(&jobs.mutex);
+    ++jobs.pending;
+    pthread_cond_signal(&jobs.idle_cond);
+    pthread_mutex_unlock(&jobs.mutex);
+    return j;
+}
+
+int job_wait(struct job *job)
+{
+    struct job *j;
+    int self = jobs_self();
+    int res;
+
+    pthread_mutex_lock(&jobs.mutex);
+    while(job->state != JOB_DONE)
+    {
+        // a pool thread must not just sleep, the job might be in its queue
+        if(self >= 0)
+        {
+            pthread_mutex_unlock(&jobs.mutex);
+            j = jobs_take(self);
+            if(j)
+                jobs_run_one(&jobs.threads[self], j);
+            pthread_mutex_lock(&jobs.mutex);
+            if(j)
+                continue;
+            if(job->state == JOB_DONE)
+                break;
+        }
+        pthread_cond_wait(&jobs.done_cond, &jobs.mutex);
+    }
+    res = job->res;
+    pthread_mutex_unlock(&jobs.mutex);
+    return res;
+}
+
+void job_cancel(struct job *job)
+{
+    struct jobs_thread *t;
+    int i, queued, removed = 0;
+
+    job->cancel = 1;
+
+    pthread_mutex_lock(&jobs.mutex);
+    queued = (job->state == JOB_QUEUED);
+    pthread_mutex_unlock(&jobs.mutex);
+
+    for(i = 0; queued && i < jobs.threads_cnt && !removed; ++i)
+    {
+        t = &jobs.threads[i];
+        pthread_mutex_lock(&t->lock);
+        removed = queue_remove(&t->queues[job->prio], job);
+        pthread_mutex_unlock(&t->lock);
+    }
+
+    if(removed)
+    {
+        pthread_mutex_lock(&jobs.mutex);
+        --jobs.pending;
+        pthread_mutex_unlock(&jobs.mutex);
+        job_finish(job, JOB_CANCELLED);
+    }
+}
+
+void job_release(struct job *job)
+{
+    if(job)
+        job_put(job);
+}
+
+int jobs_run_completions(int timeout_ms)
+{
+    struct timespec deadline;
+    struct job *list, *j;
+    int cnt = 0;
+
+    pthread_mutex_lock(&jobs.mutex);
+    if(!jobs.compl_head && timeout_ms > 0)
+    {
+        cond_deadline(&deadline, timeout_ms);
+        pthread_cond_timedwait(&jobs.compl_cond, &jobs.mutex, &deadline);
+    }
+    list = jobs.compl_head;
+    jobs.compl_head = jobs.compl_tail = NULL;
+    pthread_mutex_unlock(&jobs.mutex);
+
+    while((j = list))
+    {
+        list = j->next_done;
+        j->done(j, j->res, j->data);
+        job_put(j);
+        ++cnt;
+    }
+    return cnt;
+}
+
+/*
+ * Stress test and benchmark of the pool, run by "multirom -jobs-bench".
+ */
+#define BENCH_FANOUT 64
+
+struct bench_ctx
+{
+    volatile uint32_t sum;
+    volatile uint32_t done_calls;
+    volatile uint32_t cancel_seen;
+    int spin_us;
+};
+
+static int bench_job(void *data, volatile int *cancel)
+{
+    struct bench_ctx *c = data;
+    uint64_t end = get_mono_us() + c->spin_us;
+
+    while(c->spin_us && get_mono_us() < end)
+    {
+        if(*cancel)
+        {
+            __sync_fetch_and_add(&c->cancel_seen, 1);
+            return JOB_CANCELLED;
+        }
+    }
+    __sync_fetch_and_add(&c->sum, 1);
+    return 0;
+}
+
+static void bench_done(struct job *job, int res, void *data)
+{
+    struct bench_ctx *c = data;
+    ++c->done_calls;
+}
+
+static int bench_fanout(void *data, volatile int *cancel)
+{
+    struct job *children[BENCH_FANOUT];
+    int i, res = 0;
+
+    for(i = 0; i < BENCH_FANOUT; ++i)
+        children[i] = job_submit(bench_job, data, JOB_PRIO_NORMAL, NULL);
+
+    for(i = 0; i < BENCH_FANOUT; ++i)
+    {
+        // the pool is being stopped
+        if(!children[i])
+            res |= bench_job(data, cancel);
+        else if(job_wait(children[i]) != 0)
+            res = -1;
+        job_release(children[i]);
+    }
+    return res;
+}
+
+static int bench_check(const char *name, int ok, uint64_t start_us, int cnt)
+{
+    uint64_t us = get_mono_us() - start_us + 1;
+    printf("%-12s %6d jobs %8llu us %10llu jobs/s  %s\n", name, cnt,
+            (unsigned long long)us, (unsigned long long)cnt*1000000/us, ok ? "ok" : "FAILED");
+    return ok ? 0 : -1;
+}
+
+int jobs_bench(int threads, int cnt)
+{
+    struct bench_ctx c;
+    struct job **handles;
+    uint64_t start;
+    int i, res = 0, cancelled, fanouts;
+
+    if(jobs.run)
+        return -1;
+
+    cnt = imax(BENCH_FANOUT, cnt);
+    handles = malloc(cnt*sizeof(struct job*));
+
+    jobs_start(threads);
+    printf("jobs: %d threads, %ld CPUs online\n", jobs_thread_count(), sysconf(_SC_NPROCESSORS_ONLN));
+
+    // submit/wait overhead of empty jobs
+    memset(&c, 0, sizeof(c));
+    start = get_mono_us();
+    for(i = 0; i < cnt; ++i)
+        handles[i] = job_submit(bench_job, &c, i % JOB_PRIO_CNT, NULL);
+    for(i = 0; i < cnt; ++i)
+    {
+        job_wait(handles[i]);
+        job_release(handles[i]);
+    }
+    res |= bench_check("empty", c.sum == (uint32_t)cnt, start, cnt);
+
+    // jobs spawning and waiting for jobs, exercises stealing
+    memset(&c, 0, sizeof(c));
+    c.spin_us = 50;
+    fanouts = cnt / BENCH_FANOUT;
+    start = get_mono_us();
+    for(i = 0; i < fanouts; ++i)
+        handles[i] = job_submit(bench_fanout, &c, JOB_PRIO_NORMAL, NULL);
+    for(i = 0; i < fanouts; ++i)
+    {
+        if(job_wait(handles[i]) != 0)
+            c.sum = 0;
+        job_release(handles[i]);
+    }
+    res |= bench_check("fanout 50us", c.sum == (uint32_t)(fanouts*BENCH_FANOUT), start, fanouts*BENCH_FANOUT);
+
+    // cancel every other job while they are queued or running, the first
+    // ones might finish before that
+    memset(&c, 0, sizeof(c));
+    c.spin_us = 200;
+    cancelled = 0;
+    start = get_mono_us();
+    for(i = 0; i < cnt; ++i)
+        handles[i] = job_submit(bench_job, &c, JOB_PRIO_LOW, NULL);
+    for(i = 0; i < cnt; i += 2)
+        job_cancel(handles[i]);
+    for(i = 0; i < cnt; ++i)
+    {
+        if(job_wait(handles[i]) == JOB_CANCELLED)
+            ++cancelled;
+        job_release(handles[i]);
+    }
+    res |= bench_check("cancel", c.sum + cancelled == (uint32_t)cnt, start, cnt);
+    printf("             %d cancelled, %u noticed while running\n", cancelled, c.cancel_seen);
+
+    // completion callbacks, fire and forget
+    memset(&c, 0, sizeof(c));
+    start = get_mono_us();
+    for(i = 0; i < cnt; ++i)
+        job_release(job_submit(bench_job, &c, JOB_PRIO_HIGH, bench_done));
+    while(c.done_calls < (uint32_t)cnt)
+        if(jobs_run_completions(1000) == 0)
+            break;
+    res |= bench_check("completions", c.done_calls == (uint32_t)cnt, start, cnt);
+
+    jobs_stop();
+    free(handles);
+    return res;
+}
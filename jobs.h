@@ -0,0 +1,76 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef JOBS_H
+#define JOBS_H
+
+/*
+ * Pool of background threads for one-off jobs (scans, log copying...).
+ * Every thread has its own queue and idle threads steal from the others.
+ * The animation loops belong to workers.h, not here.
+ */
+
+#define JOBS_MAX_THREADS 8
+// niceness of a thread while it runs a JOB_PRIO_LOW job
+#define JOBS_LOW_NICE 10
+// result of a job which was cancelled before it started
+#define JOB_CANCELLED -125
+
+enum
+{
+    JOB_PRIO_HIGH    = 0,
+    JOB_PRIO_NORMAL  = 1,
+    JOB_PRIO_LOW     = 2,
+
+    JOB_PRIO_CNT
+};
+
+struct job;
+
+// long jobs should check *cancel and return early when it is set
+typedef int (*job_call)(void *data, volatile int *cancel);
+// called from jobs_run_completions(), that is the UI loop
+typedef void (*job_done_call)(struct job *job, int res, void *data);
+
+// threads = 0 means one per online CPU
+void jobs_start(int threads);
+// cancels queued jobs and drops pending completion callbacks
+void jobs_stop(void);
+int jobs_thread_count(void);
+
+/*
+ * Queues a job. The returned handle has to be released by job_release(),
+ * release it right away if you don't need it. Returns NULL if the pool
+ * isn't running, run the call directly in that case.
+ */
+struct job *job_submit(job_call call, void *data, int prio, job_done_call done);
+// returns the call's result, or JOB_CANCELLED
+int job_wait(struct job *job);
+// a queued job is dropped, a running one gets *cancel set
+void job_cancel(struct job *job);
+void job_release(struct job *job);
+
+/*
+ * Runs the done callbacks of finished jobs, waiting up to timeout_ms
+ * for the first one. Returns the number of callbacks called.
+ */
+int jobs_run_completions(int timeout_ms);
+
+// stress test and benchmark, prints the results to stdout
+int jobs_bench(int threads, int jobs);
+
+#endif
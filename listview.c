@@ -16,6 +16,8 @@
  */
 
 #include <stdlib.h>
+#include <pthread.h>
+#include <math.h>
 
 #include "listview.h"
 #include "framebuffer.h"
@@ -33,23 +35,76 @@
 #define SCROLL_DIST (20*DPI_MUL)
 #define OVERSCROLL_H (130*DPI_MUL)
 #define OVERSCROLL_MARK_H (4*DPI_MUL)
-#define OVERSCROLL_RETURN_SPD (15*DPI_MUL)
+// fling velocity decays as e^(-t/FLING_TAU_MS)
+#define FLING_TAU_MS 325
+#define FLING_MIN_V (250*DPI_MUL)
+#define FLING_MAX_V (6000*DPI_MUL)
+#define FLING_STOP_V (15*DPI_MUL)
+// finger which stopped this long before release does not fling
+#define FLING_STALE_US 80000
+// angular frequency of the critically damped overscroll spring, 1/s
+#define SPRING_W 14.f
+// longer frames are integrated as this, so a stall does not jump the list
+#define ANIM_MAX_STEP_MS 50
+
+static inline int64_t get_us_diff(struct timeval now, struct timeval prev)
+{
+    return ((int64_t)(now.tv_sec - prev.tv_sec))*1000000+
+        (now.tv_usec - prev.tv_usec);
+}
 
-static void listview_bounceback(uint32_t diff, void *data)
+static void listview_update_overscroll(listview *v)
 {
-    listview *v = (listview*)data;
     const int max = v->fullH - v->h;
+    listview_update_overscroll_mark(v, 0, v->pos < 0 ? -v->pos : 0);
+    listview_update_overscroll_mark(v, 1, v->pos > max ? v->pos - max : 0);
+}
 
+// Both the fling and the spring are solved exactly for the elapsed time,
+// so they move the same at any frame rate. Goes idle once the list settles,
+// listview_touch_handler() wakes it up again.
+static uint32_t listview_animate(uint32_t diff, void *data)
+{
+    listview *v = (listview*)data;
+    const int max = v->fullH - v->h;
+    const float t = imin(diff, ANIM_MAX_STEP_MS) / 1000.f;
+    float x, b, decay, target;
     int step;
-    if(v->pos < 0)
+
+    if(v->touch.id != -1)
+    {
+        v->scroll_v = 0;
+        listview_update_overscroll(v);
+        return WORKER_IDLE;
+    }
+
+    // dragged or scrolled by keys since the last tick
+    if(fabsf(v->scroll_pos - v->pos) >= 1.f)
+        v->scroll_pos = v->pos;
+
+    if(v->pos < 0 || v->pos > max)
     {
-        step = imin(-v->pos, OVERSCROLL_RETURN_SPD);
-        listview_update_overscroll_mark(v, 0, -(v->pos+step));
+        target = v->pos < 0 ? 0 : max;
+        x = v->scroll_pos - target;
+        b = v->scroll_v + SPRING_W*x;
+        decay = expf(-SPRING_W*t);
+        v->scroll_pos = target + (x + b*t)*decay;
+        v->scroll_v = (v->scroll_v - SPRING_W*b*t)*decay;
+
+        if(fabsf(v->scroll_pos - target) < 0.5f && fabsf(v->scroll_v) < FLING_STOP_V)
+        {
+            v->scroll_pos = target;
+            v->scroll_v = 0;
+        }
     }
-    else if(v->pos > max)
+    else if(v->scroll_v != 0)
     {
-        step = -imin(v->pos-max, OVERSCROLL_RETURN_SPD);
-        listview_update_overscroll_mark(v, 1, (v->pos - max + step));
+        decay = expf(-t*1000.f/FLING_TAU_MS);
+        v->scroll_pos += v->scroll_v*(FLING_TAU_MS/1000.f)*(1.f - decay);
+        v->scroll_v *= decay;
+
+        if(fabsf(v->scroll_v) < FLING_STOP_V)
+            v->scroll_v = 0;
     }
     else
     {
@@ -57,11 +112,23 @@ static void listview_bounceback(uint32_t diff, void *data)
             v->overscroll_marks[0]->w = 0;
         if(v->overscroll_marks[1]->w != 0)
             v->overscroll_marks[1]->w = 0;
-        return;
+        return WORKER_IDLE;
     }
 
-    if(v->touch.id == -1)
+    step = lroundf(v->scroll_pos) - v->pos;
+    if(step != 0)
+    {
         listview_scroll_by(v, step);
+
+        // hit the overscroll limit
+        if(v->pos != lroundf(v->scroll_pos))
+        {
+            v->scroll_pos = v->pos;
+            v->scroll_v = 0;
+        }
+    }
+    listview_update_overscroll(v);
+    return WORKER_FRAME_MS;
 }
 
 void listview_init_ui(listview *view)
@@ -76,12 +143,12 @@ void listview_init_ui(listview *view)
     view->touch.id = -1;
     view->touch.last_y = -1;
 
-    add_touch_handler(&listview_touch_handler, view);
+    add_touch_handler_rect(&listview_touch_handler, view, view->x, view->y, view->w, view->h);
 }
 
 void listview_destroy(listview *view)
 {
-    workers_remove(listview_bounceback, view);
+    workers_remove(listview_animate, view);
 
     rm_touch_handler(&listview_touch_handler, view);
 
@@ -92,6 +159,7 @@ void listview_destroy(listview *view)
     fb_rm_rect(view->overscroll_marks[0]);
     fb_rm_rect(view->overscroll_marks[1]);
 
+    free(view->item_y);
     free(view);
 }
 
@@ -107,6 +175,17 @@ listview_item *listview_add_item(listview *view, struct multirom_rom *rom, struc
         keyaction_add(view->x, view->y, listview_keyaction_call, view);
 
     list_add(it, &view->items);
+
+    if(view->items_cnt + 2 > view->items_alloc)
+    {
+        view->items_alloc = imax(16, view->items_alloc*2);
+        view->item_y = realloc(view->item_y, view->items_alloc*sizeof(int));
+    }
+
+    if(view->items_cnt == 0)
+        view->item_y[0] = 0;
+    it->index = view->items_cnt++;
+    view->item_y[view->items_cnt] = view->item_y[it->index] + (*view->item_height)(data);
     return it;
 }
 
@@ -114,40 +193,68 @@ void listview_clear(listview *view)
 {
     list_clear(&view->items, view->item_destroy);
     view->selected = NULL;
+    view->items_cnt = 0;
+    view->vis_first = view->vis_last = 0;
 
     keyaction_remove(listview_keyaction_call, view);
 }
 
+// first index to item_y which is at or below y, searches the end of the
+// last item too, so the result is in 0..items_cnt+1
+static int listview_item_below(listview *view, int y)
+{
+    int lo = 0, hi = view->items_cnt ? view->items_cnt + 1 : 0, mid;
+    while(lo < hi)
+    {
+        mid = (lo + hi) / 2;
+        if(view->item_y[mid] < y)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// last index to item_y which is above y, -1 if none
+static int listview_item_above(listview *view, int y)
+{
+    return listview_item_below(view, y) - 1;
+}
+
+// Only items which fit whole into the view are drawn, fb has no clipping.
+// Cost depends only on the number of visible items.
 void listview_update_ui(listview *view)
 {
-    int y = 0;
-    int i, it_h, visible;
+    int i, first, last;
     listview_item *it;
 
-    for(i = 0; view->items && view->items[i]; ++i)
+    // items from the top edge down to the last one which ends above the bottom edge
+    first = imin(listview_item_below(view, view->pos), view->items_cnt);
+    last = imax(first, listview_item_above(view, view->pos + view->h + 1));
+
+    for(i = view->vis_first; i < view->vis_last; ++i)
     {
         it = view->items[i];
-        it_h = (*view->item_height)(it->data);
-
-        visible = (int)(view->pos <= y && y+it_h-view->pos <= view->h);
-
-        if(!visible && (it->flags & IT_VISIBLE))
+        if((i < first || i >= last) && (it->flags & IT_VISIBLE))
+        {
             (*view->item_hide)(it->data);
-        else if(visible)
-            (*view->item_draw)(view->x, view->y+y-view->pos, view->w - PADDING, it);
-
-        if(visible)
-            it->flags |= IT_VISIBLE;
-        else
             it->flags &= ~(IT_VISIBLE);
+        }
+    }
 
-        y += it_h;
+    for(i = first; i < last; ++i)
+    {
+        it = view->items[i];
+        (*view->item_draw)(view->x, view->y+view->item_y[i]-view->pos, view->w - PADDING, it);
+        it->flags |= IT_VISIBLE;
     }
 
-    view->fullH = y;
+    view->vis_first = first;
+    view->vis_last = last;
+    view->fullH = view->items_cnt ? view->item_y[view->items_cnt] : 0;
 
-    listview_enable_scroll(view, (int)(y > view->h));
-    if(y > view->h)
+    listview_enable_scroll(view, (int)(view->fullH > view->h));
+    if(view->fullH > view->h)
         listview_update_scroll_mark(view);
 
     fb_request_draw();
@@ -166,11 +273,11 @@ void listview_enable_scroll(listview *view, int enable)
         view->overscroll_marks[0] = fb_add_rect(view->x, view->y, 0, OVERSCROLL_MARK_H, CLR_SECONDARY);
         view->overscroll_marks[1] = fb_add_rect(view->x, view->y+view->h-OVERSCROLL_MARK_H,
                                                 0, OVERSCROLL_MARK_H, CLR_SECONDARY);
-        workers_add(listview_bounceback, view);
+        workers_add(listview_animate, view);
     }
     else
     {
-        workers_remove(listview_bounceback, view);
+        workers_remove(listview_animate, view);
 
         fb_rm_rect(view->scroll_mark);
         fb_rm_rect(view->overscroll_marks[0]);
@@ -214,11 +321,17 @@ int listview_touch_handler(touch_event *ev, void *data)
             ev->x > view->x+view->w || ev->y > view->y+view->h)
             return -1;
 
+        // touching a moving list only stops it
+        int was_moving = (view->scroll_v != 0);
+        view->scroll_v = 0;
+
         view->touch.id = ev->id;
         view->touch.last_y = ev->y;
         view->touch.start_y = ev->y;
         view->touch.us_diff = 0;
-        view->touch.hover = listview_item_at(view, ev->y);
+        view->touch.velocity = 0;
+        view->touch.last_move = ev->time;
+        view->touch.hover = was_moving ? NULL : listview_item_at(view, ev->y);
         view->touch.fast_scroll = (ev->x > view->x + view->w - PADDING*2 && ev->x <= view->x + view->w);
 
         if(view->touch.hover)
@@ -228,6 +341,8 @@ int listview_touch_handler(touch_event *ev, void *data)
         }
         listview_keyaction_call(view, KEYACT_CLEAR);
         listview_update_ui(view);
+        if(was_moving)
+            workers_wake(listview_animate, view);
         return 0;
     }
 
@@ -251,8 +366,14 @@ int listview_touch_handler(touch_event *ev, void *data)
                     listview_scroll_to(view, ((ev->y-view->y)*100)/(view->h));
                 else
                     listview_scroll_by(view, view->touch.last_y - ev->y);
+                workers_wake(listview_animate, view);
             }
 
+            // smoothed, single reports are too jittery
+            float v = (view->touch.last_y - ev->y)*1000000.f / view->touch.us_diff;
+            view->touch.velocity = view->touch.velocity*0.3f + v*0.7f;
+            view->touch.last_move = ev->time;
+
             view->touch.last_y = ev->y;
             view->touch.us_diff = 0;
         }
@@ -265,8 +386,15 @@ int listview_touch_handler(touch_event *ev, void *data)
             listview_select_item(view, view->touch.hover);
             view->touch.hover->flags &= ~(IT_HOVER);
         }
+        else if(!view->touch.fast_scroll && fabsf(view->touch.velocity) >= FLING_MIN_V &&
+            get_us_diff(ev->time, view->touch.last_move) < FLING_STALE_US)
+        {
+            view->scroll_pos = view->pos;
+            view->scroll_v = fmaxf(-FLING_MAX_V, fminf(view->touch.velocity, FLING_MAX_V));
+        }
         view->touch.id = -1;
         listview_update_ui(view);
+        workers_wake(listview_animate, view);
     }
 
     return 0;
@@ -316,19 +444,11 @@ void listview_scroll_to(listview *view, int pct)
 
 void listview_ensure_visible(listview *view, listview_item *it)
 {
-    if(!view->scroll_mark)
+    if(!view->scroll_mark || !it)
         return;
 
-    int i;
-    int y = 0;
-    for(i = 0; view->items[i]; ++i)
-    {
-        if(it == view->items[i])
-            break;
-        y += view->item_height(view->items[i]->data);
-    }
-
-    int last_h = view->items[i] ? view->item_height(view->items[i]->data) : 0;
+    int y = view->item_y[it->index];
+    int last_h = view->item_y[it->index + 1] - y;
 
     if((y + last_h) - view->pos > view->h)
         view->pos = (y + last_h) - view->h;
@@ -338,21 +458,13 @@ void listview_ensure_visible(listview *view, listview_item *it)
 
 listview_item *listview_item_at(listview *view, int y_pos)
 {
-    int y = -view->pos + view->y;
-    int i, it_h;
-    listview_item *it;
-
-    for(i = 0; view->items && view->items[i]; ++i)
-    {
-        it = view->items[i];
-        it_h = (*view->item_height)(it->data);
+    int y = y_pos - view->y + view->pos;
+    int i = listview_item_above(view, y);
 
-        if(y < y_pos && y+it_h > y_pos)
-            return it;
-
-        y += it_h;
-    }
-    return NULL;
+    // touches right on the line between items do not hit either
+    if(i < 0 || i >= view->items_cnt || y >= view->item_y[i + 1])
+        return NULL;
+    return view->items[i];
 }
 
 int listview_keyaction_call(void *data, int act)
@@ -363,7 +475,7 @@ int listview_keyaction_call(void *data, int act)
         case KEYACT_DOWN:
         {
             ++v->keyact_item_selected;
-            if(v->keyact_item_selected >= list_item_count(v->items))
+            if(v->keyact_item_selected >= v->items_cnt)
                 v->keyact_item_selected = -1;
             listview_update_keyact_frame(v);
             return (v->keyact_item_selected == -1) ? 1 :0;
@@ -371,7 +483,7 @@ int listview_keyaction_call(void *data, int act)
         case KEYACT_UP:
         {
             if(v->keyact_item_selected == -1)
-                v->keyact_item_selected = list_item_count(v->items)-1;
+                v->keyact_item_selected = v->items_cnt-1;
             else
                 --v->keyact_item_selected;
             listview_update_keyact_frame(v);
@@ -414,13 +526,9 @@ void listview_update_keyact_frame(listview *view)
     listview_item *it = view->items[view->keyact_item_selected];
     listview_ensure_visible(view, it);
 
-    int i;
-    int y = view->y;
-    for(i = 0; i < view->keyact_item_selected && view->items[i]; ++i)
-        y += view->item_height(view->items[i]->data);
-
-    int h = view->item_height(view->items[i]->data);
-    y -= view->pos;
+    int i = view->keyact_item_selected;
+    int y = view->y + view->item_y[i] - view->pos;
+    int h = view->item_y[i + 1] - view->item_y[i];
 
     // top
     view->keyact_frame[0]->head.y = y;
@@ -440,6 +548,80 @@ void listview_update_keyact_frame(listview *view)
 #define ROM_ITEM_H (100*DPI_MUL)
 #define ROM_TEXT_PADDING (100*DPI_MUL)
 
+// Rows are never freed while any ROM item exists, there are only as many
+// of them as items visible at once.
+static rom_item_row **rom_rows = NULL;
+static int rom_items_live = 0;
+// the list is updated from input, workers and UI threads
+static pthread_mutex_t rom_rows_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t rom_rows_created = 0;
+static uint32_t rom_rows_binds = 0;
+static uint32_t rom_rows_text_allocs = 0;
+
+static rom_item_row *rom_row_create(int x, int w)
+{
+    rom_item_row *r = mzalloc(sizeof(rom_item_row));
+    r->rom_name_it = fb_add_text(x+ROM_TEXT_PADDING, 0, WHITE, SIZE_NORMAL, "");
+    r->rom_profile_it = fb_add_text(x+ROM_TEXT_PADDING, 0, WHITE, SIZE_NORMAL, "");
+    r->part_it = fb_add_text(x+ROM_TEXT_PADDING, 0, GRAY, SIZE_SMALL, "");
+    r->bottom_line = fb_add_rect(x, 0, w, 1, 0xFF1B1B1B);
+    r->box = checkbox_create(0, 0, NULL);
+    r->hover_rect = fb_add_rect(x, 0, w, ROM_ITEM_H, CLR_SECONDARY);
+
+    list_add(r, &rom_rows);
+    ++rom_rows_created;
+    return r;
+}
+
+static void rom_row_set_hidden(rom_item_row *r, int hidden)
+{
+    fb_item_set_hidden(r->rom_name_it, hidden);
+    fb_item_set_hidden(r->rom_profile_it, hidden);
+    fb_item_set_hidden(r->part_it, hidden);
+    fb_item_set_hidden(r->bottom_line, hidden);
+    fb_item_set_hidden(r->hover_rect, hidden);
+    checkbox_set_hidden(r->box, hidden);
+}
+
+static void rom_row_destroy(void *row)
+{
+    rom_item_row *r = row;
+    fb_rm_text(r->rom_name_it);
+    fb_rm_text(r->rom_profile_it);
+    fb_rm_text(r->part_it);
+    fb_rm_rect(r->bottom_line);
+    fb_rm_rect(r->hover_rect);
+    checkbox_destroy(r->box);
+    free(r);
+}
+
+static void rom_row_bind(rom_item_data *d, int x, int w)
+{
+    int i;
+    rom_item_row *r = NULL;
+
+    for(i = 0; rom_rows && rom_rows[i]; ++i)
+    {
+        if(!rom_rows[i]->bound)
+        {
+            r = rom_rows[i];
+            break;
+        }
+    }
+
+    if(!r)
+        r = rom_row_create(x, w);
+
+    rom_rows_text_allocs += fb_text_set(r->rom_name_it, d->rom_name);
+    rom_rows_text_allocs += fb_text_set(r->rom_profile_it, d->rom_profile);
+    rom_rows_text_allocs += fb_text_set(r->part_it, d->partition ? d->partition : "");
+    rom_row_set_hidden(r, 0);
+    ++rom_rows_binds;
+
+    r->bound = d;
+    d->row = r;
+}
+
 rom_item_data *rom_item_create(const char *rom_name, const char *rom_profile, const char *partition)
 {
     rom_item_data *data = mzalloc(sizeof(rom_item_data));
@@ -451,66 +633,52 @@ rom_item_data *rom_item_create(const char *rom_name, const char *rom_profile, co
     strcpy(data->rom_profile + 2, rom_profile);
     if(partition)
         data->partition = strdup(partition);
+
+    pthread_mutex_lock(&rom_rows_mutex);
+    ++rom_items_live;
+    pthread_mutex_unlock(&rom_rows_mutex);
     return data;
 }
 
 void rom_item_draw(int x, int y, int w, listview_item *it)
 {
     rom_item_data *d = (rom_item_data*)it->data;
-    if(!d->rom_name_it)
-    {
-        d->rom_name_it = fb_add_text(x+ROM_TEXT_PADDING, 0, WHITE, SIZE_NORMAL, d->rom_name);
-        d->rom_profile_it = fb_add_text(x+ROM_TEXT_PADDING, 0, WHITE, SIZE_NORMAL, d->rom_profile);
-        d->bottom_line = fb_add_rect(x, 0, w, 1, 0xFF1B1B1B);
-        d->box = checkbox_create(0, 0, NULL);
+    rom_item_row *r;
 
-        if(d->partition)
-            d->part_it = fb_add_text(x+ROM_TEXT_PADDING, 0, GRAY, SIZE_SMALL, d->partition);
-    }
+    pthread_mutex_lock(&rom_rows_mutex);
+    if(!d->row)
+        rom_row_bind(d, x, w);
+    r = d->row;
+    pthread_mutex_unlock(&rom_rows_mutex);
 
-    d->rom_name_it->head.y = center_y(y, (ROM_ITEM_H - ISO_CHAR_HEIGHT * SIZE_SMALL * 2) / 2, SIZE_NORMAL);
-    d->rom_profile_it->head.y = d->rom_name_it->head.y + (ROM_ITEM_H - ISO_CHAR_HEIGHT * SIZE_SMALL * 2) / 2;
-    d->bottom_line->head.y = y+ROM_ITEM_H-2;
+    r->rom_name_it->head.y = center_y(y, (ROM_ITEM_H - ISO_CHAR_HEIGHT * SIZE_SMALL * 2) / 2, SIZE_NORMAL);
+    r->rom_profile_it->head.y = r->rom_name_it->head.y + (ROM_ITEM_H - ISO_CHAR_HEIGHT * SIZE_SMALL * 2) / 2;
+    r->part_it->head.y = y + ROM_ITEM_H - ISO_CHAR_HEIGHT * SIZE_SMALL * 3 / 2;
+    r->bottom_line->head.y = y+ROM_ITEM_H-2;
 
-    if(d->part_it)
-        d->part_it->head.y = y + ROM_ITEM_H - ISO_CHAR_HEIGHT * SIZE_SMALL * 3 / 2;
+    r->hover_rect->head.y = y;
+    fb_item_set_hidden(r->hover_rect, !(it->flags & IT_HOVER));
 
-    if(it->flags & IT_HOVER)
-    {
-        if(!d->hover_rect)
-            d->hover_rect = fb_add_rect(x, 0, w, rom_item_height(it->data), CLR_SECONDARY);
-        d->hover_rect->head.y = y;
-    }
-    else if(d->hover_rect)
+    checkbox_set_pos(r->box, x+CHECKBOX_SIZE, y + (ROM_ITEM_H/2 - CHECKBOX_SIZE/2));
+    checkbox_select(r->box, (it->flags & IT_SELECTED));
+}
+
+// expects locked rom_rows_mutex
+static void rom_item_unbind(rom_item_data *d)
+{
+    if(d->row)
     {
-        fb_rm_rect(d->hover_rect);
-        d->hover_rect = NULL;
+        rom_row_set_hidden(d->row, 1);
+        d->row->bound = NULL;
+        d->row = NULL;
     }
-
-    checkbox_set_pos(d->box, x+CHECKBOX_SIZE, y + (ROM_ITEM_H/2 - CHECKBOX_SIZE/2));
-    checkbox_select(d->box, (it->flags & IT_SELECTED));
 }
 
 void rom_item_hide(void *data)
 {
-    rom_item_data *d = (rom_item_data*)data;
-    if(!d->rom_name_it)
-        return;
-
-    fb_rm_text(d->rom_name_it);
-    fb_rm_text(d->rom_profile_it);
-    fb_rm_text(d->part_it);
-    fb_rm_rect(d->bottom_line);
-    fb_rm_rect(d->hover_rect);
-
-    checkbox_destroy(d->box);
-
-    d->rom_name_it = NULL;
-    d->rom_profile_it = NULL;
-    d->part_it = NULL;
-    d->bottom_line = NULL;
-    d->hover_rect = NULL;
-    d->box = NULL;
+    pthread_mutex_lock(&rom_rows_mutex);
+    rom_item_unbind((rom_item_data*)data);
+    pthread_mutex_unlock(&rom_rows_mutex);
 }
 
 int rom_item_height(void *data)
@@ -520,11 +688,25 @@ int rom_item_height(void *data)
 
 void rom_item_destroy(listview_item *it)
 {
-    rom_item_hide(it->data);
     rom_item_data *d = (rom_item_data*)it->data;
+
+    // the row goes back to the pool before its data is gone, and nothing
+    // can bind it again in between
+    pthread_mutex_lock(&rom_rows_mutex);
+    rom_item_unbind(d);
     free(d->rom_name);
     free(d->rom_profile);
     free(d->partition);
-    free(it->data);
+    free(d);
+    it->data = NULL;
+
+    if(--rom_items_live == 0 && rom_rows)
+    {
+        INFO("listview: %d rows, %u created, %u binds, %u text allocs\n",
+                list_item_count(rom_rows), rom_rows_created, rom_rows_binds, rom_rows_text_allocs);
+        list_clear(&rom_rows, &rom_row_destroy);
+        rom_rows_created = rom_rows_binds = rom_rows_text_allocs = 0;
+    }
+    pthread_mutex_unlock(&rom_rows_mutex);
     free(it);
 }
@@ -30,17 +30,24 @@ enum
     IT_SELECTED = 0x04,
 };
 
+// fb objects of one visible row, rebound to other items as they scroll
 typedef struct
 {
-    char *rom_name;
-    char *rom_profile;
-    char *partition;
+    void *bound; // rom_item_data
     fb_text *rom_name_it;
     fb_text *rom_profile_it;
     fb_text *part_it;
     fb_rect *bottom_line;
     fb_rect *hover_rect;
     checkbox *box;
+} rom_item_row;
+
+typedef struct
+{
+    char *rom_name;
+    char *rom_profile;
+    char *partition;
+    rom_item_row *row;
 } rom_item_data;
 
 typedef struct
@@ -49,6 +56,7 @@ typedef struct
     struct multirom_romdata *profile;
     rom_item_data *data;
     int flags;
+    int index; // in listview.items
 } listview_item;
 
 typedef struct 
@@ -59,6 +67,8 @@ typedef struct
     int64_t us_diff;
     listview_item *hover;
     int fast_scroll;
+    float velocity; // px/s, positive scrolls towards the end
+    struct timeval last_move;
 } listview_touch_data;
 
 typedef struct
@@ -72,6 +82,13 @@ typedef struct
     listview_item **items;
     listview_item *selected;
 
+    // item_y[i] is the top of item i, item_y[items_cnt] is fullH
+    int *item_y;
+    int items_cnt;
+    int items_alloc;
+    // items with IT_VISIBLE, vis_last is not included
+    int vis_first, vis_last;
+
     void (*item_draw)(int, int, int, listview_item *); // x, y, w, item
     void (*item_hide)(void*); // data
     int (*item_height)(void*); // data
@@ -85,6 +102,10 @@ typedef struct
     fb_rect **keyact_frame;
     int keyact_item_selected;
 
+    // fling and overscroll animation on the workers thread
+    volatile float scroll_v; // px/s
+    float scroll_pos; // pos with the fraction
+
     listview_touch_data touch;
 } listview;
 
@@ -27,7 +27,11 @@
 
 #include "multirom_main.h"
 #include "multirom_misc.h"
+#include "multirom_kexec.h"
+#include "multirom_partitions.h"
+#include "trace.h"
 #include "framebuffer.h"
+#include "jobs.h"
 #include "log.h"
 #include "version.h"
 #include "util.h"
@@ -124,11 +128,18 @@ static void remount_ro(void)
 
 static __attribute__((noreturn)) void do_kexec(void)
 {
-    sync();
+    // Flush and remount ro what MultiROM has mounted, kexec does not do this
+    // and it is necessary to prevent data corruption.
+    // Force remount ro by triggering a sysrq if that does not work.
+    if(multirom_shutdown_mounts() < 0)
+    {
+        sync();
+        remount_ro();
+    }
 
-    // Force remount ro by triggering a sysrq
-    // This is necessary to prevent data corruption because kexec does not do this
-    remount_ro();
+    // Same as what kexec -e does, the image was loaded by multirom_kexec_load()
+    // or by the kexec binary
+    multirom_kexec_exec();
 
     execl("/multirom/kexec", "/multirom/kexec", "-e", NULL);
 
@@ -148,6 +159,15 @@ int main(int argc, char *argv[])
             fflush(stdout);
             return 0;
         }
+        // -jobs-bench [threads] [jobs]
+        else if(strcmp(argv[i], "-jobs-bench") == 0)
+        {
+            int threads = (i+1 < argc) ? atoi(argv[i+1]) : 0;
+            int jobs = (i+2 < argc) ? atoi(argv[i+2]) : 4096;
+            int res = jobs_bench(threads, jobs);
+            fflush(stdout);
+            return res == 0 ? 0 : 1;
+        }
     }
 
     srand(time(0));
@@ -157,10 +177,15 @@ int main(int argc, char *argv[])
     // but it is possible to filter out INFO messages
     klog_set_level(6);
 
+    trace_init("multirom");
+    trace_begin("multirom");
     ERROR("Running MultiROM v%d%s\n", VERSION_MULTIROM, VERSION_DEV_FIX);
 
     int exit = multirom();
 
+    trace_end("multirom");
+    multirom_save_trace();
+
     if(exit >= 0)
     {
         if(exit & EXIT_REBOOT_MASK)
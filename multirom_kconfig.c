@@ -0,0 +1,163 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <zlib.h>
+
+#include "multirom_kconfig.h"
+#include "trace.h"
+#include "util.h"
+#include "log.h"
+
+struct kconfig_symbol
+{
+    const char *name;
+    uint32_t cap;
+};
+
+// must be sorted by name, it is searched with bsearch
+static const struct kconfig_symbol symbols[] = {
+    { "CONFIG_ATAGS_PROC",       KCONFIG_ATAGS_PROC },
+    { "CONFIG_KEXEC",            KCONFIG_KEXEC },
+    { "CONFIG_KEXEC_HARDBOOT",   KCONFIG_KEXEC_HARDBOOT },
+    { "CONFIG_PROC_DEVICETREE",  KCONFIG_PROC_DEVICETREE },
+    { "CONFIG_RD_GZIP",          KCONFIG_RD_GZIP },
+};
+
+static struct multirom_kconfig kconfig = { KCONFIG_SRC_NONE, 0, 0 };
+static pthread_mutex_t kconfig_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t kconfig_cond = PTHREAD_COND_INITIALIZER;
+static int kconfig_state = 0; // 0 - not started, 1 - running, 2 - done
+
+static int compare_symbol(const void *key, const void *sym)
+{
+    return strcmp((const char*)key, ((const struct kconfig_symbol*)sym)->name);
+}
+
+/*
+ * Matches all the symbols against config lines ("CONFIG_X=y") while the file
+ * is inflated, every line is looked at only once.
+ */
+static int parse_config_gz(const char *path, uint32_t *caps)
+{
+    char line[512];
+    char *eq;
+    const struct kconfig_symbol *sym;
+
+    gzFile f = gzopen(path, "rb");
+    if(!f)
+        return -1;
+
+    gzbuffer(f, 32*1024);
+
+    while(gzgets(f, line, sizeof(line)))
+    {
+        if(strncmp(line, "CONFIG_", 7) != 0)
+            continue;
+
+        eq = strchr(line, '=');
+        if(!eq)
+            continue;
+        *eq = 0;
+
+        sym = bsearch(line, symbols, ARRAY_SIZE(symbols), sizeof(symbols[0]), compare_symbol);
+        if(sym && (eq[1] == 'y' || eq[1] == 'm'))
+            *caps |= sym->cap;
+    }
+
+    int err;
+    gzerror(f, &err);
+    gzclose(f);
+    return (err == Z_OK || err == Z_STREAM_END) ? 0 : -1;
+}
+
+static void *kconfig_probe(void *data)
+{
+    struct timespec start, end;
+    uint32_t caps = 0;
+    int source;
+
+    trace_begin("kconfig_probe");
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if(access("/proc/config.gz", F_OK) >= 0 && parse_config_gz("/proc/config.gz", &caps) >= 0)
+        source = KCONFIG_SRC_CONFIG_GZ;
+    else
+    {
+        // Kernel without /proc/config.gz enabled - check for /proc/atags file,
+        // if it is present, there is good change kexec-hardboot is enabled too.
+        ERROR("/proc/config.gz is not available!\n");
+        caps = 0;
+        if(access("/proc/atags", R_OK) >= 0)
+            caps |= KCONFIG_ATAGS_PROC | KCONFIG_KEXEC | KCONFIG_KEXEC_HARDBOOT;
+        if(access("/proc/device-tree", R_OK) >= 0)
+            caps |= KCONFIG_PROC_DEVICETREE | KCONFIG_KEXEC | KCONFIG_KEXEC_HARDBOOT;
+        source = caps ? KCONFIG_SRC_GUESS : KCONFIG_SRC_NONE;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    trace_end("kconfig_probe");
+
+    pthread_mutex_lock(&kconfig_mutex);
+    kconfig.source = source;
+    kconfig.caps = caps;
+    kconfig.probe_ms = timespec_diff(&start, &end);
+    kconfig_state = 2;
+    pthread_cond_broadcast(&kconfig_cond);
+    pthread_mutex_unlock(&kconfig_mutex);
+
+    INFO("kconfig: source %d, caps 0x%02x, probed in %u ms\n", source, caps, kconfig.probe_ms);
+    return NULL;
+}
+
+void multirom_kconfig_probe_start(void)
+{
+    pthread_t thread;
+
+    pthread_mutex_lock(&kconfig_mutex);
+    if(kconfig_state != 0)
+    {
+        pthread_mutex_unlock(&kconfig_mutex);
+        return;
+    }
+    kconfig_state = 1;
+    pthread_mutex_unlock(&kconfig_mutex);
+
+    if(pthread_create(&thread, NULL, kconfig_probe, NULL) == 0)
+        pthread_detach(thread);
+    else
+    {
+        ERROR("kconfig: cannot start probe thread\n");
+        kconfig_probe(NULL);
+    }
+}
+
+const struct multirom_kconfig *multirom_kconfig_get(void)
+{
+    multirom_kconfig_probe_start();
+
+    pthread_mutex_lock(&kconfig_mutex);
+    while(kconfig_state != 2)
+        pthread_cond_wait(&kconfig_cond, &kconfig_mutex);
+    pthread_mutex_unlock(&kconfig_mutex);
+    return &kconfig;
+}
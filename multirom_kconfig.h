@@ -0,0 +1,51 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MULTIROM_KCONFIG_H_
+#define MULTIROM_KCONFIG_H_
+
+#include <stdint.h>
+
+enum
+{
+    KCONFIG_KEXEC             = 0x01,
+    KCONFIG_KEXEC_HARDBOOT    = 0x02,
+    KCONFIG_ATAGS_PROC        = 0x04,
+    KCONFIG_PROC_DEVICETREE   = 0x08,
+    KCONFIG_RD_GZIP           = 0x10,
+};
+
+enum
+{
+    KCONFIG_SRC_NONE          = 0, // nothing could be probed
+    KCONFIG_SRC_CONFIG_GZ     = 1, // parsed from /proc/config.gz
+    KCONFIG_SRC_GUESS         = 2, // guessed from files in /proc
+};
+
+struct multirom_kconfig
+{
+    int source;
+    uint32_t caps;
+    uint32_t probe_ms;
+};
+
+// Starts probing the running kernel's config in background
+void multirom_kconfig_probe_start(void);
+// Waits for the probe to finish, never returns NULL
+const struct multirom_kconfig *multirom_kconfig_get(void);
+
+#endif /* MULTIROM_KCONFIG_H_ */
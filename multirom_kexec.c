@@ -0,0 +1,306 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Does what `kexec --load-hardboot zImage --mem-min=MR_KEXEC_MEM_MIN
+ * --initrd=... --command-line=...` does on ARM, with the initrd taken
+ * from memory. Memory layout is the same as kexec-tools' zImage loader:
+ *
+ *   mem_min + 0x1000                        atags
+ *   mem_min + 0x8000                        zImage (entry point)
+ *   zImage + ALIGN(4*zImage size, PAGE)     initrd
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+
+#include "multirom_kexec.h"
+#include "cpio.h"
+#include "util.h"
+#include "log.h"
+
+#define KEXEC_ARCH_DEFAULT  (0 << 16)
+#define KEXEC_HARDBOOT      0x00000004
+
+// the kernel finds atags at entry - ZIMAGE_OFFSET + ATAGS_OFFSET
+#define KEXEC_ARM_ATAGS_OFFSET  0x1000
+#define KEXEC_ARM_ZIMAGE_OFFSET 0x8000
+
+#define ZIMAGE_MAGIC_OFFSET 0x24
+#define ZIMAGE_MAGIC        0x016F2818
+
+#define ATAG_NONE    0x00000000
+#define ATAG_CORE    0x54410001
+#define ATAG_INITRD  0x54410005
+#define ATAG_INITRD2 0x54420005
+#define ATAG_CMDLINE 0x54410009
+
+#define ATAGS_MAX_SIZE (KEXEC_ARM_ZIMAGE_OFFSET - KEXEC_ARM_ATAGS_OFFSET)
+#define COMMAND_LINE_SIZE 1024
+
+#define LINUX_REBOOT_MAGIC1     0xfee1dead
+#define LINUX_REBOOT_MAGIC2     672274793
+#define LINUX_REBOOT_CMD_KEXEC  0x45584543
+
+#define KPAGE_SIZE 4096
+#define KPAGE_ALIGN(x) (((x) + KPAGE_SIZE - 1) & ~(KPAGE_SIZE - 1))
+
+struct kexec_segment
+{
+    const void *buf;
+    size_t bufsz;
+    unsigned long mem;
+    size_t memsz;
+};
+
+struct kexec_prefetch
+{
+    pthread_t thread;
+    char *path;
+    struct cpio_buf data;
+    int res;
+    int running;
+};
+
+static struct kexec_prefetch prefetch = { .running = 0 };
+
+static void *prefetch_work(void *data)
+{
+    struct kexec_prefetch *p = data;
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    p->res = cpio_buf_load(&p->data, p->path);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    INFO("kexec: read %s (%u bytes) in %u ms\n", p->path, (unsigned)p->data.size, timespec_diff(&start, &end));
+    return NULL;
+}
+
+void multirom_kexec_prefetch(const char *kernel_path)
+{
+    if(prefetch.running)
+    {
+        if(strcmp(prefetch.path, kernel_path) == 0)
+            return;
+        pthread_join(prefetch.thread, NULL);
+        cpio_buf_free(&prefetch.data);
+        free(prefetch.path);
+    }
+
+    prefetch.path = strdup(kernel_path);
+    prefetch.res = -1;
+    prefetch.running = 1;
+    pthread_create(&prefetch.thread, NULL, prefetch_work, &prefetch);
+}
+
+static int load_kernel(const char *kernel_path, struct cpio_buf *kernel)
+{
+    if(prefetch.running)
+    {
+        pthread_join(prefetch.thread, NULL);
+        prefetch.running = 0;
+
+        int match = strcmp(prefetch.path, kernel_path) == 0 && prefetch.res == 0;
+        free(prefetch.path);
+        prefetch.path = NULL;
+        if(match)
+        {
+            *kernel = prefetch.data;
+            memset(&prefetch.data, 0, sizeof(prefetch.data));
+            return 0;
+        }
+        cpio_buf_free(&prefetch.data);
+    }
+    return cpio_buf_load(kernel, kernel_path);
+}
+
+static int atag_append(uint32_t *atags, uint32_t *words, uint32_t tag, const void *data, uint32_t data_words)
+{
+    if((*words + 2 + data_words)*4 > ATAGS_MAX_SIZE)
+        return -1;
+
+    atags[(*words)++] = data_words + 2;
+    atags[(*words)++] = tag;
+    memcpy(atags + *words, data, data_words*4);
+    *words += data_words;
+    return 0;
+}
+
+/*
+ * Takes the bootloader's atags from /proc/atags and replaces
+ * initrd and cmdline in them
+ */
+static uint32_t *build_atags(unsigned long initrd_start, size_t initrd_size, const char *cmdline, uint32_t *size)
+{
+    struct cpio_buf orig = { 0 };
+    uint32_t *atags, *t, *end;
+    uint32_t words = 0, initrd[2], cmd_words;
+    char cmd[COMMAND_LINE_SIZE];
+
+    if(cpio_buf_load(&orig, "/proc/atags") < 0 || orig.size < 8)
+    {
+        ERROR("kexec: cannot read /proc/atags\n");
+        cpio_buf_free(&orig);
+        return NULL;
+    }
+
+    atags = mzalloc(ATAGS_MAX_SIZE);
+
+    t = (uint32_t*)orig.data;
+    end = (uint32_t*)(orig.data + orig.size);
+    while(t + 2 <= end && t[0] >= 2 && t[1] != ATAG_NONE && t + t[0] <= end)
+    {
+        if(t[1] != ATAG_CMDLINE && t[1] != ATAG_INITRD && t[1] != ATAG_INITRD2)
+        {
+            if(atag_append(atags, &words, t[1], t + 2, t[0] - 2) < 0)
+                goto fail;
+        }
+        t += t[0];
+    }
+    cpio_buf_free(&orig);
+
+    if(words == 0 || atags[1] != ATAG_CORE)
+    {
+        ERROR("kexec: /proc/atags does not start with ATAG_CORE\n");
+        goto fail;
+    }
+
+    if(initrd_size)
+    {
+        initrd[0] = initrd_start;
+        initrd[1] = initrd_size;
+        if(atag_append(atags, &words, ATAG_INITRD2, initrd, 2) < 0)
+            goto fail;
+    }
+
+    memset(cmd, 0, sizeof(cmd));
+    strncpy(cmd, cmdline, sizeof(cmd)-1);
+    cmd_words = (strlen(cmd) + 1 + 3) / 4;
+    if(atag_append(atags, &words, ATAG_CMDLINE, cmd, cmd_words) < 0)
+        goto fail;
+
+    // ATAG_NONE has size 0
+    if((words + 2)*4 > ATAGS_MAX_SIZE)
+        goto fail;
+    atags[words++] = 0;
+    atags[words++] = ATAG_NONE;
+
+    *size = words*4;
+    return atags;
+
+fail:
+    ERROR("kexec: cannot build atags\n");
+    free(atags);
+    return NULL;
+}
+
+int multirom_kexec_load(const char *kernel_path, const void *initrd, size_t initrd_size, const char *cmdline)
+{
+#ifdef MR_KEXEC_DTB
+    // device tree has to be built from /proc/device-tree, leave it to kexec-tools
+    return KEXEC_LOAD_UNSUPPORTED;
+#else
+    struct cpio_buf kernel = { 0 };
+    struct kexec_segment segs[3];
+    struct timespec start, end;
+    unsigned long base, kernel_base, initrd_base;
+    uint32_t *atags = NULL;
+    uint32_t atags_size;
+    int nsegs = 0, res = -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if(load_kernel(kernel_path, &kernel) < 0)
+    {
+        ERROR("kexec: cannot read kernel %s\n", kernel_path);
+        goto exit;
+    }
+
+    if(kernel.size < ZIMAGE_MAGIC_OFFSET + 4 ||
+        *(uint32_t*)(kernel.data + ZIMAGE_MAGIC_OFFSET) != ZIMAGE_MAGIC)
+    {
+        ERROR("kexec: %s is not a zImage\n", kernel_path);
+        goto exit;
+    }
+
+    base = strtoul(MR_KEXEC_MEM_MIN, NULL, 0);
+    kernel_base = base + KEXEC_ARM_ZIMAGE_OFFSET;
+    initrd_base = kernel_base + KPAGE_ALIGN(kernel.size * 4);
+
+    atags = build_atags(initrd_base, initrd_size, cmdline, &atags_size);
+    if(!atags)
+        goto exit;
+
+    // segments must be page aligned and sorted
+    segs[nsegs].buf = atags;
+    segs[nsegs].bufsz = atags_size;
+    segs[nsegs].mem = base + KEXEC_ARM_ATAGS_OFFSET;
+    segs[nsegs].memsz = KPAGE_ALIGN(atags_size);
+    ++nsegs;
+
+    segs[nsegs].buf = kernel.data;
+    segs[nsegs].bufsz = kernel.size;
+    segs[nsegs].mem = kernel_base;
+    segs[nsegs].memsz = KPAGE_ALIGN(kernel.size);
+    ++nsegs;
+
+    if(initrd_size)
+    {
+        segs[nsegs].buf = initrd;
+        segs[nsegs].bufsz = initrd_size;
+        segs[nsegs].mem = initrd_base;
+        segs[nsegs].memsz = KPAGE_ALIGN(initrd_size);
+        ++nsegs;
+    }
+
+    if(syscall(__NR_kexec_load, kernel_base, nsegs, segs, KEXEC_ARCH_DEFAULT | KEXEC_HARDBOOT) < 0)
+    {
+        if(errno == ENOSYS)
+        {
+            ERROR("kexec: kexec_load is not available, falling back to kexec binary\n");
+            res = KEXEC_LOAD_UNSUPPORTED;
+        }
+        else
+            ERROR("kexec: kexec_load failed: %s\n", strerror(errno));
+        goto exit;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ERROR("kexec: loaded %s (%u bytes) with %u bytes initrd at 0x%08lx in %u ms\n", kernel_path,
+            (unsigned)kernel.size, (unsigned)initrd_size, initrd_base, timespec_diff(&start, &end));
+    res = 0;
+exit:
+    free(atags);
+    cpio_buf_free(&kernel);
+    return res;
+#endif
+}
+
+void multirom_kexec_exec(void)
+{
+    syscall(__NR_reboot, LINUX_REBOOT_MAGIC1, LINUX_REBOOT_MAGIC2, LINUX_REBOOT_CMD_KEXEC, NULL);
+    ERROR("kexec: reboot(LINUX_REBOOT_CMD_KEXEC) failed: %s\n", strerror(errno));
+}
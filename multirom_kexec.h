@@ -0,0 +1,39 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MULTIROM_KEXEC_H_
+#define MULTIROM_KEXEC_H_
+
+#include <stddef.h>
+
+// multirom_kexec_load() result when the external kexec binary has to be used
+#define KEXEC_LOAD_UNSUPPORTED 1
+
+// Starts reading the kernel in background, so it overlaps with the UI
+void multirom_kexec_prefetch(const char *kernel_path);
+
+/*
+ * Loads kernel (zImage) for kexec-hardboot with the initrd from memory
+ * via the kexec_load syscall.
+ * returns: 0 on success, -1 on error or KEXEC_LOAD_UNSUPPORTED
+ */
+int multirom_kexec_load(const char *kernel_path, const void *initrd, size_t initrd_size, const char *cmdline);
+
+// Jumps into the loaded kernel, returns only on failure
+void multirom_kexec_exec(void);
+
+#endif /* MULTIROM_KEXEC_H_ */
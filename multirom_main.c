@@ -21,45 +21,67 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 
 #include "fstab.h"
 #include "multirom_main.h"
 #include "multirom_misc.h"
 #include "multirom_partitions.h"
+#include "multirom_kconfig.h"
+#include "multirom_kexec.h"
+#include "multirom_ramdisk.h"
+#include "multirom_rdcache.h"
+#include "multirom_staging.h"
 #include "multirom_rom.h"
 #include "multirom_status.h"
 #include "multirom_ui.h"
+#include "jobs.h"
+#include "trace.h"
 #include "util.h"
 #include "log.h"
 
 enum exit_status multirom(void)
 {
+    // the result is needed only when a ROM is booted
+    multirom_kconfig_probe_start();
+    jobs_start(0);
+
+    trace_begin("fstab_auto_load");
     multirom_status.fstab = fstab_auto_load();
+    trace_end("fstab_auto_load");
     if(multirom_status.fstab == NULL)
     {
         multirom_emergency_reboot();
         while(1);
     }
 
+    trace_begin("mount_internal_storage");
     multirom_mount_internal_storage();
+    trace_end("mount_internal_storage");
 
     // TODO: load and save preferences
     //multirom_load_default_pref();
     multirom_status.pref.brightness = 40;
 
+    trace_begin("scan");
     multirom_scan_partitions();
     multirom_scan_all_roms();
+    trace_end("scan");
 
     struct multirom_rom *to_boot;
     struct multirom_romdata *boot_profile;
+    trace_begin("ui");
     int ui_exit = multirom_ui(&to_boot, &boot_profile);
+    trace_end("ui");
 
     enum exit_status exit = EXIT_REBOOT_RECOVERY;
 
     switch(ui_exit)
     {
         case UI_EXIT_BOOT_ROM:
+            trace_begin("prepare_boot");
             exit = multirom_prepare_boot(to_boot, boot_profile);
+            trace_end("prepare_boot");
             break;
         case UI_EXIT_REBOOT:
             exit = EXIT_REBOOT;
@@ -89,6 +111,9 @@ enum exit_status multirom(void)
             break;
     }
 
+    multirom_staging_stop();
+    jobs_stop();
+
     return exit;
 }
 
@@ -140,49 +165,40 @@ static char *replace_mountpath(const char *target, const char *old, const char *
     }
 }
 
-enum exit_status multirom_prepare_android_img(struct multirom_partition *part, struct multirom_rom_android_img *sys, struct multirom_romdata_android_img *data)
+static int write_setup_plan(const char *dest, struct multirom_partition *part, struct multirom_rom_android_img *sys, struct multirom_romdata_android_img *data)
 {
-    FILE *f = fopen("/multirom/setup-gen.sh", "w");
+    char *path = NULL;
+    FILE *f = fopen(dest, "w");
     if(f == NULL)
     {
-        ERROR("Cannot open /multirom/setup-gen.sh");
-        goto fail;
+        ERROR("Cannot open %s", dest);
+        return -1;
     }
-    if(fputs("bb mkdir /multirom/mnt\n", f) < 0)
+    if(fputs("# Auto-generated by MultiROM\nmkdir /multirom/mnt\n", f) < 0)
         goto fail;
     if(fprintf(f, "waitfor \"%s\"\n", part->block_dev) < 0)
         goto fail;
-    if(fprintf(f, "bb mount -t %s \"%s\" /multirom/mnt\n", part->fstype, part->block_dev) < 0)
+    if(fprintf(f, "mount %s \"%s\" /multirom/mnt\n", part->fstype, part->block_dev) < 0)
         goto fail;
-    char *path;
     if(sys != NULL)
     {
-        char *cmd;
-        remove("/multirom/boot.cpio");
-        asprintf(&cmd, "/multirom/busybox zcat \"%s\" > /multirom/boot.cpio", sys->ramdisk_path);
-        int res = shell_cmd(cmd);
-        free(cmd);
-        if(res != 0)
-        {
-            ERROR("Extracting ramdisk.gz failed");
-            goto fail;
-        }
-
         path = replace_mountpath(sys->system_path, part->mount_path, "/multirom/mnt");
-        if(part == NULL)
+        if(path == NULL)
             goto fail;
         if(fprintf(f, "replaceblk \"/dev/block/platform/msm_sdcc.1/by-name/system\" \"%s\"\n", path) < 0)
             goto fail;
         free(path);
+        path = NULL;
 
         if(sys->firmware_path != NULL)
         {
             path = replace_mountpath(sys->firmware_path, part->mount_path, "/multirom/mnt");
-            if(part == NULL)
+            if(path == NULL)
                 goto fail;
             if(fprintf(f, "replaceblk \"/dev/block/platform/msm_sdcc.1/by-name/modem\" \"%s\"\n", path) < 0)
                 goto fail;
             free(path);
+            path = NULL;
         }
     }
 
@@ -190,89 +206,151 @@ enum exit_status multirom_prepare_android_img(struct multirom_partition *part, s
         goto fail;
 
     path = replace_mountpath(data->data_path, part->mount_path, "/multirom/mnt");
-    if(part == NULL)
+    if(path == NULL)
         goto fail;
     if(fprintf(f, "replaceblk \"/dev/block/platform/msm_sdcc.1/by-name/userdata\" \"%s\"\n", path) < 0)
         goto fail;
     free(path);
 
     path = replace_mountpath(data->cache_path, part->mount_path, "/multirom/mnt");
-    if(part == NULL)
+    if(path == NULL)
         goto fail;
     if(fprintf(f, "replaceblk \"/dev/block/platform/msm_sdcc.1/by-name/cache\" \"%s\"\n", path) < 0)
         goto fail;
     free(path);
 
     path = replace_mountpath(data->persist_path, part->mount_path, "/multirom/mnt");
-    if(part == NULL)
+    if(path == NULL)
         goto fail;
     if(fprintf(f, "replaceblk \"/dev/block/platform/msm_sdcc.1/by-name/persist\" \"%s\"\n", path) < 0)
         goto fail;
     free(path);
 
+    if(fclose(f) != 0)
+        return -1;
+    return 0;
+
+fail:
+    free(path);
     fclose(f);
+    return -1;
+}
 
-    mkdir("/rd_tmp", 0755);
-    if(shell_cmd("cd /rd_tmp; /multirom/busybox cpio -i < \"/multirom/boot.cpio\"") != 0)
+/*
+ * Generates setup.plan and the patched boot.cpio into `out_dir`.
+ * `out_buf`: if not NULL, the ramdisk is kept in memory instead of boot.cpio
+ * `cancel`: can be NULL, the build is aborted when it becomes non-zero
+ */
+int multirom_build_android_img(struct multirom_partition *part, struct multirom_rom_android_img *sys, struct multirom_romdata_android_img *data, const char *out_dir, struct cpio_buf *out_buf, volatile int *cancel)
+{
+    char setup_plan[128];
+    char rd_new[128];
+    char rd_out[128];
+    char cache_key[RDCACHE_KEY_LEN+1];
+    char *cache_dir = NULL;
+    int res = -1;
+
+    snprintf(setup_plan, sizeof(setup_plan), "%s/setup.plan", out_dir);
+    snprintf(rd_new, sizeof(rd_new), "%s/boot.cpio.new", out_dir);
+    snprintf(rd_out, sizeof(rd_out), "%s/boot.cpio", out_dir);
+
+    if(write_setup_plan(setup_plan, part, sys, data) < 0)
     {
-        ERROR("Cannot extract cpio ramdisk!");
-        goto fail;
+        ERROR("Cannot write %s", setup_plan);
+        return -1;
     }
-    rename("/rd_tmp/init.rc", "/multirom/init.rc.orig");
-    rename("/multirom/prepend-init.rc", "/rd_tmp/init.rc");
 
-    FILE *app = fopen("/rd_tmp/init.rc", "a");
-    if(app == NULL)
-    {
-        ERROR("Cannot open init.rc");
-        goto fail;
-    }
+    int kexec = (sys != NULL && sys->kernel_path != NULL);
+    int compress = 0;
+    struct multirom_rd_file kexec_files[] = {
+        // kexec, copy the setup executor and its plan to new ramdisk
+        { "multirom",            NULL,              S_IFDIR | 0755 },
+        { "multirom/setup",      "/multirom/setup", S_IFREG | 0755 },
+        { "multirom/setup.plan", setup_plan,        S_IFREG | 0644 },
+        { NULL, NULL, 0 }
+    };
+
+#ifdef MR_KEXEC_GZIP_RAMDISK
+    compress = kexec;
+#endif
+
+    // Without a ROM ramdisk, patch the one the trampoline left for the internal ROM
+    const char *rd_src = sys != NULL ? sys->ramdisk_path : "/multirom/boot.cpio";
+
+    // Everything the patched ramdisk is made of goes into the cache key
+    const char *key_inputs[] = {
+        "/multirom/prepend-init.rc",
+        setup_plan,
+        "/multirom/setup",
+        NULL
+    };
+    if(!kexec)
+        key_inputs[2] = NULL;
 
-    FILE *in = fopen("/multirom/init.rc.orig", "r");
-    if(in == NULL)
+    cache_dir = multirom_rdcache_dir(part);
+    if(cache_dir != NULL && multirom_rdcache_key(rd_src, sys != NULL, key_inputs, compress | (kexec << 1), cache_key) < 0)
     {
-        ERROR("Cannot open init.rc.orig");
-        goto fail;
+        ERROR("Cannot compute ramdisk cache key, not using cache");
+        free(cache_dir);
+        cache_dir = NULL;
     }
 
-    fseek(in, 0, SEEK_END);
-    size_t size = ftell(in);
-    rewind(in);
-
-    char *buff = malloc(size);
-    fread(buff, 1, size, in);
-    fwrite(buff, 1, size, app);
+    const char *rd_file = out_buf ? NULL : rd_new;
+    if(cache_dir == NULL || multirom_rdcache_get(cache_dir, cache_key, rd_file, out_buf) < 0)
+    {
+        if(out_buf)
+            out_buf->size = 0;
 
-    fclose(in);
-    fclose(app);
-    free(buff);
+        if(multirom_ramdisk_patch(rd_src, rd_file, out_buf, "/multirom/prepend-init.rc",
+            kexec ? kexec_files : NULL, compress, cancel) < 0)
+        {
+            if(cancel == NULL || !*cancel)
+                ERROR("Cannot patch ramdisk!");
+            goto exit;
+        }
 
-    remove("/multirom/init.rc.orig");
+        if(cache_dir != NULL && multirom_rdcache_put(cache_dir, cache_key, rd_file, out_buf) < 0)
+            ERROR("Cannot store ramdisk in cache %s", cache_dir);
+    }
 
-    if(sys != NULL && sys->kernel_path != NULL)
+    if(rd_file != NULL)
     {
-        // kexec, copy busybox, etc. to new ramdisk
-        mkdir("/rd_tmp/multirom", 0755);
-        copy_file("/multirom/busybox", "/rd_tmp/multirom/busybox");
-        chmod("/rd_tmp/multirom/busybox", 0755);
-        copy_file("/multirom/reboot", "/rd_tmp/multirom/reboot");
-        chmod("/rd_tmp/multirom/reboot", 0755);
-        copy_file("/multirom/setup.sh", "/rd_tmp/multirom/setup.sh");
-        chmod("/rd_tmp/multirom/setup.sh", 0755);
-        copy_file("/multirom/setup-gen.sh", "/rd_tmp/multirom/setup-gen.sh");
+        remove(rd_out);
+        if(rename(rd_new, rd_out) < 0)
+        {
+            ERROR("Cannot replace %s!", rd_out);
+            goto exit;
+        }
     }
 
-    remove("/multirom/boot.cpio");
+    res = 0;
+exit:
+    free(cache_dir);
+    return res;
+}
+
+enum exit_status multirom_prepare_android_img(struct multirom_partition *part, struct multirom_rom_android_img *sys, struct multirom_romdata_android_img *data)
+{
+    int kexec = (sys != NULL && sys->kernel_path != NULL);
+    struct cpio_buf rd = { 0 };
 
-    if(shell_cmd("cd /rd_tmp; /multirom/busybox find . | /multirom/busybox cpio -H newc -o > /multirom/boot.cpio") != 0)
+    // Use the result of background preparation if it was for this ROM,
+    // kexec'd ramdisks are built in memory and handed to the kernel directly
+    if(multirom_staging_commit(part, sys, data) < 0)
     {
-        ERROR("Cannot repack ramdisk!");
+        trace_begin("build_android_img");
+        int built = multirom_build_android_img(part, sys, data, "/multirom", kexec ? &rd : NULL, NULL);
+        trace_end("build_android_img");
+        if(built < 0)
+            goto fail;
+    }
+    else if(kexec && cpio_buf_load(&rd, "/multirom/boot.cpio") < 0)
+    {
+        ERROR("Cannot read staged ramdisk");
         goto fail;
     }
 
-    remove_dir("/rd_tmp");
-
-    if(sys != NULL && sys->kernel_path != NULL)
+    if(kexec)
     {
         char *bl_cmdline = multirom_get_bootloader_cmdline();
         if(bl_cmdline == NULL)
@@ -285,8 +363,28 @@ enum exit_status multirom_prepare_android_img(struct multirom_partition *part, s
         char *new_cmdline = malloc(l1 + l2 + 1);
         strncpy(new_cmdline, sys->cmdline, l1);
         strcpy(new_cmdline + l1, bl_cmdline);
-        enum exit_status res = multirom_prepare_kexec(sys->kernel_path, "/multirom/boot.cpio", new_cmdline);
+
+        enum exit_status res = EXIT_KEXEC;
+        trace_begin("kexec_load");
+        int loaded = multirom_kexec_load(sys->kernel_path, rd.data, rd.size, new_cmdline);
+        trace_end("kexec_load");
+        if(loaded == KEXEC_LOAD_UNSUPPORTED)
+        {
+            if(cpio_buf_save(&rd, "/multirom/boot.cpio") < 0)
+            {
+                ERROR("Cannot write /multirom/boot.cpio");
+                goto fail;
+            }
+            res = multirom_prepare_kexec(sys->kernel_path, "/multirom/boot.cpio", new_cmdline);
+        }
+        else if(loaded < 0)
+        {
+            ERROR("Loading kexec failed");
+            goto fail;
+        }
+
         free(new_cmdline);
+        cpio_buf_free(&rd);
         return res;
     }
     else
@@ -36,10 +36,12 @@ enum exit_status
 };
 
 #include "multirom_rom.h"
+#include "cpio.h"
 
 enum exit_status multirom(void);
 enum exit_status multirom_prepare_boot(struct multirom_rom *to_boot, struct multirom_romdata *boot_profile);
 enum exit_status multirom_prepare_android_img(struct multirom_partition *part, struct multirom_rom_android_img *system, struct multirom_romdata_android_img *data);
+int multirom_build_android_img(struct multirom_partition *part, struct multirom_rom_android_img *sys, struct multirom_romdata_android_img *data, const char *out_dir, struct cpio_buf *out_buf, volatile int *cancel);
 enum exit_status multirom_prepare_kexec(const char *kernel_path, const char *ramdisk, const char *cmdline);
 
 #endif /* MULTIROM_MAIN_H_ */
@@ -17,6 +17,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <sys/klog.h>
 #include <sys/stat.h>
@@ -28,11 +29,16 @@
 #include <libbootimg.h>
 
 #include "multirom_misc.h"
+#include "multirom_kconfig.h"
+#include "trace.h"
 #include "framebuffer.h"
 #include "input.h"
 #include "log.h"
 #include "util.h"
 
+#define INPUT_DEBUG_CFG "/mnt/internal/multirom_input.txt"
+#define INPUT_DEBUG_REC "/mnt/internal/multirom_input.rec"
+
 void multirom_emergency_reboot(void)
 {
     if(multirom_init_fb(0) < 0)
@@ -100,60 +106,66 @@ int multirom_init_fb(int rotation)
     return 0;
 }
 
-int multirom_has_kexec(void)
+int multirom_init_fb_offscreen(int rotation)
 {
-    static int has_kexec = -2;
-    if(has_kexec != -2)
-        return has_kexec;
-
-    if(access("/proc/config.gz", F_OK) >= 0)
+    if(fb_open_offscreen(rotation) < 0)
     {
-        shell_cmd("/multirom/busybox zcat \"/proc/config.gz\" > \"/config\"");
-        has_kexec = 0;
+        ERROR("Failed to open offscreen framebuffer!");
+        return -1;
+    }
 
-        uint32_t i;
-        static const char *checks[] = {
-            "CONFIG_KEXEC_HARDBOOT=y",
-#ifndef MR_KEXEC_DTB
-            "CONFIG_ATAGS_PROC=y",
-#else
-            "CONFIG_PROC_DEVICETREE=y",
-#endif
-        };
-        //                   0             1       2     3
-        char *cmd_grep[] = { "/multirom/busybox", "grep", NULL, "/config", NULL };
-        for(i = 0; i < ARRAY_SIZE(checks); ++i)
-        {
-            cmd_grep[2] = (char*)checks[i];
-            if(run_cmd(cmd_grep) != 0)
-            {
-                has_kexec = -1;
-                ERROR("%s not found in /proc/config.gz!\n", checks[i]);
-            }
-        }
+    fb_fill(BLACK);
+    return 0;
+}
+
+// One-shot input record/replay request, INPUT_DEBUG_CFG contains either
+// "record" or "replay <speed %> [offscreen]". Returns 1 if the UI should
+// run headless.
+int multirom_load_input_debug(void)
+{
+    char line[64] = { 0 };
+    char mode[16], opt[16];
+    int speed = 100;
+    int n, res = 0;
 
-        remove("/config");
+    FILE *f = fopen(INPUT_DEBUG_CFG, "r");
+    if(!f)
+        return 0;
+
+    fgets(line, sizeof(line), f);
+    fclose(f);
+    remove(INPUT_DEBUG_CFG);
+
+    n = sscanf(line, "%15s %d %15s", mode, &speed, opt);
+    if(n >= 1 && strcmp(mode, "record") == 0)
+        input_record_set(INPUT_DEBUG_REC);
+    else if(n >= 1 && strcmp(mode, "replay") == 0)
+    {
+        input_replay_set(INPUT_DEBUG_REC, speed);
+        res = (n == 3 && strcmp(opt, "offscreen") == 0);
     }
     else
-    {
-        // Kernel without /proc/config.gz enabled - check for /proc/atags file,
-        // if it is present, there is good change kexec-hardboot is enabled too.
-        ERROR("/proc/config.gz is not available!\n");
+        ERROR("Unknown input debug request: %s\n", line);
+    return res;
+}
+
+int multirom_has_kexec(void)
+{
+    const struct multirom_kconfig *kconfig = multirom_kconfig_get();
+    uint32_t required = KCONFIG_KEXEC_HARDBOOT;
 #ifndef MR_KEXEC_DTB
-        const char *checkfile = "/proc/atags";
+    required |= KCONFIG_ATAGS_PROC;
 #else
-        const char *checkfile = "/proc/device-tree";
+    required |= KCONFIG_PROC_DEVICETREE;
 #endif
-        if(access(checkfile, R_OK) < 0)
-        {
-            ERROR("%s was not found!\n", checkfile);
-            has_kexec = -1;
-        }
-        else
-            has_kexec = 0;
-    }
 
-    return has_kexec;
+    if((kconfig->caps & required) != required)
+    {
+        ERROR("Kernel is missing kexec support (caps 0x%02x, required 0x%02x, source %d)\n",
+                kconfig->caps, required, kconfig->source);
+        return -1;
+    }
+    return 0;
 }
 
 char *multirom_get_bootloader_cmdline(void)
@@ -254,6 +266,7 @@ int multirom_copy_log(char *klog)
     if(klog)
     {
         multirom_save_log("/mnt/internal/multirom_error.txt", klog, strlen(klog));
+        multirom_save_trace();
         if(multirom_status.external_sd != NULL)
         {
             char path[256];
@@ -272,6 +285,21 @@ int multirom_copy_log(char *klog)
     return res;
 }
 
+// Chrome trace JSON of the boot so far, next to multirom_error.txt
+void multirom_save_trace(void)
+{
+    char path[256];
+
+    if(trace_export_json("/mnt/internal/multirom_trace.json") < 0)
+        ERROR("Failed to save boot trace!\n");
+
+    if(multirom_status.external_sd != NULL)
+    {
+        snprintf(path, sizeof(path), "%s/multirom_trace.json", multirom_status.external_sd);
+        trace_export_json(path);
+    }
+}
+
 int multirom_get_battery(void)
 {
     char buff[4];
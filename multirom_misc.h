@@ -23,11 +23,14 @@
 
 void multirom_emergency_reboot(void) __attribute__((noreturn));
 int multirom_init_fb(int rotation);
+int multirom_init_fb_offscreen(int rotation);
+int multirom_load_input_debug(void);
 int multirom_has_kexec(void);
 char *multirom_get_bootloader_cmdline(void);
 int multirom_load_kexec(struct multirom_status *s, struct multirom_rom *rom);
 char *multirom_get_klog(void);
 int multirom_copy_log(char *klog);
+void multirom_save_trace(void);
 int multirom_get_battery(void);
 void multirom_set_brightness(int val);
 void multirom_take_screenshot(void);
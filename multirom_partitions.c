@@ -20,16 +20,128 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/inotify.h>
 #include <sys/mount.h>
+#include <sys/syscall.h>
 #include <errno.h>
 
 #include "fstab.h"
+#include "trampoline/devices.h"
 #include "multirom_partitions.h"
 #include "multirom_status.h"
 #include "util.h"
 #include "log.h"
 
 #define BLOCKDEV_PREFIX "/dev/block/"
+#define COLDBOOT_WAIT_MAX 10000
+// used when /dev can't be watched
+#define COLDBOOT_POLL_INTERVAL 20
+
+// block device backed filesystems MultiROM mounted, flushed before kexec
+struct tracked_mount
+{
+    char *dev;
+    char *path;
+};
+
+struct mount_shutdown
+{
+    struct tracked_mount *m;
+    pthread_t thread;
+    int threaded;
+    uint32_t sync_ms;
+    uint32_t remount_ms;
+    int res;
+};
+
+static struct tracked_mount **tracked_mounts = NULL;
+static pthread_mutex_t tracked_mounts_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void free_tracked_mount(struct tracked_mount *m)
+{
+    free(m->dev);
+    free(m->path);
+    free(m);
+}
+
+static void track_mount(const char *dev, const char *path)
+{
+    struct tracked_mount *m = mzalloc(sizeof(struct tracked_mount));
+    m->dev = strdup(dev);
+    m->path = strdup(path);
+
+    pthread_mutex_lock(&tracked_mounts_mutex);
+    list_add(m, &tracked_mounts);
+    pthread_mutex_unlock(&tracked_mounts_mutex);
+}
+
+void multirom_untrack_mount(const char *path)
+{
+    struct tracked_mount **itr;
+
+    pthread_mutex_lock(&tracked_mounts_mutex);
+    for(itr = tracked_mounts; itr && *itr; ++itr)
+    {
+        if(strcmp((*itr)->path, path) == 0)
+        {
+            list_rm(*itr, &tracked_mounts, free_tracked_mount);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&tracked_mounts_mutex);
+}
+
+/*
+ * The trampoline creates the nodes needed to show the menu first and the
+ * rest in background (trampoline/devices.c), wait for external storage.
+ */
+static void wait_for_coldboot(void)
+{
+    struct timespec start, now;
+    struct pollfd pfd;
+    char buf[sizeof(struct inotify_event) + NAME_MAX + 1];
+    uint32_t waited = 0;
+    int fd;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    fd = inotify_init();
+    if(fd >= 0 && inotify_add_watch(fd, "/dev", IN_DELETE) < 0)
+    {
+        close(fd);
+        fd = -1;
+    }
+    if(fd < 0)
+        ERROR("Cannot watch /dev for coldboot, polling: %s", strerror(errno));
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
+    // checked after adding the watch, so that the removal can't be missed
+    while(access(COLDBOOT_PENDING_FILE, F_OK) >= 0 && waited < COLDBOOT_WAIT_MAX)
+    {
+        if(fd < 0)
+            usleep(COLDBOOT_POLL_INTERVAL*1000);
+        else if(poll(&pfd, 1, COLDBOOT_WAIT_MAX - waited) > 0)
+            read(fd, buf, sizeof(buf));
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        waited = timespec_diff(&start, &now);
+    }
+
+    if(waited)
+        INFO("Waited %u ms for the trampoline to create device nodes", waited);
+
+    if(fd >= 0)
+        close(fd);
+}
 
 void multirom_scan_partitions(void)
 {
@@ -38,6 +150,8 @@ void multirom_scan_partitions(void)
 
     INFO("Scanning for partitions...");
 
+    wait_for_coldboot();
+
     char *const cmd[] = { "/multirom/busybox", "blkid", NULL };
     char *res = run_get_stdout(cmd);
     if(res == NULL)
@@ -185,6 +299,7 @@ void multirom_mount_internal_storage(void)
         multirom_status.partition_internal = multirom_mount_fake_internal_storage();
         return;
     }
+    track_mount(fstab_part->device, "/mnt/data");
     struct multirom_partition *part = mzalloc(sizeof(struct multirom_partition));
     part->name = strdup("internal");
     part->mount_path = strdup("/mnt/internal");
@@ -233,6 +348,7 @@ int multirom_mount_partition(struct multirom_partition *part)
     mkdir(part->mount_path, 0755);
     if(mount(part->block_dev, part->mount_path, part->fstype, MS_NOATIME, "") == 0)
     {
+        track_mount(part->block_dev, part->mount_path);
         return 1;
     }
     else
@@ -241,3 +357,79 @@ int multirom_mount_partition(struct multirom_partition *part)
         return 0;
     }
 }
+
+static void *shutdown_mount(void *data)
+{
+    struct mount_shutdown *sd = data;
+    struct timespec start, synced, end;
+    int fd;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    fd = open(sd->m->path, O_RDONLY | O_DIRECTORY);
+    if(fd >= 0)
+    {
+        if(syscall(__NR_syncfs, fd) < 0)
+        {
+            ERROR("syncfs on %s failed: %s", sd->m->path, strerror(errno));
+            if(errno == ENOSYS)
+                sync();
+        }
+        close(fd);
+    }
+    else
+        ERROR("Cannot open %s: %s", sd->m->path, strerror(errno));
+
+    clock_gettime(CLOCK_MONOTONIC, &synced);
+
+    sd->res = mount(NULL, sd->m->path, NULL, MS_REMOUNT | MS_RDONLY, NULL);
+    if(sd->res < 0)
+        ERROR("Cannot remount %s read-only: %s", sd->m->path, strerror(errno));
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    sd->sync_ms = timespec_diff(&start, &synced);
+    sd->remount_ms = timespec_diff(&synced, &end);
+    return NULL;
+}
+
+/*
+ * Flushes and remounts read-only every filesystem MultiROM has mounted,
+ * all of them in parallel.
+ * returns: 0 if all of them are read-only now, -1 otherwise
+ */
+int multirom_shutdown_mounts(void)
+{
+    struct mount_shutdown *jobs;
+    struct timespec start, end;
+    int i, cnt, res = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pthread_mutex_lock(&tracked_mounts_mutex);
+    cnt = list_item_count(tracked_mounts);
+    jobs = mzalloc(sizeof(struct mount_shutdown) * (cnt ? cnt : 1));
+    for(i = 0; i < cnt; ++i)
+    {
+        jobs[i].m = tracked_mounts[i];
+        jobs[i].threaded = (pthread_create(&jobs[i].thread, NULL, shutdown_mount, &jobs[i]) == 0);
+        if(!jobs[i].threaded)
+            shutdown_mount(&jobs[i]);
+    }
+
+    for(i = 0; i < cnt; ++i)
+    {
+        if(jobs[i].threaded)
+            pthread_join(jobs[i].thread, NULL);
+        ERROR("Flushed %s (%s) in %u ms, remount %s in %u ms", jobs[i].m->path, jobs[i].m->dev,
+                jobs[i].sync_ms, jobs[i].res == 0 ? "ro" : "FAILED", jobs[i].remount_ms);
+        if(jobs[i].res < 0)
+            res = -1;
+    }
+    pthread_mutex_unlock(&tracked_mounts_mutex);
+
+    free(jobs);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ERROR("Shut down %d filesystem(s) in %u ms", cnt, timespec_diff(&start, &end));
+    return res;
+}
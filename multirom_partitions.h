@@ -48,5 +48,7 @@ void multirom_clear_partitions(void);
 void multirom_mount_internal_storage(void);
 struct multirom_partition *multirom_mount_fake_internal_storage(void);
 int multirom_mount_partition(struct multirom_partition *part);
+void multirom_untrack_mount(const char *path);
+int multirom_shutdown_mounts(void);
 
 #endif /* MULTIROM_PARTITIONS_H_ */
@@ -0,0 +1,226 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#include "cpio.h"
+#include "multirom_ramdisk.h"
+#include "util.h"
+#include "log.h"
+
+static char *read_whole_file(const char *path, uint32_t *size)
+{
+    FILE *f = fopen(path, "r");
+    if(!f)
+        return NULL;
+
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    rewind(f);
+
+    char *buf = malloc(len > 0 ? len : 1);
+    if(len < 0 || fread(buf, 1, len, f) != (size_t)len)
+    {
+        free(buf);
+        fclose(f);
+        return NULL;
+    }
+
+    fclose(f);
+    *size = len;
+    return buf;
+}
+
+static int is_extra_file(const struct multirom_rd_file *extra, const char *name)
+{
+    for(; extra && extra->name; ++extra)
+        if(strcmp(cpio_entry_path(extra->name), name) == 0)
+            return 1;
+    return 0;
+}
+
+// original inode of a hardlinked entry and the number it was given
+struct ino_map
+{
+    uint32_t ino;
+    uint32_t dev_major;
+    uint32_t dev_minor;
+    uint32_t new_ino;
+};
+
+/*
+ * Entries are renumbered from the writer's counter, so that they can't
+ * collide with the extra files. Links of one file have to keep sharing
+ * their number, the map remembers what it was renumbered to.
+ */
+static uint32_t renumber_ino(struct cpio_writer *w, const struct cpio_entry *e,
+        struct ino_map **map, int *map_cnt)
+{
+    struct ino_map *m;
+    int i;
+
+    if(e->nlink <= 1)
+        return w->next_ino++;
+
+    for(i = 0; i < *map_cnt; ++i)
+    {
+        m = &(*map)[i];
+        if(m->ino == e->ino && m->dev_major == e->dev_major && m->dev_minor == e->dev_minor)
+            return m->new_ino;
+    }
+
+    m = realloc(*map, (*map_cnt + 1)*sizeof(struct ino_map));
+    if(!m)
+        return w->next_ino++;
+    *map = m;
+
+    m = &(*map)[(*map_cnt)++];
+    m->ino = e->ino;
+    m->dev_major = e->dev_major;
+    m->dev_minor = e->dev_minor;
+    m->new_ino = w->next_ino++;
+    return m->new_ino;
+}
+
+static long get_peak_rss_kb(void)
+{
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) < 0)
+        return -1;
+    return usage.ru_maxrss;
+}
+
+int multirom_ramdisk_patch(const char *src, const char *dst, struct cpio_buf *dst_buf, const char *init_prepend,
+        const struct multirom_rd_file *extra, int compress, volatile int *cancel)
+{
+    struct cpio_reader *r = NULL;
+    struct cpio_writer *w = NULL;
+    struct cpio_entry e;
+    struct ino_map *inos = NULL;
+    int inos_cnt = 0;
+    struct timespec start, end;
+    char *prepend = NULL;
+    uint32_t prepend_size = 0;
+    int found_init = 0;
+    int res = -1, next;
+    uint64_t in_bytes;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if(init_prepend)
+    {
+        prepend = read_whole_file(init_prepend, &prepend_size);
+        if(!prepend)
+        {
+            ERROR("Cannot read %s\n", init_prepend);
+            goto exit;
+        }
+    }
+
+    r = cpio_reader_open(src);
+    if(!r)
+        goto exit;
+
+    if(dst_buf)
+        w = cpio_writer_open_mem(dst_buf, compress);
+    else
+        w = cpio_writer_open(dst, compress);
+    if(!w)
+        goto exit;
+
+    while((next = cpio_reader_next(r)) > 0)
+    {
+        if(cancel && *cancel)
+        {
+            INFO("Patching of ramdisk %s cancelled\n", src);
+            goto exit;
+        }
+
+        const char *name = cpio_entry_path(r->entry.name);
+        if(*name == 0 || strcmp(name, ".") == 0)
+            continue;
+
+        if(is_extra_file(extra, name))
+            continue;
+
+        e = r->entry;
+        e.name = (char*)name;
+        e.ino = renumber_ino(w, &e, &inos, &inos_cnt);
+
+        if(prepend && strcmp(name, "init.rc") == 0)
+        {
+            found_init = 1;
+            e.size += prepend_size;
+            if(cpio_writer_add(w, &e) < 0 || cpio_writer_write(w, prepend, prepend_size) < 0)
+                goto exit;
+        }
+        else if(cpio_writer_add(w, &e) < 0)
+            goto exit;
+
+        if(cpio_copy_data(w, r) < 0)
+            goto exit;
+    }
+
+    if(next < 0)
+    {
+        ERROR("Failed to read ramdisk %s\n", src);
+        goto exit;
+    }
+
+    if(prepend && !found_init)
+    {
+        ERROR("Ramdisk %s has no init.rc!\n", src);
+        goto exit;
+    }
+
+    for(; extra && extra->name; ++extra)
+    {
+        if(cpio_writer_add_file(w, cpio_entry_path(extra->name), extra->src, extra->mode) < 0)
+        {
+            ERROR("Failed to add %s to ramdisk\n", extra->name);
+            goto exit;
+        }
+    }
+
+    res = 0;
+exit:
+    in_bytes = r ? r->offset : 0;
+    if(w)
+    {
+        uint64_t out_bytes = w->written;
+        if(cpio_writer_close(w) < 0)
+            res = -1;
+        if(res == 0)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            ERROR("Patched ramdisk %s -> %s (%llu -> %llu bytes%s) in %u ms, peak RSS %ld kB\n",
+                    src, dst_buf ? "memory" : dst, (unsigned long long)in_bytes, (unsigned long long)out_bytes,
+                    compress ? ", gzipped" : "", timespec_diff(&start, &end), get_peak_rss_kb());
+        }
+    }
+    cpio_reader_close(r);
+    free(inos);
+    free(prepend);
+    if(res != 0 && !dst_buf)
+        remove(dst);
+    return res;
+}
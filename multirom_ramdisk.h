@@ -0,0 +1,45 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MULTIROM_RAMDISK_H_
+#define MULTIROM_RAMDISK_H_
+
+#include <stdint.h>
+
+#include "cpio.h"
+
+// A file to be added into the patched ramdisk. src == NULL
+// makes a directory, in which case mode should contain S_IFDIR.
+struct multirom_rd_file
+{
+    const char *name;
+    const char *src;
+    uint32_t mode;
+};
+
+/*
+ * Streams the (possibly gzipped) cpio archive src into dst, prepending
+ * the contents of init_prepend to init.rc and appending the NULL-name
+ * terminated extra array. If dst_buf is not NULL, the result is written
+ * there instead of the file dst. Entries of src which clash with extra files
+ * are dropped. If compress is set, dst is gzip-compressed. Returns -1
+ * without logging an error when *cancel becomes non-zero.
+ */
+int multirom_ramdisk_patch(const char *src, const char *dst, struct cpio_buf *dst_buf, const char *init_prepend,
+        const struct multirom_rd_file *extra, int compress, volatile int *cancel);
+
+#endif /* MULTIROM_RAMDISK_H_ */
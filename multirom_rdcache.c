@@ -0,0 +1,350 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "mincrypt/sha.h"
+
+#include "multirom_rdcache.h"
+#include "multirom_rom.h"
+#include "version.h"
+#include "util.h"
+#include "log.h"
+
+struct rdcache_entry
+{
+    char *name;
+    time_t mtime;
+};
+
+static void digest_to_hex(const uint8_t *digest, char *hex)
+{
+    static const char digits[] = "0123456789abcdef";
+    int i;
+    for(i = 0; i < SHA_DIGEST_SIZE; ++i)
+    {
+        hex[i*2] = digits[digest[i] >> 4];
+        hex[i*2+1] = digits[digest[i] & 0xF];
+    }
+    hex[SHA_DIGEST_SIZE*2] = 0;
+}
+
+/*
+ * Copies `from` into `to` or `to_buf` (if not NULL) and hashes the contents
+ * returns: size of the file or -1 on error
+ */
+static off_t sha_copy_file(SHA_CTX *ctx, const char *from, const char *to, struct cpio_buf *to_buf)
+{
+    char buf[16*1024];
+    ssize_t len;
+    off_t total = 0;
+    int out = -1;
+    int in = open(from, O_RDONLY);
+    if(in < 0)
+        return -1;
+
+    if(to)
+    {
+        out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(out < 0)
+        {
+            close(in);
+            return -1;
+        }
+    }
+
+    while((len = read(in, buf, sizeof(buf))) > 0)
+    {
+        SHA_update(ctx, buf, len);
+        if((out >= 0 && write(out, buf, len) != len) ||
+            (to_buf && cpio_buf_append(to_buf, buf, len) < 0))
+        {
+            len = -1;
+            break;
+        }
+        total += len;
+    }
+
+    close(in);
+    if(out >= 0 && close(out) < 0)
+        len = -1;
+    return len < 0 ? -1 : total;
+}
+
+int multirom_rdcache_key(const char *ramdisk, int ramdisk_by_stat, const char * const *inputs,
+        int flags, char *key)
+{
+    SHA_CTX ctx;
+    struct stat info;
+    char buf[256];
+    int len;
+
+    SHA_init(&ctx);
+
+    len = snprintf(buf, sizeof(buf), "MultiROM %d%s flags %d\n", VERSION_MULTIROM, VERSION_DEV_FIX, flags);
+    SHA_update(&ctx, buf, len);
+
+    if(ramdisk_by_stat)
+    {
+        if(stat(ramdisk, &info) < 0)
+            return -1;
+        len = snprintf(buf, sizeof(buf), "%s %lld %ld %llu\n", ramdisk, (long long)info.st_size,
+                (long)info.st_mtime, (unsigned long long)info.st_ino);
+        SHA_update(&ctx, buf, len);
+    }
+    else if(sha_copy_file(&ctx, ramdisk, NULL, NULL) < 0)
+        return -1;
+
+    for(; inputs && *inputs; ++inputs)
+    {
+        // file name too, so that the same content in a different role gives a different key,
+        // but not the dir, the plan is written to a different one when staging
+        const char *role = strrchr(*inputs, '/');
+        role = role ? role + 1 : *inputs;
+        SHA_update(&ctx, role, strlen(role) + 1);
+        if(sha_copy_file(&ctx, *inputs, NULL, NULL) < 0)
+        {
+            ERROR("rdcache: cannot hash %s: %s\n", *inputs, strerror(errno));
+            return -1;
+        }
+    }
+
+    digest_to_hex(SHA_final(&ctx), key);
+    return 0;
+}
+
+char *multirom_rdcache_dir(struct multirom_partition *part)
+{
+    char *base = multirom_get_basepath(part);
+    char *res = NULL;
+    if(base == NULL)
+        return NULL;
+
+    if(asprintf(&res, "%s/"RDCACHE_DIR, base) < 0)
+        res = NULL;
+    free(base);
+    return res;
+}
+
+static int read_checksum(const char *path, char *hex, off_t *size)
+{
+    long long sz;
+    int res = -1;
+    FILE *f = fopen(path, "r");
+    if(!f)
+        return -1;
+
+    if(fscanf(f, "%40s %lld", hex, &sz) == 2 && strlen(hex) == RDCACHE_KEY_LEN)
+    {
+        *size = sz;
+        res = 0;
+    }
+    fclose(f);
+    return res;
+}
+
+static void remove_entry(const char *cache_dir, const char *key)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s.cpio", cache_dir, key);
+    remove(path);
+    snprintf(path, sizeof(path), "%s/%s.sha1", cache_dir, key);
+    remove(path);
+}
+
+int multirom_rdcache_get(const char *cache_dir, const char *key, const char *dst, struct cpio_buf *dst_buf)
+{
+    char path[256];
+    char expected[RDCACHE_KEY_LEN+1];
+    char actual[RDCACHE_KEY_LEN+1];
+    off_t expected_size, size;
+    struct timespec start, end;
+    SHA_CTX ctx;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    snprintf(path, sizeof(path), "%s/%s.sha1", cache_dir, key);
+    if(read_checksum(path, expected, &expected_size) < 0)
+    {
+        INFO("rdcache: miss for %s\n", key);
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s.cpio", cache_dir, key);
+
+    if(dst_buf)
+        dst_buf->size = 0;
+
+    SHA_init(&ctx);
+    size = sha_copy_file(&ctx, path, dst, dst_buf);
+    digest_to_hex(SHA_final(&ctx), actual);
+
+    if(size != expected_size || strcmp(actual, expected) != 0)
+    {
+        ERROR("rdcache: entry %s is corrupted (%lld bytes, sha1 %s), removing\n",
+                key, (long long)size, actual);
+        remove_entry(cache_dir, key);
+        if(dst)
+            remove(dst);
+        return -1;
+    }
+
+    // partitions are mounted with noatime, mtime is used for LRU
+    utimes(path, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ERROR("rdcache: hit for %s, %lld bytes verified in %u ms\n", key, (long long)size, timespec_diff(&start, &end));
+    return 0;
+}
+
+static int compare_entry_age(const void *a, const void *b)
+{
+    const struct rdcache_entry *ea = *(const struct rdcache_entry **)a;
+    const struct rdcache_entry *eb = *(const struct rdcache_entry **)b;
+    if(ea->mtime == eb->mtime)
+        return 0;
+    return ea->mtime > eb->mtime ? -1 : 1;
+}
+
+static void free_rdcache_entry(struct rdcache_entry *e)
+{
+    free(e->name);
+    free(e);
+}
+
+static void rdcache_evict(const char *cache_dir, const char *key)
+{
+    struct rdcache_entry **entries = NULL;
+    struct dirent *dr;
+    struct stat info;
+    char path[256];
+    size_t len;
+    int i, cnt;
+
+    DIR *d = opendir(cache_dir);
+    if(!d)
+        return;
+
+    while((dr = readdir(d)) != NULL)
+    {
+        len = strlen(dr->d_name);
+        if(len != RDCACHE_KEY_LEN + 5 || strcmp(dr->d_name + RDCACHE_KEY_LEN, ".cpio") != 0)
+        {
+            // leftovers of interrupted writes. Another put may still be writing
+            // its temp files (staging and foreground boot can overlap), so only
+            // old ones go, and never those of the key being written here.
+            if(strstr(dr->d_name, ".tmp") && strncmp(dr->d_name, key, RDCACHE_KEY_LEN) != 0)
+            {
+                snprintf(path, sizeof(path), "%s/%s", cache_dir, dr->d_name);
+                if(stat(path, &info) >= 0 && time(NULL) - info.st_mtime > RDCACHE_TMP_MAX_AGE)
+                    remove(path);
+            }
+            continue;
+        }
+
+        snprintf(path, sizeof(path), "%s/%s", cache_dir, dr->d_name);
+        if(stat(path, &info) < 0)
+            continue;
+
+        struct rdcache_entry *e = mzalloc(sizeof(struct rdcache_entry));
+        e->name = strndup(dr->d_name, RDCACHE_KEY_LEN);
+        e->mtime = info.st_mtime;
+        list_add(e, &entries);
+    }
+    closedir(d);
+
+    cnt = list_item_count(entries);
+    if(cnt > RDCACHE_MAX_ENTRIES)
+    {
+        qsort(entries, cnt, sizeof(struct rdcache_entry*), compare_entry_age);
+        for(i = RDCACHE_MAX_ENTRIES; i < cnt; ++i)
+        {
+            INFO("rdcache: evicting %s\n", entries[i]->name);
+            remove_entry(cache_dir, entries[i]->name);
+        }
+    }
+
+    list_clear(&entries, free_rdcache_entry);
+}
+
+int multirom_rdcache_put(const char *cache_dir, const char *key, const char *src, const struct cpio_buf *src_buf)
+{
+    char tmp[256];
+    char path[256];
+    char hex[RDCACHE_KEY_LEN+1];
+    off_t size;
+    SHA_CTX ctx;
+    FILE *f;
+
+    if(mkdir(cache_dir, 0755) < 0 && errno != EEXIST)
+    {
+        ERROR("rdcache: cannot create %s: %s\n", cache_dir, strerror(errno));
+        return -1;
+    }
+
+    // write to temp files and rename, so that entries are never half-written.
+    // The thread id keeps two puts of the same key from sharing them.
+    snprintf(tmp, sizeof(tmp), "%s/%s.cpio.%d.tmp", cache_dir, key, gettid());
+    SHA_init(&ctx);
+    if(src_buf)
+    {
+        SHA_update(&ctx, src_buf->data, src_buf->size);
+        size = cpio_buf_save(src_buf, tmp) < 0 ? -1 : (off_t)src_buf->size;
+    }
+    else
+        size = sha_copy_file(&ctx, src, tmp, NULL);
+
+    if(size < 0)
+    {
+        ERROR("rdcache: cannot write %s: %s\n", tmp, strerror(errno));
+        goto fail;
+    }
+    digest_to_hex(SHA_final(&ctx), hex);
+
+    snprintf(path, sizeof(path), "%s/%s.cpio", cache_dir, key);
+    if(rename(tmp, path) < 0)
+        goto fail;
+
+    snprintf(tmp, sizeof(tmp), "%s/%s.sha1.%d.tmp", cache_dir, key, gettid());
+    f = fopen(tmp, "w");
+    if(!f)
+        goto fail;
+    fprintf(f, "%s %lld\n", hex, (long long)size);
+    if(fclose(f) != 0)
+        goto fail;
+
+    snprintf(path, sizeof(path), "%s/%s.sha1", cache_dir, key);
+    if(rename(tmp, path) < 0)
+        goto fail;
+
+    rdcache_evict(cache_dir, key);
+    return 0;
+
+fail:
+    remove(tmp);
+    remove_entry(cache_dir, key);
+    return -1;
+}
@@ -0,0 +1,54 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MULTIROM_RDCACHE_H_
+#define MULTIROM_RDCACHE_H_
+
+#include "multirom_partitions.h"
+#include "cpio.h"
+
+// Cache of prepared boot ramdisks, lives in <multirom dir>/.rdcache
+// (dirs starting with '.' are skipped by ROM scanning)
+#define RDCACHE_DIR ".rdcache"
+#define RDCACHE_MAX_ENTRIES 6
+// temp files older than this (in seconds) are leftovers of interrupted writes
+#define RDCACHE_TMP_MAX_AGE 600
+
+#define RDCACHE_KEY_LEN 40 // hex SHA-1
+
+/*
+ * Computes the key of a prepared ramdisk.
+ * `ramdisk`: the source ramdisk. If `ramdisk_by_stat` is set, only
+ *            its path, size, mtime and inode number are hashed, not the contents
+ * `inputs`: NULL terminated list of files whose contents go into the key,
+ *           along with their file names but not the dirs they are in
+ * `flags`: anything else which changes the output (e.g. compression)
+ * `key`: buffer of RDCACHE_KEY_LEN+1 bytes
+ */
+int multirom_rdcache_key(const char *ramdisk, int ramdisk_by_stat, const char * const *inputs,
+        int flags, char *key);
+
+// Returns path of the cache dir for the partition (allocated) or NULL
+char *multirom_rdcache_dir(struct multirom_partition *part);
+
+// Copies a cached ramdisk to file dst or into dst_buf if it is not NULL,
+// verifying its checksum. 0 on hit, -1 on miss.
+int multirom_rdcache_get(const char *cache_dir, const char *key, const char *dst, struct cpio_buf *dst_buf);
+// Stores file src (or src_buf if not NULL) under key and evicts least recently used entries
+int multirom_rdcache_put(const char *cache_dir, const char *key, const char *src, const struct cpio_buf *src_buf);
+
+#endif /* MULTIROM_RDCACHE_H_ */
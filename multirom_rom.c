@@ -27,26 +27,59 @@
 
 #include "multirom_rom.h"
 #include "multirom_status.h"
+#include "jobs.h"
 #include "util.h"
 #include "log.h"
 
+struct scan_job
+{
+    struct multirom_partition *part;
+    struct multirom_rom **roms;
+    struct job *job;
+};
+
+static int scan_roms_job(void *data, volatile int *cancel)
+{
+    struct scan_job *s = data;
+    s->roms = multirom_scan_roms(s->part);
+    return 0;
+}
+
 /*
- * Scans for ROMs in all partitions.
+ * Scans for ROMs in all partitions, each partition in its own job.
+ * The ROM list keeps the partition order.
  */
 void multirom_scan_all_roms()
 {
-    struct multirom_rom **roms = multirom_scan_roms(multirom_status.partition_internal);
-    list_add_from_list(roms, &multirom_status.roms);
-    free(roms);
+    struct scan_job *scans;
+    int i, cnt;
+
+    cnt = 1 + list_item_count(multirom_status.partitions_external);
+    scans = mzalloc(cnt*sizeof(struct scan_job));
 
-    struct multirom_partition **part_ptr;
+    scans[0].part = multirom_status.partition_internal;
+    for(i = 1; i < cnt; ++i)
+        scans[i].part = multirom_status.partitions_external[i-1];
 
-    for(part_ptr = multirom_status.partitions_external; part_ptr != NULL && *part_ptr != NULL; part_ptr++)
+    // the user is waiting for the list
+    for(i = 0; i < cnt; ++i)
     {
-        roms = multirom_scan_roms(*part_ptr);
-        list_add_from_list(roms, &multirom_status.roms);
-        free(roms);
+        scans[i].job = job_submit(scan_roms_job, &scans[i], JOB_PRIO_HIGH, NULL);
+        if(!scans[i].job)
+            scan_roms_job(&scans[i], NULL);
     }
+
+    for(i = 0; i < cnt; ++i)
+    {
+        if(scans[i].job)
+        {
+            job_wait(scans[i].job);
+            job_release(scans[i].job);
+        }
+        list_add_from_list(scans[i].roms, &multirom_status.roms);
+        free(scans[i].roms);
+    }
+    free(scans);
 }
 
 /*
@@ -59,13 +92,8 @@ void multirom_scan_all_roms()
 struct multirom_rom **multirom_scan_roms(struct multirom_partition *partition)
 {
     INFO("Scanning for roms...");
-    char *multirom_basepath;
-    int res;
-    if(partition->type == PART_INTERNAL)
-        res = asprintf(&multirom_basepath, "%s/multirom", partition->mount_path);
-    else
-        res = asprintf(&multirom_basepath, "%s/multirom-"TARGET_DEVICE, partition->mount_path);
-    if(res < 0)
+    char *multirom_basepath = multirom_get_basepath(partition);
+    if(multirom_basepath == NULL)
         goto fail;
 
     if(access(multirom_basepath, F_OK) < 0)
@@ -126,6 +154,24 @@ done:
     return roms;
 }
 
+/*
+ * Get the path of the MultiROM dir of a partition
+ * `partition`: the partition
+ * returns: a newly allocated string or NULL
+ */
+char *multirom_get_basepath(struct multirom_partition *partition)
+{
+    char *multirom_basepath;
+    int res;
+    if(partition->type == PART_INTERNAL)
+        res = asprintf(&multirom_basepath, "%s/multirom", partition->mount_path);
+    else
+        res = asprintf(&multirom_basepath, "%s/multirom-"TARGET_DEVICE, partition->mount_path);
+    if(res < 0)
+        return NULL;
+    return multirom_basepath;
+}
+
 /*
  * Parse a ROM and return its information
  * `multirom_basepath`: the path to the multirom dir of the partition
@@ -169,17 +215,17 @@ struct multirom_rom *multirom_parse_rom_entry(const char *multirom_basepath, con
         char line[1024];
         char key[256];
         char value[256];
-        char *pch;
+        char *pch, *saveptr;
 
         while((fgets(line, sizeof(line), f)))
         {
             if(line[0] == '#')
                 continue;
 
-            pch = strtok(line, "=\n");
+            pch = strtok_r(line, "=\n", &saveptr);
             if(pch == NULL) continue;
             strncpy(key, pch, sizeof(key));
-            pch = strtok(NULL, "\n");
+            pch = strtok_r(NULL, "\n", &saveptr);
             if(pch == NULL) continue;
             strncpy(value, pch, sizeof(value));
 
@@ -499,17 +545,17 @@ struct multirom_romdata *multirom_parse_romdata_entry(const char *rom_basepath,
         char line[1024];
         char key[256];
         char value[256];
-        char *pch;
+        char *pch, *saveptr;
 
         while((fgets(line, sizeof(line), f)))
         {
             if(line[0] == '#')
                 continue;
 
-            pch = strtok(line, "=\n");
+            pch = strtok_r(line, "=\n", &saveptr);
             if(pch == NULL) continue;
             strncpy(key, pch, sizeof(key));
-            pch = strtok(NULL, "\n");
+            pch = strtok_r(NULL, "\n", &saveptr);
             if(pch == NULL) continue;
             strncpy(value, pch, sizeof(value));
 
@@ -0,0 +1,302 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "multirom_staging.h"
+#include "multirom_main.h"
+#include "trace.h"
+#include "util.h"
+#include "log.h"
+
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+
+struct staging_job
+{
+    struct multirom_partition *part;
+    struct multirom_rom_android_img *sys;
+    struct multirom_romdata_android_img *data;
+};
+
+/*
+ * Not a job in the jobs.h pool: the build has to wait for the selection to
+ * settle, runs in the idle I/O class, and is raised to normal CPU and I/O
+ * priority while it is running once the user boots that ROM. Pool jobs
+ * have a fixed priority and would hold a pool thread for the whole
+ * debounce delay.
+ */
+struct staging_thread
+{
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int run;
+    pid_t tid;
+    volatile int cancel;
+    int urgent;
+
+    struct staging_job pending;
+    int has_pending;
+    struct timespec pending_since;
+
+    struct staging_job current;
+    int busy;
+
+    struct staging_job done;
+    int has_done;
+};
+
+static struct staging_thread staging = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .run = 0,
+};
+
+static int job_equal(const struct staging_job *a, const struct staging_job *b)
+{
+    return a->part == b->part && a->sys == b->sys && a->data == b->data;
+}
+
+static void set_thread_priority(pid_t tid, int background)
+{
+    int ioprio;
+    if(background)
+        ioprio = (IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+    else
+        ioprio = (IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | 4;
+
+    setpriority(PRIO_PROCESS, tid, background ? STAGING_NICE : 0);
+    syscall(__NR_ioprio_set, IOPRIO_WHO_PROCESS, tid, ioprio);
+}
+
+static void clean_staging_dir(void)
+{
+    remove(STAGING_DIR "/boot.cpio");
+    remove(STAGING_DIR "/boot.cpio.new");
+    remove(STAGING_DIR "/setup.plan");
+}
+
+static void *staging_thread_work(void *data)
+{
+    struct staging_thread *t = (struct staging_thread*)data;
+    struct staging_job job;
+    struct timespec start, end, deadline;
+    int res;
+
+    pthread_mutex_lock(&t->mutex);
+    t->tid = gettid();
+    set_thread_priority(t->tid, 1);
+
+    while(t->run)
+    {
+        if(!t->has_pending)
+        {
+            pthread_cond_wait(&t->cond, &t->mutex);
+            continue;
+        }
+
+        // wait for the selection to settle, so scrolling through
+        // the list does not start a job for every item
+        if(!t->urgent)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            uint32_t elapsed = timespec_diff(&t->pending_since, &end);
+            if(elapsed < STAGING_DELAY)
+            {
+                cond_deadline(&deadline, STAGING_DELAY - elapsed);
+                pthread_cond_timedwait(&t->cond, &t->mutex, &deadline);
+                continue;
+            }
+        }
+
+        job = t->pending;
+        t->current = job;
+        t->has_pending = 0;
+        t->has_done = 0;
+        t->busy = 1;
+        t->cancel = 0;
+        set_thread_priority(t->tid, !t->urgent);
+        pthread_mutex_unlock(&t->mutex);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        clean_staging_dir();
+        trace_begin("staging_build");
+        res = multirom_build_android_img(job.part, job.sys, job.data, STAGING_DIR, NULL, &t->cancel);
+        trace_end("staging_build");
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        pthread_mutex_lock(&t->mutex);
+        t->busy = 0;
+        if(res == 0 && !t->cancel)
+        {
+            t->done = job;
+            t->has_done = 1;
+            ERROR("staging: boot prepared in background in %u ms\n", timespec_diff(&start, &end));
+        }
+        else
+            clean_staging_dir();
+        set_thread_priority(t->tid, 1);
+        pthread_cond_broadcast(&t->cond);
+    }
+
+    pthread_mutex_unlock(&t->mutex);
+    return NULL;
+}
+
+void multirom_staging_start(struct multirom_rom *rom, struct multirom_romdata *profile)
+{
+    struct staging_job job;
+
+    if(profile->type != ROMDATA_TYPE_ANDROID_IMG)
+    {
+        // nothing to prepare, just stop whatever is going on
+        pthread_mutex_lock(&staging.mutex);
+        staging.has_pending = 0;
+        staging.cancel = 1;
+        pthread_mutex_unlock(&staging.mutex);
+        return;
+    }
+
+    job.part = rom->partition;
+    job.sys = rom->type == ROM_TYPE_ANDROID_IMG ? rom->android_img : NULL;
+    job.data = profile->android_img;
+
+    pthread_mutex_lock(&staging.mutex);
+
+    if((staging.busy && job_equal(&job, &staging.current)) ||
+        (staging.has_done && job_equal(&job, &staging.done)))
+    {
+        // back on the ROM being built, a selection in between could have
+        // queued another job and cancelled this one
+        staging.has_pending = 0;
+        staging.cancel = 0;
+        pthread_mutex_unlock(&staging.mutex);
+        return;
+    }
+
+    staging.pending = job;
+    staging.has_pending = 1;
+    staging.urgent = 0;
+    clock_gettime(CLOCK_MONOTONIC, &staging.pending_since);
+    if(staging.busy)
+        staging.cancel = 1;
+
+    if(!staging.run)
+    {
+        mkdir(STAGING_DIR, 0755);
+        staging.run = 1;
+        pthread_create(&staging.thread, NULL, staging_thread_work, &staging);
+    }
+    pthread_cond_broadcast(&staging.cond);
+    pthread_mutex_unlock(&staging.mutex);
+}
+
+void multirom_staging_cancel(void)
+{
+    pthread_mutex_lock(&staging.mutex);
+    staging.has_pending = 0;
+    staging.has_done = 0;
+    staging.cancel = 1;
+    while(staging.busy)
+        pthread_cond_wait(&staging.cond, &staging.mutex);
+    pthread_mutex_unlock(&staging.mutex);
+}
+
+void multirom_staging_stop(void)
+{
+    multirom_staging_cancel();
+
+    pthread_mutex_lock(&staging.mutex);
+    if(!staging.run)
+    {
+        pthread_mutex_unlock(&staging.mutex);
+        return;
+    }
+    staging.run = 0;
+    pthread_cond_broadcast(&staging.cond);
+    pthread_mutex_unlock(&staging.mutex);
+
+    pthread_join(staging.thread, NULL);
+    clean_staging_dir();
+    rmdir(STAGING_DIR);
+}
+
+int multirom_staging_commit(struct multirom_partition *part, struct multirom_rom_android_img *sys, struct multirom_romdata_android_img *data)
+{
+    struct staging_job job = { part, sys, data };
+    struct timespec start, end;
+    int res = -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pthread_mutex_lock(&staging.mutex);
+    if((staging.has_pending && job_equal(&job, &staging.pending)) ||
+        (staging.busy && job_equal(&job, &staging.current)))
+    {
+        // the user is waiting now, skip the delay and run at full speed
+        staging.urgent = 1;
+        if(staging.busy)
+            set_thread_priority(staging.tid, 0);
+        pthread_cond_broadcast(&staging.cond);
+
+        while((staging.has_pending && job_equal(&job, &staging.pending)) ||
+            (staging.busy && job_equal(&job, &staging.current)))
+        {
+            pthread_cond_wait(&staging.cond, &staging.mutex);
+        }
+    }
+    else
+    {
+        // a different ROM is booted, don't compete with its foreground build
+        staging.has_pending = 0;
+        if(staging.busy)
+            staging.cancel = 1;
+    }
+
+    if(staging.has_done && job_equal(&job, &staging.done))
+    {
+        staging.has_done = 0;
+        if(rename(STAGING_DIR "/setup.plan", "/multirom/setup.plan") == 0 &&
+            rename(STAGING_DIR "/boot.cpio", "/multirom/boot.cpio") == 0)
+        {
+            res = 0;
+        }
+        else
+            ERROR("staging: cannot move staged files: %s\n", strerror(errno));
+    }
+    pthread_mutex_unlock(&staging.mutex);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if(res == 0)
+        ERROR("staging: using staged boot, waited %u ms\n", timespec_diff(&start, &end));
+    else
+        INFO("staging: nothing staged for this ROM\n");
+    return res;
+}
@@ -0,0 +1,45 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MULTIROM_STAGING_H_
+#define MULTIROM_STAGING_H_
+
+#include "multirom_rom.h"
+
+/*
+ * Background preparation of the boot ramdisk of the highlighted ROM.
+ * The result is built in STAGING_DIR and moved to /multirom on boot.
+ */
+#define STAGING_DIR "/multirom/staging"
+// selection must stay the same for this long before work starts (ms)
+#define STAGING_DELAY 400
+// niceness of the staging thread while the UI is in use
+#define STAGING_NICE 10
+
+// Schedules preparation of rom + profile, replacing any previous job
+void multirom_staging_start(struct multirom_rom *rom, struct multirom_romdata *profile);
+// Drops the pending job and staged result, waits for the running one to stop
+void multirom_staging_cancel(void);
+// Stops the staging thread
+void multirom_staging_stop(void);
+/*
+ * Waits for the job for these arguments if there is one and moves its
+ * result to /multirom. Returns 0 if the staged result was used, -1 otherwise.
+ */
+int multirom_staging_commit(struct multirom_partition *part, struct multirom_rom_android_img *sys, struct multirom_romdata_android_img *data);
+
+#endif /* MULTIROM_STAGING_H_ */
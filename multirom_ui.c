@@ -35,7 +35,10 @@
 #include "pong.h"
 #include "progressdots.h"
 #include "multirom_ui_themes.h"
+#include "multirom_staging.h"
+#include "multirom_kexec.h"
 #include "workers.h"
+#include "jobs.h"
 #include "hooks.h"
 
 
@@ -60,7 +63,8 @@ uint32_t CLR_SECONDARY = LBLUE2;
 
 int multirom_ui(struct multirom_rom **to_boot, struct multirom_romdata **boot_profile)
 {
-    if(multirom_init_fb(0) < 0)
+    int offscreen = multirom_load_input_debug();
+    if((offscreen ? multirom_init_fb_offscreen(0) : multirom_init_fb(0)) < 0)
         return UI_EXIT_BOOT_ROM;
 
     fb_freeze(1);
@@ -111,6 +115,10 @@ int multirom_ui(struct multirom_rom **to_boot, struct multirom_romdata **boot_pr
     while(1)
     {
         pthread_mutex_lock(&exit_code_mutex);
+        // nobody can see or touch an offscreen UI
+        if(offscreen && exit_ui_code == -1 && input_replay_done())
+            exit_ui_code = UI_EXIT_REBOOT;
+
         if(exit_ui_code != -1)
         {
             pthread_mutex_unlock(&exit_code_mutex);
@@ -128,6 +136,8 @@ int multirom_ui(struct multirom_rom **to_boot, struct multirom_romdata **boot_pr
 
         if(loop_act & LOOP_EXT_RESCAN)
         {
+            // the staged job points to the ROMs being freed
+            multirom_staging_cancel();
             list_clear(&multirom_status.roms, free_multirom_rom);
             multirom_clear_partitions();
 
@@ -193,7 +203,8 @@ int multirom_ui(struct multirom_rom **to_boot, struct multirom_romdata **boot_pr
 
         pthread_mutex_unlock(&exit_code_mutex);
 
-        usleep(100000);
+        // sleeps unless a background job has finished
+        jobs_run_completions(100);
     }
 
     keyaction_enable(0);
@@ -251,6 +262,10 @@ int multirom_ui(struct multirom_rom **to_boot, struct multirom_romdata **boot_pr
     mrom_hook_before_fb_close();
 #endif
     fb_close();
+
+    // keep the replay and latency stats
+    if(offscreen)
+        multirom_copy_log(NULL);
     return exit_ui_code;
 }
 
@@ -576,6 +591,8 @@ void multirom_ui_tab_rom_selected(listview_item *prev, listview_item *now)
     cur_theme->center_rom_name(t, rom->name, t->rom_profile->text);
 
     fb_draw();
+
+    multirom_staging_start(rom, profile);
 }
 
 void multirom_ui_tab_rom_confirmed(listview_item *it)
@@ -674,6 +691,10 @@ void multirom_ui_tab_rom_boot_btn(int action)
     }
 #endif
 
+    // read the kernel while the UI is torn down and "Booting ROM..." is shown
+    if(rom->type == ROM_TYPE_ANDROID_IMG && rom->android_img->kernel_path != NULL)
+        multirom_kexec_prefetch(rom->android_img->kernel_path);
+
     pthread_mutex_lock(&exit_code_mutex);
     selected_rom = rom;
     selected_profile = profile;
@@ -777,14 +798,23 @@ void multirom_ui_reboot_btn(int action)
     pthread_mutex_unlock(&exit_code_mutex);
 }
 
-void multirom_ui_tab_misc_copy_log(int action)
+static volatile int copy_log_running = 0;
+
+static int multirom_ui_copy_log_job(void *data, volatile int *cancel)
 {
     //multirom_dump_status(mrom_status);
+    return multirom_copy_log(NULL);
+}
 
-    int res = multirom_copy_log(NULL);
-
+static void multirom_ui_copy_log_done(struct job *job, int res, void *data)
+{
     static const char *text[] = { "Failed!", "Success!" };
 
+    copy_log_running = 0;
+    if(res == JOB_CANCELLED)
+        return;
+
+    pthread_mutex_lock(&exit_code_mutex);
     active_msgbox = fb_create_msgbox(416*DPI_MUL, 260*DPI_MUL, res ? DRED : CLR_PRIMARY);
     fb_msgbox_add_text(-1, 50*DPI_MUL, SIZE_NORMAL, (char*)text[res+1]);
     if(res == 0)
@@ -794,6 +824,23 @@ void multirom_ui_tab_misc_copy_log(int action)
     fb_draw();
     fb_freeze(1);
     set_touch_handlers_mode(HANDLERS_ALL);
+    pthread_mutex_unlock(&exit_code_mutex);
+}
+
+// the log is written in the background, the result is shown by the UI loop
+void multirom_ui_tab_misc_copy_log(int action)
+{
+    struct job *job;
+
+    if(copy_log_running)
+        return;
+
+    copy_log_running = 1;
+    job = job_submit(multirom_ui_copy_log_job, NULL, JOB_PRIO_NORMAL, multirom_ui_copy_log_done);
+    if(job)
+        job_release(job);
+    else
+        multirom_ui_copy_log_done(NULL, multirom_ui_copy_log_job(NULL, NULL), NULL);
 }
 
 void multirom_ui_tab_misc_rescan(int action)
@@ -39,6 +39,7 @@
 #define BALL_W (25*DPI_MUL)
 #define DEFAULT_BALL_SPEED (10*DPI_MUL)
 #define BALL_SPEED_MOD ((PADDLE_W/2)/ball_speed)
+#define FRAME_MS 16
 
 #define COMPUTER L
 #define COMPUTER_SPEED (10*DPI_MUL)
@@ -98,9 +99,12 @@ void pong(void)
 
     int step = 0;
     volatile int run = 1;
+    int64_t now, next_frame = get_mono_us()/1000;
     while(run)
     {
-        switch(get_last_key())
+        // sleep until the next frame, but handle keys as they come
+        now = get_mono_us()/1000;
+        switch(wait_for_key_timeout(next_frame > now ? next_frame - now : 0))
         {
             case KEY_POWER:
                 run = 0;
@@ -120,10 +124,15 @@ void pong(void)
                 break;
         }
 
+        now = get_mono_us()/1000;
+        if(now < next_frame)
+            continue;
+        // do not try to catch up after a long frame
+        next_frame = (now - next_frame < FRAME_MS) ? next_frame + FRAME_MS : now + FRAME_MS;
+
         step = pong_do_movement(step);
 
         fb_request_draw();
-        usleep(16000);
     }
 
     rm_touch_handler(&pong_touch_handler, NULL);
@@ -24,7 +24,7 @@
 // ms
 #define SWITCH_SPEED 800
 
-static void progdots_animate(uint32_t diff, void *data)
+static uint32_t progdots_animate(uint32_t diff, void *data)
 {
     progdots *p = (progdots*)data;
 
@@ -40,6 +40,8 @@ static void progdots_animate(uint32_t diff, void *data)
     }
     else
         p->switch_timer -= diff;
+
+    return p->switch_timer;
 }
 
 progdots *progdots_create(int x, int y)
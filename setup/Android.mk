@@ -0,0 +1,19 @@
+LOCAL_PATH:= $(call my-dir)
+include $(CLEAR_VARS)
+
+LOCAL_C_INCLUDES += $(multirom_local_path)
+LOCAL_SRC_FILES := \
+    setup.c \
+    ../util.c \
+    ../trace.c
+
+LOCAL_MODULE := multirom_setup
+LOCAL_MODULE_TAGS := eng
+
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+LOCAL_MODULE_PATH := $(PRODUCT_OUT)/multirom
+#LOCAL_UNSTRIPPED_PATH := $(TARGET_ROOT_OUT_UNSTRIPPED)/multirom
+
+LOCAL_STATIC_LIBRARIES := libcutils libc
+
+include $(BUILD_EXECUTABLE)
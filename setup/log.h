@@ -0,0 +1,10 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <cutils/klog.h>
+
+#define ERROR(x...)   KLOG_ERROR("multirom-setup", x)
+#define NOTICE(x...)  KLOG_NOTICE("multirom-setup", x)
+#define INFO(x...)    KLOG_INFO("multirom-setup", x)
+
+#endif
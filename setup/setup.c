@@ -0,0 +1,494 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Executes the setup plan generated by MultiROM (see etc/readme) before
+ * the ROM's init mounts its partitions: image files are bound to loop
+ * devices and the by-name block nodes are replaced with links to them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/loop.h>
+#include <linux/reboot.h>
+#include <cutils/uevent.h>
+#include <cutils/android_reboot.h>
+
+#include "log.h"
+#include "../util.h"
+#include "../trace.h"
+
+#define PLAN_PATH "/multirom/setup.plan"
+#define READY_PATH "/multirom/ready"
+#define FAIL_LED_PATH "/sys/class/led/fih_led/control"
+#define FAIL_LED_VALUE "01 0 1"
+#define EMMC_FORCE_RO_PATH "/sys/devices/platform/msm_sdcc.1/mmc_host/mmc0/mmc0:0001/block/mmcblk0/force_ro"
+
+// whole setup must finish in this time, init waits for us
+#define SETUP_TIMEOUT 7000
+// ueventd creates nodes a bit after the kernel sends the uevent,
+// so keep checking often for a while after each one
+#define UEVENT_RECHECK_WINDOW 500
+#define UEVENT_RECHECK_INTERVAL 10
+// on a busy boot the node can show up much later, never stop checking
+#define UEVENT_RECHECK_MAX 100
+// the watchdog reboots on its own if the setup still hasn't given up
+#define WATCHDOG_GRACE 2
+#define UEVENT_MSG_LEN 1024
+
+#define MAX_ARGS 4
+
+#ifndef LOOP_CTL_GET_FREE
+#define LOOP_CTL_GET_FREE 0x4C82
+#endif
+
+static struct timespec start_time;
+static int uevent_fd = -1;
+static volatile sig_atomic_t watchdog_fired = 0;
+
+static uint32_t elapsed_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return timespec_diff(&start_time, &now);
+}
+
+static void drain_uevents(void)
+{
+    char msg[UEVENT_MSG_LEN+2];
+    while(uevent_kernel_multicast_recv(uevent_fd, msg, UEVENT_MSG_LEN) > 0);
+}
+
+static int wait_for_node(const char *path)
+{
+    struct pollfd pfd;
+    uint32_t now, recheck_until = 0;
+    int timeout;
+
+    pfd.fd = uevent_fd;
+    pfd.events = POLLIN;
+
+    while(access(path, F_OK) < 0)
+    {
+        now = elapsed_ms();
+        if(now >= SETUP_TIMEOUT || watchdog_fired)
+        {
+            ERROR("Timed out waiting for %s\n", path);
+            return -1;
+        }
+
+        timeout = imin(SETUP_TIMEOUT - now,
+                now < recheck_until ? UEVENT_RECHECK_INTERVAL : UEVENT_RECHECK_MAX);
+
+        if(uevent_fd >= 0)
+        {
+            if(poll(&pfd, 1, timeout) > 0)
+            {
+                drain_uevents();
+                recheck_until = elapsed_ms() + UEVENT_RECHECK_WINDOW;
+            }
+        }
+        else
+            usleep(timeout*1000);
+    }
+    return 0;
+}
+
+static int find_free_loop(char *path, size_t size)
+{
+    struct loop_info64 info;
+    int fd, res, i;
+
+    fd = open("/dev/loop-control", O_RDWR | O_CLOEXEC);
+    if(fd >= 0)
+    {
+        res = ioctl(fd, LOOP_CTL_GET_FREE);
+        close(fd);
+        if(res >= 0)
+        {
+            snprintf(path, size, "/dev/block/loop%d", res);
+            return 0;
+        }
+        ERROR("LOOP_CTL_GET_FREE failed: %s\n", strerror(errno));
+    }
+
+    // kernel without loop-control, look for an unbound device
+    for(i = 0; i < 256; ++i)
+    {
+        snprintf(path, size, "/dev/block/loop%d", i);
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if(fd < 0)
+        {
+            if(errno == ENOENT)
+                break;
+            continue;
+        }
+        res = ioctl(fd, LOOP_GET_STATUS64, &info);
+        close(fd);
+        if(res < 0 && errno == ENXIO)
+            return 0;
+    }
+
+    ERROR("No free loop device\n");
+    return -1;
+}
+
+static int bind_loop(const char *loop, const char *image)
+{
+    struct loop_info64 info;
+    int loop_fd = -1, img_fd = -1, res = -1;
+    int ro = 0;
+
+    img_fd = open(image, O_RDWR | O_CLOEXEC);
+    if(img_fd < 0 && (errno == EROFS || errno == EACCES))
+    {
+        ro = 1;
+        img_fd = open(image, O_RDONLY | O_CLOEXEC);
+    }
+    if(img_fd < 0)
+    {
+        ERROR("Cannot open %s: %s\n", image, strerror(errno));
+        goto exit;
+    }
+
+    loop_fd = open(loop, (ro ? O_RDONLY : O_RDWR) | O_CLOEXEC);
+    if(loop_fd < 0)
+    {
+        ERROR("Cannot open %s: %s\n", loop, strerror(errno));
+        goto exit;
+    }
+
+    if(ioctl(loop_fd, LOOP_SET_FD, img_fd) < 0)
+    {
+        ERROR("LOOP_SET_FD on %s failed: %s\n", loop, strerror(errno));
+        goto exit;
+    }
+
+    memset(&info, 0, sizeof(info));
+    strncpy((char*)info.lo_file_name, image, LO_NAME_SIZE-1);
+    if(ro)
+        info.lo_flags |= LO_FLAGS_READ_ONLY;
+
+    if(ioctl(loop_fd, LOOP_SET_STATUS64, &info) < 0)
+    {
+        ERROR("LOOP_SET_STATUS64 on %s failed: %s\n", loop, strerror(errno));
+        ioctl(loop_fd, LOOP_CLR_FD, 0);
+        goto exit;
+    }
+
+    res = 0;
+exit:
+    if(loop_fd >= 0)
+        close(loop_fd);
+    if(img_fd >= 0)
+        close(img_fd);
+    return res;
+}
+
+static int cmd_mkdir(char **args)
+{
+    if(mkdir(args[0], 0755) < 0 && errno != EEXIST)
+    {
+        ERROR("Cannot create %s: %s\n", args[0], strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int cmd_waitfor(char **args)
+{
+    return wait_for_node(args[0]);
+}
+
+// mount <fstype> <device> <dir>
+static int cmd_mount(char **args)
+{
+    if(mount(args[1], args[2], args[0], MS_NOATIME, NULL) < 0)
+    {
+        ERROR("Cannot mount %s to %s: %s\n", args[1], args[2], strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// replaceblk <block node> <image>
+static int cmd_replaceblk(char **args)
+{
+    char loop[64];
+    char tmp[256];
+    char *real = NULL;
+    struct stat info;
+    int res = -1;
+
+    if(stat(args[1], &info) < 0 || !S_ISREG(info.st_mode))
+    {
+        ERROR("%s is not a file\n", args[1]);
+        return -1;
+    }
+
+    if(find_free_loop(loop, sizeof(loop)) < 0 || wait_for_node(loop) < 0)
+        return -1;
+
+    if(bind_loop(loop, args[1]) < 0)
+        return -1;
+
+    if(wait_for_node(args[0]) < 0)
+        return -1;
+
+    real = readlink_recursive(args[0]);
+    if(real == NULL || wait_for_node(real) < 0)
+        goto exit;
+
+    // swap the node for a link to the loop device in one step,
+    // nobody can see it missing
+    snprintf(tmp, sizeof(tmp), "%s.mrom", real);
+    unlink(tmp);
+    if(symlink(loop, tmp) < 0 || rename(tmp, real) < 0)
+    {
+        ERROR("Cannot replace %s: %s\n", real, strerror(errno));
+        unlink(tmp);
+        goto exit;
+    }
+
+    INFO("%s (%s) -> %s -> %s\n", args[0], real, loop, args[1]);
+    res = 0;
+exit:
+    free(real);
+    return res;
+}
+
+struct plan_cmd
+{
+    const char *name;
+    int argc;
+    int (*run)(char **args);
+};
+
+static const struct plan_cmd plan_cmds[] = {
+    { "mkdir",      1, cmd_mkdir },
+    { "waitfor",    1, cmd_waitfor },
+    { "mount",      3, cmd_mount },
+    { "replaceblk", 2, cmd_replaceblk },
+    { NULL, 0, NULL }
+};
+
+// splits line into words, "quoted strings" may contain spaces
+static int split_args(char *line, char **args, int max)
+{
+    int cnt = 0;
+    char *p = line;
+
+    while(*p)
+    {
+        while(*p == ' ' || *p == '\t')
+            ++p;
+        if(*p == 0 || *p == '#')
+            break;
+
+        if(cnt >= max)
+            return -1;
+
+        if(*p == '"')
+        {
+            args[cnt++] = ++p;
+            p = strchr(p, '"');
+            if(!p)
+                return -1;
+        }
+        else
+        {
+            args[cnt++] = p;
+            while(*p && *p != ' ' && *p != '\t')
+                ++p;
+            if(*p == 0)
+                break;
+        }
+        *p++ = 0;
+    }
+    return cnt;
+}
+
+static int run_plan(const char *path)
+{
+    FILE *f;
+    char line[512];
+    char *args[MAX_ARGS+1];
+    const struct plan_cmd *cmd;
+    uint32_t step_start;
+    int argc, step = 0, res = 0;
+
+    f = fopen(path, "r");
+    if(!f)
+    {
+        ERROR("Cannot open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    while(res == 0 && fgets(line, sizeof(line), f))
+    {
+        if(watchdog_fired)
+        {
+            ERROR("Setup takes too long!\n");
+            res = -1;
+            break;
+        }
+
+        line[strcspn(line, "\r\n")] = 0;
+
+        argc = split_args(line, args, MAX_ARGS+1);
+        if(argc == 0)
+            continue;
+        if(argc < 0)
+        {
+            ERROR("Malformed line in plan: %s\n", line);
+            res = -1;
+            break;
+        }
+
+        for(cmd = plan_cmds; cmd->name; ++cmd)
+            if(strcmp(cmd->name, args[0]) == 0)
+                break;
+
+        if(!cmd->name || cmd->argc != argc-1)
+        {
+            ERROR("Unknown command or wrong argument count: %s\n", args[0]);
+            res = -1;
+            break;
+        }
+
+        ++step;
+        step_start = elapsed_ms();
+        trace_begin(args[0]);
+        res = cmd->run(args + 1);
+        trace_end(args[0]);
+        ERROR("step %d: %s %s%s took %u ms\n", step, args[0], args[1],
+                res == 0 ? "" : " FAILED", elapsed_ms() - step_start);
+    }
+
+    fclose(f);
+    return res;
+}
+
+static void fail(void)
+{
+    ERROR("MultiROM setup failed after %u ms, rebooting to recovery\n", elapsed_ms());
+    trace_instant("setup_failed");
+    trace_flush();
+
+    // prevent any damage to the internal memory by whatever boots now
+    write_file(FAIL_LED_PATH, FAIL_LED_VALUE);
+    write_file(EMMC_FORCE_RO_PATH, "1");
+    sync();
+
+    android_reboot(ANDROID_RB_RESTART2, 0, "recovery");
+    ERROR("Reboot failed!\n");
+    exit(1);
+}
+
+// only async-signal-safe calls
+static void write_file_raw(const char *path, const char *value)
+{
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if(fd >= 0)
+    {
+        write(fd, value, strlen(value));
+        close(fd);
+    }
+}
+
+/*
+ * First alarm only sets the flag and interrupts the syscall the setup is
+ * in, run_plan() then gives up and fail() does the rest. If that doesn't
+ * happen in WATCHDOG_GRACE seconds, the setup is stuck for good and the
+ * handler reboots by itself.
+ */
+static void watchdog_handler(int sig)
+{
+    static const char msg[] = "<3>multirom-setup: stuck, rebooting to recovery\n";
+
+    if(!watchdog_fired)
+    {
+        watchdog_fired = 1;
+        alarm(WATCHDOG_GRACE);
+        return;
+    }
+
+    write_file_raw("/dev/kmsg", msg);
+    write_file_raw(FAIL_LED_PATH, FAIL_LED_VALUE);
+    write_file_raw(EMMC_FORCE_RO_PATH, "1");
+    syscall(__NR_reboot, LINUX_REBOOT_MAGIC1, LINUX_REBOOT_MAGIC2,
+            LINUX_REBOOT_CMD_RESTART2, "recovery");
+    _exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *plan = argc > 1 ? argv[1] : PLAN_PATH;
+
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    klog_init();
+    trace_init("setup");
+    trace_begin("setup");
+
+    // waits time out on their own, this catches steps stuck in a syscall,
+    // no SA_RESTART so that the syscall gets interrupted
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = watchdog_handler;
+    sigaction(SIGALRM, &sa, NULL);
+    alarm(SETUP_TIMEOUT/1000 + 1);
+
+    // open it before looking for any node, so no uevent is missed
+    uevent_fd = uevent_open_socket(64*1024, true);
+    if(uevent_fd < 0)
+        ERROR("Cannot open uevent socket, falling back to polling\n");
+    else
+        fcntl(uevent_fd, F_SETFL, O_NONBLOCK);
+
+    if(run_plan(plan) < 0)
+        fail();
+
+    alarm(0);
+    if(uevent_fd >= 0)
+        close(uevent_fd);
+
+    ERROR("MultiROM setup done in %u ms\n", elapsed_ms());
+    trace_end("setup");
+    trace_flush();
+
+    // init waits for this
+    int fd = open(READY_PATH, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+        fail();
+    close(fd);
+
+    // after init is released, the ROM's own boot is not held up by it
+    if(trace_export_json(TRACE_JSON_FILE) < 0)
+        ERROR("Failed to export boot trace\n");
+    return 0;
+}
@@ -0,0 +1,212 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "supervisor.h"
+#include "util.h"
+#include "log.h"
+
+struct supervisor
+{
+    struct supervisor_cfg cfg;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pid_t pid;
+    int stopping;
+    int finished;
+    struct timespec started;
+    struct supervisor_stats stats;
+};
+
+static uint32_t run_time(struct supervisor *s)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return timespec_diff(&s->started, &now);
+}
+
+static pid_t supervisor_spawn(struct supervisor *s)
+{
+    sigset_t mask;
+    pid_t pid = fork();
+    if(pid == 0)
+    {
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+        setsid();
+
+        if(s->cfg.child_setup)
+            s->cfg.child_setup();
+
+        execve(s->cfg.argv[0], s->cfg.argv, s->cfg.envp);
+        _exit(127);
+    }
+    return pid;
+}
+
+static void *supervisor_thread(void *data)
+{
+    struct supervisor *s = data;
+    uint32_t backoff = s->cfg.backoff_min_ms;
+    uint32_t uptime;
+    struct timespec deadline;
+    int status;
+    pid_t pid;
+
+    pthread_mutex_lock(&s->mutex);
+    while(!s->stopping)
+    {
+        pid = supervisor_spawn(s);
+        if(pid < 0)
+        {
+            ERROR("%s: fork failed: %s\n", s->cfg.name, strerror(errno));
+            status = -1;
+            uptime = 0;
+        }
+        else
+        {
+            s->pid = pid;
+            s->stats.starts++;
+            s->stats.running = 1;
+            clock_gettime(CLOCK_MONOTONIC, &s->started);
+            pthread_mutex_unlock(&s->mutex);
+
+            while(waitpid(pid, &status, 0) < 0 && errno == EINTR);
+
+            pthread_mutex_lock(&s->mutex);
+            uptime = run_time(s);
+            s->pid = -1;
+            s->stats.running = 0;
+            s->stats.last_status = status;
+            s->stats.total_uptime_ms += uptime;
+            pthread_cond_broadcast(&s->cond);
+        }
+
+        if(s->stopping)
+            break;
+
+        if(uptime >= s->cfg.stable_ms)
+            backoff = s->cfg.backoff_min_ms;
+
+        ERROR("%s exited with status %d after %u ms, restarting in %u ms\n",
+                s->cfg.name, status, uptime, backoff);
+
+        cond_deadline(&deadline, backoff);
+        while(!s->stopping && pthread_cond_timedwait(&s->cond, &s->mutex, &deadline) != ETIMEDOUT);
+
+        if(backoff < s->cfg.backoff_max_ms/2)
+            backoff *= 2;
+        else
+            backoff = s->cfg.backoff_max_ms;
+
+        if(!s->stopping)
+            s->stats.restarts++;
+    }
+    s->finished = 1;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->mutex);
+    return NULL;
+}
+
+// whole group, unless the child did not get to setsid() yet
+static void supervisor_signal(pid_t pid, int sig)
+{
+    if(kill(-pid, sig) < 0)
+        kill(pid, sig);
+}
+
+struct supervisor *supervisor_start(const struct supervisor_cfg *cfg)
+{
+    struct supervisor *s = mzalloc(sizeof(struct supervisor));
+    s->cfg = *cfg;
+    if(s->cfg.backoff_min_ms == 0)
+        s->cfg.backoff_min_ms = 1;
+    if(s->cfg.backoff_max_ms < s->cfg.backoff_min_ms)
+        s->cfg.backoff_max_ms = s->cfg.backoff_min_ms;
+    s->pid = -1;
+    s->stats.last_status = -1;
+    pthread_mutex_init(&s->mutex, NULL);
+    pthread_cond_init(&s->cond, NULL);
+
+    if(pthread_create(&s->thread, NULL, supervisor_thread, s) != 0)
+    {
+        ERROR("%s: failed to start supervisor thread\n", cfg->name);
+        pthread_mutex_destroy(&s->mutex);
+        pthread_cond_destroy(&s->cond);
+        free(s);
+        return NULL;
+    }
+    return s;
+}
+
+int supervisor_stop(struct supervisor *s)
+{
+    struct timespec deadline;
+    int killed = 0;
+
+    pthread_mutex_lock(&s->mutex);
+    s->stopping = 1;
+    pthread_cond_broadcast(&s->cond);
+
+    if(s->pid > 0)
+    {
+        supervisor_signal(s->pid, SIGTERM);
+        cond_deadline(&deadline, s->cfg.stop_timeout_ms);
+        while(!s->finished)
+        {
+            if(pthread_cond_timedwait(&s->cond, &s->mutex, &deadline) == ETIMEDOUT)
+            {
+                if(s->pid > 0)
+                {
+                    ERROR("%s did not exit in %u ms, killing it\n", s->cfg.name, s->cfg.stop_timeout_ms);
+                    supervisor_signal(s->pid, SIGKILL);
+                    killed = 1;
+                }
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&s->mutex);
+
+    pthread_join(s->thread, NULL);
+
+    INFO("%s: %u starts, %u restarts, up %u ms in total\n", s->cfg.name,
+            s->stats.starts, s->stats.restarts, s->stats.total_uptime_ms);
+
+    pthread_mutex_destroy(&s->mutex);
+    pthread_cond_destroy(&s->cond);
+    free(s);
+    return killed;
+}
+
+void supervisor_get_stats(struct supervisor *s, struct supervisor_stats *st)
+{
+    pthread_mutex_lock(&s->mutex);
+    *st = s->stats;
+    st->uptime_ms = s->stats.running ? run_time(s) : 0;
+    pthread_mutex_unlock(&s->mutex);
+}
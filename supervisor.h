@@ -0,0 +1,62 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SUPERVISOR_H_
+#define SUPERVISOR_H_
+
+#include <stdint.h>
+
+/*
+ * Keeps a helper process (adbd...) running. The supervisor thread
+ * blocks in waitpid(), so exits are noticed immediately, and restarts
+ * the process with exponential backoff. The child runs in its own
+ * session, supervisor_stop() sends SIGTERM to the whole group and
+ * SIGKILL if it is still alive after stop_timeout_ms.
+ */
+
+struct supervisor_cfg
+{
+    const char *name;
+    char *const *argv;
+    char *const *envp;
+    void (*child_setup)(void); // runs in the child right before exec
+    uint32_t backoff_min_ms;
+    uint32_t backoff_max_ms;
+    uint32_t stable_ms;        // running this long resets the backoff
+    uint32_t stop_timeout_ms;
+};
+
+struct supervisor_stats
+{
+    uint32_t starts;
+    uint32_t restarts;
+    int last_status;           // from waitpid, -1 if it has not exited yet
+    int running;
+    uint32_t uptime_ms;        // of the current run
+    uint32_t total_uptime_ms;
+};
+
+struct supervisor;
+
+// cfg is copied, argv and envp must stay valid until supervisor_stop()
+struct supervisor *supervisor_start(const struct supervisor_cfg *cfg);
+// Returns 0 if the process exited on SIGTERM, 1 if it had to be killed.
+// Frees s.
+int supervisor_stop(struct supervisor *s);
+void supervisor_get_stats(struct supervisor *s, struct supervisor_stats *st);
+
+#endif /* SUPERVISOR_H_ */
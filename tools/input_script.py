@@ -0,0 +1,224 @@
+#!/usr/bin/env python
+#
+# This file is part of MultiROM.
+#
+# MultiROM is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# MultiROM is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+#
+# Turns a touch script into an input recording which MultiROM can replay,
+# or dumps an existing recording (multirom_input.rec) as text.
+#
+# usage: input_script.py [--type-a] [--big-endian] <script> <output.rec>
+#        input_script.py --dump <recording.rec>
+#
+# Script commands, one per line, coordinates are in screen pixels:
+#   screen W H               touchscreen size, default 480 854
+#   tap X Y                  press and release
+#   swipe X1 Y1 X2 Y2 MS     one finger moving from X1,Y1 to X2,Y2
+#   wait MS
+#   key CODE                 press and release, 116 is power
+#   repeat N ... end         repeats the lines in between
+#
+# Touch reports are generated every 8 ms, like a 120 Hz digitizer. The
+# touchscreen range equals the screen size, so the input scaling is 1:1.
+
+import struct
+import sys
+
+MAGIC = b'MRIR'
+VERSION = 1
+
+REC_EVENT = 0
+REC_DEVICE = 1
+REC_REMOVE = 2
+
+EV_SYN = 0x00
+EV_KEY = 0x01
+EV_ABS = 0x03
+SYN_REPORT = 0
+SYN_MT_REPORT = 2
+ABS_MT_SLOT = 0x2f
+ABS_MT_POSITION_X = 0x35
+ABS_MT_POSITION_Y = 0x36
+ABS_MT_TRACKING_ID = 0x39
+
+REC_FMT = 'IBBHHHi'
+DEVICE_FMT = 'ii2i2i16s'
+
+REPORT_US = 8000
+TOUCH_DEV = 0
+KEY_DEV = 1
+
+
+class Recording(object):
+    def __init__(self, endian, type_a):
+        self.endian = endian
+        self.type_a = type_a
+        self.data = bytearray()
+        self.data += struct.pack(endian + '4sI', MAGIC, VERSION)
+        self.dt = 0
+        self.tracking_id = 0
+
+    def device(self, slot, name, is_touch, w, h):
+        self.data += struct.pack(self.endian + REC_FMT, 0, REC_DEVICE, slot, 0, 0, 0, 0)
+        self.data += struct.pack(self.endian + DEVICE_FMT, is_touch, 0,
+                0, w, 0, h, name.encode('ascii'))
+
+    def event(self, dev, type, code, value):
+        self.data += struct.pack(self.endian + REC_FMT, self.dt, REC_EVENT, dev, type, code, 0, value)
+        self.dt = 0
+
+    def wait(self, us):
+        self.dt += us
+
+    # state is 'new', 'move' or 'up'
+    def touch(self, x, y, state):
+        if self.type_a:
+            if state != 'up':
+                self.event(TOUCH_DEV, EV_ABS, ABS_MT_POSITION_X, x)
+                self.event(TOUCH_DEV, EV_ABS, ABS_MT_POSITION_Y, y)
+                self.event(TOUCH_DEV, EV_ABS, ABS_MT_TRACKING_ID, self.tracking_id)
+                self.event(TOUCH_DEV, EV_SYN, SYN_MT_REPORT, 0)
+        else:
+            self.event(TOUCH_DEV, EV_ABS, ABS_MT_SLOT, 0)
+            if state == 'new':
+                self.event(TOUCH_DEV, EV_ABS, ABS_MT_TRACKING_ID, self.tracking_id)
+            if state != 'up':
+                self.event(TOUCH_DEV, EV_ABS, ABS_MT_POSITION_X, x)
+                self.event(TOUCH_DEV, EV_ABS, ABS_MT_POSITION_Y, y)
+            else:
+                self.event(TOUCH_DEV, EV_ABS, ABS_MT_TRACKING_ID, -1)
+        self.event(TOUCH_DEV, EV_SYN, SYN_REPORT, 0)
+
+    def swipe(self, x1, y1, x2, y2, ms):
+        steps = max(1, ms*1000 // REPORT_US)
+        self.touch(x1, y1, 'new')
+        for i in range(1, steps + 1):
+            self.wait(REPORT_US)
+            self.touch(x1 + (x2 - x1)*i // steps, y1 + (y2 - y1)*i // steps, 'move')
+        self.wait(REPORT_US)
+        self.touch(x2, y2, 'up')
+        self.tracking_id += 1
+
+    def key(self, code):
+        self.event(KEY_DEV, EV_KEY, code, 1)
+        self.event(KEY_DEV, EV_SYN, SYN_REPORT, 0)
+        self.wait(100000)
+        self.event(KEY_DEV, EV_KEY, code, 0)
+        self.event(KEY_DEV, EV_SYN, SYN_REPORT, 0)
+
+
+def expand(lines):
+    res = []
+    stack = [(1, res)]
+    for no, line in lines:
+        args = line.split()
+        if args[0] == 'repeat':
+            stack.append((int(args[1]), []))
+        elif args[0] == 'end':
+            cnt, body = stack.pop()
+            stack[-1][1].extend(body*cnt)
+        else:
+            stack[-1][1].append((no, args))
+    if len(stack) != 1:
+        raise ValueError('missing "end"')
+    return res
+
+
+def compile_script(path, endian, type_a):
+    with open(path) as f:
+        lines = [(no + 1, l.split('#')[0].strip()) for no, l in enumerate(f)]
+    cmds = expand([l for l in lines if l[1]])
+
+    w, h = 480, 854
+    for no, args in cmds:
+        if args[0] == 'screen':
+            w, h = int(args[1]), int(args[2])
+
+    rec = Recording(endian, type_a)
+    rec.device(TOUCH_DEV, 'event0', 1, w, h)
+    rec.device(KEY_DEV, 'event1', 0, 0, 0)
+
+    for no, args in cmds:
+        try:
+            nums = [int(a) for a in args[1:]]
+            if args[0] == 'screen':
+                pass
+            elif args[0] == 'tap':
+                rec.swipe(nums[0], nums[1], nums[0], nums[1], 50)
+            elif args[0] == 'swipe':
+                rec.swipe(*nums)
+            elif args[0] == 'wait':
+                rec.wait(nums[0]*1000)
+            elif args[0] == 'key':
+                rec.key(nums[0])
+            else:
+                raise ValueError('unknown command ' + args[0])
+        except (ValueError, IndexError, TypeError) as e:
+            raise ValueError('line %d: %s' % (no, e))
+    return rec.data
+
+
+def dump(path, endian):
+    with open(path, 'rb') as f:
+        data = f.read()
+    magic, version = struct.unpack_from(endian + '4sI', data, 0)
+    if magic != MAGIC or version != VERSION:
+        raise ValueError('not an input recording')
+
+    off = 8
+    t = 0
+    while off + struct.calcsize(endian + REC_FMT) <= len(data):
+        dt, kind, dev, type, code, _, value = struct.unpack_from(endian + REC_FMT, data, off)
+        off += struct.calcsize(endian + REC_FMT)
+        t += dt
+        if kind == REC_DEVICE:
+            is_touch, switch_xy, x0, x1, y0, y1, name = struct.unpack_from(endian + DEVICE_FMT, data, off)
+            off += struct.calcsize(endian + DEVICE_FMT)
+            print('%10.3f dev %d %s touch %d switch_xy %d x %d-%d y %d-%d' % (t/1000.0, dev,
+                    name.rstrip(b'\0').decode('ascii', 'replace'), is_touch, switch_xy, x0, x1, y0, y1))
+        elif kind == REC_REMOVE:
+            print('%10.3f dev %d removed' % (t/1000.0, dev))
+        else:
+            print('%10.3f dev %d type %d code %d value %d' % (t/1000.0, dev, type, code, value))
+
+
+def main(argv):
+    endian = '<'
+    type_a = False
+    do_dump = False
+    args = []
+    for a in argv[1:]:
+        if a == '--type-a':
+            type_a = True
+        elif a == '--big-endian':
+            endian = '>'
+        elif a == '--dump':
+            do_dump = True
+        else:
+            args.append(a)
+
+    if do_dump and len(args) == 1:
+        dump(args[0], endian)
+    elif not do_dump and len(args) == 2:
+        data = compile_script(args[0], endian, type_a)
+        with open(args[1], 'wb') as f:
+            f.write(data)
+    else:
+        sys.stderr.write('usage: %s [--type-a] [--big-endian] <script> <output.rec>\n' % argv[0])
+        sys.stderr.write('       %s --dump <recording.rec>\n' % argv[0])
+        return 1
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
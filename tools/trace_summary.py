@@ -0,0 +1,165 @@
+#!/usr/bin/env python
+#
+# This file is part of MultiROM.
+#
+# MultiROM is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# MultiROM is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+#
+# Summarizes a MultiROM boot trace: either multirom_trace.json from the
+# sdcard or /multirom/trace.txt pulled from the booted ROM.
+#
+# usage: trace_summary.py <trace file> [min gap ms]
+#
+# The critical path is what the main thread of each process (trampoline,
+# multirom, setup) was doing, in time order, down to the innermost span.
+# Spans of other threads are listed separately, with the main thread span
+# that ended right after them, which is likely the one waiting for them.
+
+import json
+import sys
+
+
+class Span(object):
+    def __init__(self, name, pid, tid, start):
+        self.name = name
+        self.pid = pid
+        self.tid = tid
+        self.start = start
+        self.end = None
+        self.children = []
+
+    def dur(self):
+        return (self.end - self.start) / 1000.0
+
+
+def load_events(path):
+    with open(path) as f:
+        data = f.read()
+
+    if data.lstrip().startswith('{'):
+        events = json.loads(data)['traceEvents']
+        return [(e['ph'], e.get('ts', 0), e['pid'], e['tid'],
+                 e['args']['name'] if e['ph'] == 'M' else e['name']) for e in events]
+
+    events = []
+    for line in data.splitlines():
+        parts = line.split(' ', 4)
+        if len(parts) == 5:
+            events.append((parts[0], int(parts[1]), int(parts[2]), int(parts[3]), parts[4]))
+    return events
+
+
+def build_spans(events):
+    names = {}
+    stacks = {}
+    roots = []
+    for ph, ts, pid, tid, name in sorted(events, key=lambda e: e[1]):
+        if ph == 'M':
+            names[pid] = name
+        elif ph == 'B':
+            span = Span(name, pid, tid, ts)
+            stack = stacks.setdefault((pid, tid), [])
+            (stack[-1].children if stack else roots).append(span)
+            stack.append(span)
+        elif ph == 'E':
+            stack = stacks.get((pid, tid), [])
+            while stack:
+                span = stack.pop()
+                span.end = ts
+                if span.name == name:
+                    break
+        elif ph == 'D':
+            print('warning: %s in pid %d' % (name, pid))
+
+    # spans cut short by a crash or a reboot
+    for stack in stacks.values():
+        for span in stack:
+            print('warning: span %s (pid %d) never ended' % (span.name, span.pid))
+            span.end = span.start
+    return names, roots
+
+
+def critical_path(span, out):
+    pos = span.start
+    for c in sorted(span.children, key=lambda c: c.start):
+        if c.start > pos:
+            out.append((pos, c.start, span))
+        critical_path(c, out)
+        pos = max(pos, c.end)
+    if span.end > pos:
+        out.append((pos, span.end, span))
+
+
+def label(names, span):
+    return '%s:%s' % (names.get(span.pid, span.pid), span.name)
+
+
+def main():
+    if len(sys.argv) < 2:
+        print('usage: %s <trace file> [min gap ms]' % sys.argv[0])
+        return 1
+
+    min_gap = float(sys.argv[2]) if len(sys.argv) > 2 else 1.0
+    names, roots = build_spans(load_events(sys.argv[1]))
+    main_roots = [r for r in roots if r.pid == r.tid]
+    bg_roots = [r for r in roots if r.pid != r.tid]
+    if not main_roots:
+        print('no spans found')
+        return 1
+
+    t0 = min(r.start for r in main_roots)
+    t1 = max(r.end for r in main_roots)
+    print('boot timeline: %.1f ms (from %.1f ms after kernel start)\n' % ((t1 - t0) / 1000.0, t0 / 1000.0))
+
+    print('critical path:')
+    segments = []
+    for r in sorted(main_roots, key=lambda r: r.start):
+        critical_path(r, segments)
+
+    self_time = {}
+    pos = t0
+    for start, end, span in segments:
+        if start - pos >= min_gap * 1000:
+            print('  %9.1f %8.1f ms  (not traced)' % ((pos - t0) / 1000.0, (start - pos) / 1000.0))
+        key = label(names, span)
+        self_time[key] = self_time.get(key, 0) + (end - start)
+        if end - start >= min_gap * 1000:
+            print('  %9.1f %8.1f ms  %s' % ((start - t0) / 1000.0, (end - start) / 1000.0, key))
+        pos = max(pos, end)
+
+    print('\nself time on critical path:')
+    total = float(t1 - t0) or 1.0
+    for key, t in sorted(self_time.items(), key=lambda i: -i[1])[:15]:
+        print('  %8.1f ms %5.1f%%  %s' % (t / 1000.0, t * 100 / total, key))
+
+    if bg_roots:
+        print('\nbackground threads:')
+        flat = []
+
+        def flatten(s):
+            flat.append(s)
+            for c in s.children:
+                flatten(c)
+
+        for r in main_roots:
+            flatten(r)
+        for b in sorted(bg_roots, key=lambda b: b.start):
+            waiter = [s for s in flat if s.pid == b.pid and s.start <= b.end <= s.end]
+            waiter = min(waiter, key=lambda s: s.end - b.end) if waiter else None
+            print('  %9.1f %8.1f ms  %s%s' % ((b.start - t0) / 1000.0, b.dur(), label(names, b),
+                  ('  (during %s)' % waiter.name) if waiter else ''))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
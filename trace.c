@@ -0,0 +1,176 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+#include "util.h"
+
+struct trace_event
+{
+    char phase;
+    pid_t tid;
+    uint64_t ts;
+    char name[TRACE_NAME_LEN];
+};
+
+static struct trace_event events[TRACE_MAX_EVENTS];
+static volatile int events_cnt = 0;
+static int events_dropped = 0;
+static char process_name[TRACE_NAME_LEN] = "";
+
+static void trace_add(char phase, const char *name)
+{
+    int64_t ts = get_mono_us();
+    int idx;
+
+    idx = __sync_fetch_and_add(&events_cnt, 1);
+    if(idx >= TRACE_MAX_EVENTS)
+    {
+        __sync_fetch_and_add(&events_dropped, 1);
+        return;
+    }
+
+    events[idx].phase = phase;
+    events[idx].tid = syscall(__NR_gettid);
+    events[idx].ts = ts;
+    strncpy(events[idx].name, name, TRACE_NAME_LEN-1);
+}
+
+void trace_init(const char *process)
+{
+    strncpy(process_name, process, TRACE_NAME_LEN-1);
+}
+
+void trace_begin(const char *name)
+{
+    trace_add('B', name);
+}
+
+void trace_end(const char *name)
+{
+    trace_add('E', name);
+}
+
+void trace_instant(const char *name)
+{
+    trace_add('i', name);
+}
+
+// not safe against concurrent trace_*() calls, use it only when the process is done
+int trace_flush(void)
+{
+    int i, cnt;
+    pid_t pid = getpid();
+
+    cnt = events_cnt < TRACE_MAX_EVENTS ? events_cnt : TRACE_MAX_EVENTS;
+    FILE *f = fopen(TRACE_FILE, "a");
+    if(!f)
+        return -1;
+
+    if(process_name[0])
+        fprintf(f, "M 0 %d %d %s\n", pid, pid, process_name);
+
+    for(i = 0; i < cnt; ++i)
+    {
+        fprintf(f, "%c %llu %d %d %s\n", events[i].phase, (unsigned long long)events[i].ts,
+                pid, events[i].tid, events[i].name);
+    }
+
+    if(events_dropped)
+        fprintf(f, "D 0 %d %d %d events dropped\n", pid, pid, events_dropped);
+
+    events_cnt = 0;
+    events_dropped = 0;
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+static void json_string(FILE *f, const char *str)
+{
+    fputc('"', f);
+    for(; *str; ++str)
+    {
+        if(*str == '"' || *str == '\\')
+            fputc('\\', f);
+        if((unsigned char)*str >= 0x20)
+            fputc(*str, f);
+    }
+    fputc('"', f);
+}
+
+int trace_export_json(const char *path)
+{
+    char line[128];
+    char phase;
+    unsigned long long ts;
+    int pid, tid, n, first = 1;
+    FILE *in, *out;
+
+    trace_flush();
+
+    in = fopen(TRACE_FILE, "r");
+    if(!in)
+        return -1;
+
+    out = fopen(path, "w");
+    if(!out)
+    {
+        fclose(in);
+        return -1;
+    }
+
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", out);
+    while(fgets(line, sizeof(line), in))
+    {
+        line[strcspn(line, "\n")] = 0;
+        if(sscanf(line, "%c %llu %d %d %n", &phase, &ts, &pid, &tid, &n) != 4)
+            continue;
+
+        fputs(first ? "" : ",\n", out);
+        first = 0;
+
+        switch(phase)
+        {
+            case 'M':
+                fprintf(out, "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":", pid, tid);
+                json_string(out, line + n);
+                fputs("}}", out);
+                break;
+            case 'D':
+                fprintf(out, "{\"ph\":\"i\",\"s\":\"p\",\"ts\":0,\"pid\":%d,\"tid\":%d,\"name\":", pid, tid);
+                json_string(out, line + n);
+                fputc('}', out);
+                break;
+            default:
+                fprintf(out, "{\"ph\":\"%c\",%s\"ts\":%llu,\"pid\":%d,\"tid\":%d,\"name\":",
+                        phase, phase == 'i' ? "\"s\":\"t\"," : "", ts, pid, tid);
+                json_string(out, line + n);
+                fputc('}', out);
+                break;
+        }
+    }
+    fputs("\n]}\n", out);
+
+    fclose(in);
+    return fclose(out) == 0 ? 0 : -1;
+}
@@ -0,0 +1,44 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+/*
+ * Boot timeline tracing, shared by trampoline, multirom and setup.
+ *
+ * Events are recorded into a preallocated buffer and appended to
+ * TRACE_FILE (in the ramdisk, so it survives exec) by trace_flush(),
+ * one event per line: "<phase> <timestamp us> <pid> <tid> <name>".
+ * trace_export_json() converts that file into Chrome trace JSON.
+ * Timestamps are CLOCK_MONOTONIC, so they restart after kexec.
+ */
+
+#define TRACE_FILE "/multirom/trace.txt"
+// exported by setup, the last stage which records anything
+#define TRACE_JSON_FILE "/multirom/trace.json"
+#define TRACE_MAX_EVENTS 512
+#define TRACE_NAME_LEN 40
+
+void trace_init(const char *process);
+void trace_begin(const char *name);
+void trace_end(const char *name);
+void trace_instant(const char *name);
+int trace_flush(void);
+int trace_export_json(const char *path);
+
+#endif /* TRACE_H_ */
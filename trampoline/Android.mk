@@ -7,7 +7,11 @@ LOCAL_SRC_FILES:= \
     devices.c \
     ../util.c \
     adb.c \
-    ../fstab.c
+    ../fstab.c \
+    ../trace.c \
+    ../cpio.c \
+    ../supervisor.c \
+    path_trie.c
 
 LOCAL_MODULE:= multirom_trampoline
 LOCAL_MODULE_TAGS := eng
@@ -16,13 +20,25 @@ LOCAL_FORCE_STATIC_EXECUTABLE := true
 LOCAL_MODULE_PATH := $(PRODUCT_OUT)/multirom
 #LOCAL_UNSTRIPPED_PATH := $(TARGET_ROOT_OUT_UNSTRIPPED)
 
-LOCAL_STATIC_LIBRARIES := libfs_mgr libcutils libc
+LOCAL_STATIC_LIBRARIES := libfs_mgr libcutils libc libz
+LOCAL_C_INCLUDES += external/zlib
 
 ifeq ($(MR_INIT_DEVICES),)
     $(info MR_INIT_DEVICES was not defined in device files!)
 endif
 LOCAL_SRC_FILES += ../../../../$(MR_INIT_DEVICES)
 
+# Walk /sys for coldboot serially, the old way, to compare coldboot times
+ifeq ($(MR_SERIAL_COLDBOOT),true)
+    LOCAL_CFLAGS += -DMR_SERIAL_COLDBOOT
+endif
+
+# Replay the uevents of this boot through the old list lookups and the
+# path_trie index in devices_close and log the times
+ifeq ($(MR_DEVICES_BENCH),true)
+    LOCAL_CFLAGS += -DMR_DEVICES_BENCH
+endif
+
 # for adb
 LOCAL_CFLAGS += -DPRODUCT_MODEL="\"$(PRODUCT_MODEL)\"" -DPRODUCT_MANUFACTURER="\"$(PRODUCT_MANUFACTURER)\""
 
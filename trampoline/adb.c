@@ -30,11 +30,18 @@
 
 #include "adb.h"
 #include "../util.h"
+#include "../supervisor.h"
 #include "log.h"
 
+// restart adbd quickly at first, but do not spin if it keeps crashing
+#define ADBD_BACKOFF_MIN  100
+#define ADBD_BACKOFF_MAX  5000
+#define ADBD_STABLE       10000
+#define ADBD_STOP_TIMEOUT 1000
+
 static pthread_t adb_thread;
 static volatile int run_thread = 0;
-static pid_t adb_pid = -1;
+static struct supervisor *adbd_supervisor = NULL;
 
 static char busybox_path[64] = { 0 };
 static char adbd_path[64] = { 0 };
@@ -50,6 +57,14 @@ static char * const ENV[] = {
     NULL
 };
 
+static char * const ADBD_CMD[] = { adbd_path, NULL };
+
+static void adbd_child_setup(void)
+{
+    umask(077);
+    stdio_to_null();
+}
+
 static void *adb_thread_work(void *mrom_path)
 {
     //int enabled = adb_is_enabled((char*)mrom_path);
@@ -68,32 +83,17 @@ static void *adb_thread_work(void *mrom_path)
 
     chmod(adbd_path, 0755);
 
-    while(run_thread)
-    {
-        adb_pid = fork();
-        if(adb_pid == 0) // child
-        {
-            umask(077);
-            setsid();
-            stdio_to_null();
-            setpgid(0, getpid());
-
-            static char * const cmd[] = { adbd_path, NULL };
-            execve(cmd[0], cmd, ENV);
-            exit(127);
-        }
-        else
-        {
-            int status = 0;
-            while(waitpid(adb_pid, &status, WNOHANG) == 0)
-                usleep(300000);
-            ERROR("adb stop %d", status);
-        }
-        usleep(300000);
-    }
-
-    adb_cleanup();
-    write_file("/sys/class/android_usb/android0/enable", "0");
+    static const struct supervisor_cfg cfg = {
+        .name = "adbd",
+        .argv = ADBD_CMD,
+        .envp = ENV,
+        .child_setup = adbd_child_setup,
+        .backoff_min_ms = ADBD_BACKOFF_MIN,
+        .backoff_max_ms = ADBD_BACKOFF_MAX,
+        .stable_ms = ADBD_STABLE,
+        .stop_timeout_ms = ADBD_STOP_TIMEOUT,
+    };
+    adbd_supervisor = supervisor_start(&cfg);
 
     return NULL;
 }
@@ -113,6 +113,8 @@ void adb_init(char *mrom_path)
 
 void adb_quit(void)
 {
+    struct supervisor_stats stats;
+
     if(!run_thread)
         return;
 
@@ -120,13 +122,21 @@ void adb_quit(void)
 
     run_thread = 0;
 
-    if(adb_pid != -1)
+    // adbd is started at the end of adb_thread_work
+    pthread_join(adb_thread, NULL);
+
+    if(adbd_supervisor)
     {
-        kill(adb_pid, 9);
-        adb_pid = -1;
+        supervisor_get_stats(adbd_supervisor, &stats);
+        ERROR("adbd: %u restarts, up %u ms, last status %d",
+                stats.restarts, stats.total_uptime_ms + stats.uptime_ms, stats.last_status);
+
+        supervisor_stop(adbd_supervisor);
+        adbd_supervisor = NULL;
     }
 
-    pthread_join(adb_thread, NULL);
+    adb_cleanup();
+    write_file("/sys/class/android_usb/android0/enable", "0");
 }
 
 void adb_init_usb(void)
@@ -27,9 +27,16 @@
 #include <string.h>
 #include <poll.h>
 #include <pthread.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
 
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/sendfile.h>
 #include <linux/netlink.h>
 
 #ifdef HAVE_SELINUX
@@ -46,6 +53,8 @@
 #include <cutils/uevent.h>
 
 #include "devices.h"
+#include "path_trie.h"
+#include "../fstab.h"
 #include "../util.h"
 #include "log.h"
 
@@ -67,41 +76,153 @@ static struct selabel_handle *sehandle;
 
 extern const char *mr_init_devices[];
 
+#define UEVENT_MSG_LEN  1024
+// uevents received with one recvmmsg call
+#define UEVENT_BATCH    16
+
+struct uevent_stats {
+    uint32_t events;
+    uint32_t batches;
+    uint32_t max_batch;
+    uint64_t total_us;
+    uint32_t max_us;
+    uint32_t overflows;
+};
+
+// threads walking /sys in parallel during coldboot
+#define COLDBOOT_THREADS 4
+// how many times /sys is walked again because uevents were lost
+#define COLDBOOT_REPLAY_MAX 3
+
 static int device_fd = -1;
+static int wake_fd = -1;
 static volatile int run_event_thread = 1;
 static pthread_t uevent_thread;
+static struct uevent_stats uevent_stats;
+
+// devices_init() waits for the uevent thread to handle everything
+static pthread_mutex_t uevent_sync_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t uevent_sync_cond = PTHREAD_COND_INITIALIZER;
+static uint32_t uevent_sync_req = 0;
+static uint32_t uevent_sync_done = 0;
+
+/* Set when the uevent socket overflows, the events lost with it are gone
+ * for good, so the coldboot walk is run again to get them resent. */
+static pthread_mutex_t coldboot_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int coldboot_replay = 0;
+static int coldboot_replays = 0;
+static int coldboot_active = 0;  // a walk is running and checks coldboot_replay when done
+static int coldboot_closing = 0;
+
+struct coldboot_job {
+    int fd;
+    int recurse;
+};
 
-static void *uevent_thread_work(void *cookie)
+// sysfs directories coldboot_priority() already triggered, sorted
+struct coldboot_done {
+    ino_t *ino;
+    int cnt;
+};
+
+struct coldboot {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct coldboot_job jobs[COLDBOOT_THREADS*2];
+    int cnt;
+    int active;
+    int done;
+    uint32_t triggered;
+    const struct coldboot_done *skip;
+};
+
+static void wake_uevent_thread(void)
 {
-    struct pollfd ufd;
-    int nr;
+    uint64_t one = 1;
+    if (wake_fd >= 0)
+        write(wake_fd, &one, sizeof(one));
+}
 
-    ufd.events = POLLIN;
-    ufd.fd = get_device_fd();
+static void *uevent_thread_work(void *cookie)
+{
+    struct pollfd ufds[2];
+    uint64_t val;
+    uint32_t req;
+    int nr, nfds = 1;
+
+    ufds[0].events = POLLIN;
+    ufds[0].fd = get_device_fd();
+    if (wake_fd >= 0) {
+        ufds[1].events = POLLIN;
+        ufds[1].fd = wake_fd;
+        nfds = 2;
+    }
 
     while(run_event_thread) {
-        ufd.revents = 0;
-        nr = poll(&ufd, 1, 0);
+        ufds[0].revents = 0;
+        ufds[1].revents = 0;
 
-        if (nr > 0 && ufd.revents == POLLIN)
+        /* without the eventfd, check run_event_thread now and then */
+        nr = poll(ufds, nfds, nfds == 2 ? -1 : 100);
+        if (nr < 0 && errno != EINTR) {
+            ERROR("uevent poll failed: %s", strerror(errno));
+            break;
+        }
+
+        if (nfds == 2 && ufds[1].revents)
+            read(wake_fd, &val, sizeof(val));
+
+        if (!run_event_thread)
+            break;
+
+        pthread_mutex_lock(&uevent_sync_mutex);
+        req = uevent_sync_req;
+        pthread_mutex_unlock(&uevent_sync_mutex);
+
+        if ((nr > 0 && (ufds[0].revents & POLLIN)) || req != uevent_sync_done)
             handle_device_fd();
 
-        usleep(100000);
+        /* uevents are queued by the time the write to sysfs returns, so
+         * everything triggered before the request is handled now */
+        if (req != uevent_sync_done) {
+            pthread_mutex_lock(&uevent_sync_mutex);
+            uevent_sync_done = req;
+            pthread_cond_broadcast(&uevent_sync_cond);
+            pthread_mutex_unlock(&uevent_sync_mutex);
+        }
     }
     return NULL;
 }
 
-static void init_single_path(const char *path)
+static void uevent_thread_sync(void)
+{
+    uint32_t req;
+
+    pthread_mutex_lock(&uevent_sync_mutex);
+    req = ++uevent_sync_req;
+    pthread_mutex_unlock(&uevent_sync_mutex);
+
+    wake_uevent_thread();
+
+    pthread_mutex_lock(&uevent_sync_mutex);
+    while ((int32_t)(uevent_sync_done - req) < 0)
+        pthread_cond_wait(&uevent_sync_cond, &uevent_sync_mutex);
+    pthread_mutex_unlock(&uevent_sync_mutex);
+}
+
+#ifdef MR_SERIAL_COLDBOOT
+static uint32_t init_single_path(const char *path)
 {
     int fd, dfd;
     DIR *d;
+    uint32_t res = 0;
 
     INFO("Initializing device %s", path);
     d = opendir(path);
     if(!d)
     {
         UEVENT_ERR("Failed to open folder %s", path);
-        return;
+        return 0;
     }
 
     dfd = dirfd(d);
@@ -112,6 +233,7 @@ static void init_single_path(const char *path)
         write(fd, "add\n", 4);
         close(fd);
         handle_device_fd();
+        res = 1;
     }
     else
     {
@@ -119,17 +241,18 @@ static void init_single_path(const char *path)
     }
 
     closedir(d);
+    return res;
 }
 
-static void init_folder(const char *path)
+static uint32_t init_folder(const char *path)
 {
-    init_single_path(path);
+    uint32_t res = init_single_path(path);
 
     DIR *d = opendir(path);
     if(!d)
     {
         UEVENT_ERR("Failed to open folder %s\n", path);
-        return;
+        return res;
     }
 
     struct dirent *dr;
@@ -144,54 +267,532 @@ static void init_folder(const char *path)
         strcat(p, "/");
         strcat(p, dr->d_name);
 
-        init_folder(p);
+        res += init_folder(p);
 
         free(p);
     }
     closedir(d);
+    return res;
 }
 
-void devices_init(void)
+static uint32_t coldboot(const char **paths)
 {
-    /* is 256K enough? udev uses 16MB! */
-    device_fd = uevent_open_socket(256*1024, true);
-    if(device_fd < 0)
-        return;
-
-    fcntl(device_fd, F_SETFD, FD_CLOEXEC);
-    fcntl(device_fd, F_SETFL, O_NONBLOCK);
-
+    uint32_t res = 0;
     int i, len;
-    for(i = 0; mr_init_devices[i]; ++i)
+    for(i = 0; paths[i]; ++i)
     {
-        len = strlen(mr_init_devices[i]);
-        if(mr_init_devices[i][len-1] != '*')
-            init_single_path(mr_init_devices[i]);
+        len = strlen(paths[i]);
+        if(paths[i][len-1] != '*')
+            res += init_single_path(paths[i]);
         else
         {
-            char *path = strndup(mr_init_devices[i], len-1);
-            init_folder(path);
+            char *path = strndup(paths[i], len-1);
+            res += init_folder(path);
             free(path);
         }
     }
+    return res;
+}
+
+#else
+
+/*
+ * Parallel coldboot: writes "add" to uevent files only, the uevent thread
+ * handles the events at the same time. Paths are walked with
+ * openat/fdopendir relative to the parent directory.
+ */
+static int ino_cmp(const void *a, const void *b)
+{
+    ino_t x = *(const ino_t*)a, y = *(const ino_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static int coldboot_trigger(struct coldboot *cb, int dfd)
+{
+    struct stat st;
+    int fd;
+
+    // don't send a second "add" for the devices the menu needed first
+    if (cb->skip && cb->skip->cnt && fstat(dfd, &st) == 0 &&
+        bsearch(&st.st_ino, cb->skip->ino, cb->skip->cnt, sizeof(ino_t), ino_cmp))
+        return 0;
+
+    fd = openat(dfd, "uevent", O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    write(fd, "add\n", 4);
+    close(fd);
+    __sync_fetch_and_add(&cb->triggered, 1);
+    return 0;
+}
+
+// hands the directory over to an idle thread, if there is one
+static int coldboot_push(struct coldboot *cb, int fd, int recurse)
+{
+    int res = 0;
+    pthread_mutex_lock(&cb->mutex);
+    if (cb->cnt + cb->active < COLDBOOT_THREADS && cb->cnt < (int)ARRAY_SIZE(cb->jobs)) {
+        cb->jobs[cb->cnt].fd = fd;
+        cb->jobs[cb->cnt].recurse = recurse;
+        ++cb->cnt;
+        pthread_cond_signal(&cb->cond);
+        res = 1;
+    }
+    pthread_mutex_unlock(&cb->mutex);
+    return res;
+}
+
+static void coldboot_walk(struct coldboot *cb, int dfd, int recurse)
+{
+    struct dirent *dr;
+    DIR *d;
+    int fd;
+
+    /* parent first, platform devices have to be known before their children */
+    coldboot_trigger(cb, dfd);
+
+    if (!recurse) {
+        close(dfd);
+        return;
+    }
+
+    d = fdopendir(dfd);
+    if (!d) {
+        close(dfd);
+        return;
+    }
+
+    while ((dr = readdir(d))) {
+        if (dr->d_type != DT_DIR ||
+           (dr->d_name[0] == '.' && (dr->d_name[1] == 0 || dr->d_name[1] == '.')))
+           continue;
+
+        fd = openat(dirfd(d), dr->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+
+        if (!coldboot_push(cb, fd, 1))
+            coldboot_walk(cb, fd, 1);
+    }
+    closedir(d);
+}
+
+static void *coldboot_thread_work(void *data)
+{
+    struct coldboot *cb = data;
+    struct coldboot_job job;
+
+    pthread_mutex_lock(&cb->mutex);
+    for (;;) {
+        while (cb->cnt == 0 && !cb->done)
+            pthread_cond_wait(&cb->cond, &cb->mutex);
+
+        if (cb->cnt == 0)
+            break;
+
+        job = cb->jobs[--cb->cnt];
+        ++cb->active;
+        pthread_mutex_unlock(&cb->mutex);
+
+        coldboot_walk(cb, job.fd, job.recurse);
+
+        pthread_mutex_lock(&cb->mutex);
+        if (--cb->active == 0 && cb->cnt == 0)
+            pthread_cond_broadcast(&cb->cond);
+    }
+    pthread_mutex_unlock(&cb->mutex);
+    return NULL;
+}
+
+static void coldboot_wait_idle(struct coldboot *cb)
+{
+    pthread_mutex_lock(&cb->mutex);
+    while (cb->cnt != 0 || cb->active != 0)
+        pthread_cond_wait(&cb->cond, &cb->mutex);
+    pthread_mutex_unlock(&cb->mutex);
+}
+
+static uint32_t coldboot(const char **paths, const struct coldboot_done *skip)
+{
+    struct coldboot cb;
+    pthread_t threads[COLDBOOT_THREADS];
+    int i, len, fd, recurse, nthreads = 0;
+    char buf[256];
+
+    memset(&cb, 0, sizeof(cb));
+    cb.skip = skip;
+    pthread_mutex_init(&cb.mutex, NULL);
+    pthread_cond_init(&cb.cond, NULL);
+
+    for (i = 0; i < COLDBOOT_THREADS; ++i)
+        if (pthread_create(&threads[nthreads], NULL, coldboot_thread_work, &cb) == 0)
+            ++nthreads;
+
+    /* The list is handled in order, later entries may depend on platform
+     * devices from the earlier ones. Subtrees of one entry are parallel. */
+    for (i = 0; paths[i]; ++i) {
+        len = strlen(paths[i]);
+        recurse = (paths[i][len-1] == '*');
+        snprintf(buf, sizeof(buf), "%.*s", recurse ? len-1 : len, paths[i]);
+
+        fd = open(buf, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) {
+            UEVENT_ERR("Failed to open folder %s", buf);
+            continue;
+        }
+
+        if (!recurse || nthreads == 0 || !coldboot_push(&cb, fd, recurse))
+            coldboot_walk(&cb, fd, recurse);
+        coldboot_wait_idle(&cb);
+    }
+
+    pthread_mutex_lock(&cb.mutex);
+    cb.done = 1;
+    pthread_cond_broadcast(&cb.cond);
+    pthread_mutex_unlock(&cb.mutex);
+
+    for (i = 0; i < nthreads; ++i)
+        pthread_join(threads[i], NULL);
+
+    pthread_mutex_destroy(&cb.mutex);
+    pthread_cond_destroy(&cb.cond);
+    return cb.triggered;
+}
+#endif
 
-    // /dev/null
-    init_single_path("/sys/devices/virtual/mem/null");
+static const char *coldboot_extra[] = {
+    "/sys/devices/virtual/mem/null",   // /dev/null
+    "/sys/devices/virtual/misc/fuse",  // /dev/fuse
+    NULL
+};
+
+#ifndef MR_SERIAL_COLDBOOT
+// block devices MultiROM needs to show the menu
+static const char *priority_mounts[] = { "/data", "/cache", "/boot", NULL };
 
-    // /dev/fuse
-    init_single_path("/sys/devices/virtual/misc/fuse");
+static pthread_t coldboot_thread;
+static int coldboot_thread_running = 0;
+
+static int priority_triggered(char **done, const char *path)
+{
+    for (; done && *done; ++done)
+        if (strcmp(*done, path) == 0)
+            return 1;
+    return 0;
+}
+
+/*
+ * Triggers the device and all its parents under /sys/devices, parents
+ * first, so that platform devices are known before their block devices.
+ */
+static void trigger_with_parents(struct coldboot *cb, const char *sys_link, char ***done)
+{
+    char path[PATH_MAX];
+    char c;
+    int i, len, fd;
+
+    if (!realpath(sys_link, path) || strncmp(path, "/sys/devices/", 13) != 0)
+        return;
+
+    len = strlen(path);
+    for (i = 13; i <= len; ++i) {
+        if (path[i] != '/' && path[i] != 0)
+            continue;
+
+        c = path[i];
+        path[i] = 0;
+        if (!priority_triggered(*done, path)) {
+            fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (fd >= 0) {
+                coldboot_trigger(cb, fd);
+                close(fd);
+            }
+            list_add(strdup(path), done);
+        }
+        path[i] = c;
+    }
+}
+
+static int uevent_has_partname(int dfd, const char *entry, const char *partname)
+{
+    char buf[512];
+    char key[128];
+    char *uevent = buf;
+    int fd, len;
+
+    snprintf(key, sizeof(key), "%s/uevent", entry);
+    fd = openat(dfd, key, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+
+    buf[0] = '\n';
+    len = read(fd, buf + 1, sizeof(buf) - 2);
+    close(fd);
+    if (len <= 0)
+        return 0;
+    buf[len + 1] = 0;
+
+    snprintf(key, sizeof(key), "\nPARTNAME=%s\n", partname);
+    return strstr(uevent, key) != NULL;
+}
+
+// fstab devices are either /dev/block/<name> or by-name links of platform devices
+static void trigger_block_device(struct coldboot *cb, const char *dev, char ***done)
+{
+    char path[PATH_MAX];
+    const char *name = strrchr(dev, '/');
+    struct dirent *dr;
+    DIR *d;
+
+    if (!name)
+        return;
+    ++name;
+
+    if (!strstr(dev, "/by-name/")) {
+        snprintf(path, sizeof(path), "/sys/class/block/%s", name);
+        trigger_with_parents(cb, path, done);
+        return;
+    }
+
+    d = opendir("/sys/class/block");
+    if (!d)
+        return;
+
+    while ((dr = readdir(d))) {
+        if (dr->d_name[0] == '.')
+            continue;
+
+        if (uevent_has_partname(dirfd(d), dr->d_name, name)) {
+            snprintf(path, sizeof(path), "/sys/class/block/%s", dr->d_name);
+            trigger_with_parents(cb, path, done);
+            break;
+        }
+    }
+    closedir(d);
+}
+
+/*
+ * Creates only the nodes needed to start MultiROM: framebuffer, input
+ * devices and the /data, /cache and /boot block devices.
+ */
+static uint32_t coldboot_priority(struct fstab *fstab, struct coldboot_done *res)
+{
+    struct coldboot cb;
+    struct stat st;
+    struct fstab_part *part;
+    struct dirent *dr;
+    char path[PATH_MAX];
+    char **done = NULL;
+    DIR *d;
+    int i;
+
+    memset(&cb, 0, sizeof(cb));
+
+    trigger_with_parents(&cb, "/sys/class/graphics/fb0", &done);
+
+    d = opendir("/sys/class/input");
+    if (d) {
+        while ((dr = readdir(d))) {
+            if (dr->d_name[0] == '.')
+                continue;
+            snprintf(path, sizeof(path), "/sys/class/input/%s", dr->d_name);
+            trigger_with_parents(&cb, path, &done);
+        }
+        closedir(d);
+    }
+
+    for (i = 0; fstab && priority_mounts[i]; ++i) {
+        part = fstab_find_by_path(fstab, priority_mounts[i]);
+        if (part)
+            trigger_block_device(&cb, part->device, &done);
+    }
+
+    res->cnt = 0;
+    res->ino = malloc(list_item_count(done)*sizeof(ino_t) + 1);
+    for (i = 0; done && done[i]; ++i)
+        if (stat(done[i], &st) == 0)
+            res->ino[res->cnt++] = st.st_ino;
+    qsort(res->ino, res->cnt, sizeof(ino_t), ino_cmp);
+
+    list_clear(&done, free);
+    return cb.triggered;
+}
+
+// walks /sys again for as long as uevents keep getting lost
+static void coldboot_replay_lost(void)
+{
+    struct timespec start, end;
+    uint32_t triggered;
+
+    pthread_mutex_lock(&coldboot_mutex);
+    while (coldboot_replay && !coldboot_closing && coldboot_replays < COLDBOOT_REPLAY_MAX) {
+        coldboot_replay = 0;
+        ++coldboot_replays;
+        pthread_mutex_unlock(&coldboot_mutex);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        triggered = coldboot(mr_init_devices, NULL);
+        triggered += coldboot(coldboot_extra, NULL);
+        uevent_thread_sync();
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        ERROR("coldboot: replay of lost uevents triggered %u uevents, done in %u ms",
+                triggered, timespec_diff(&start, &end));
+
+        pthread_mutex_lock(&coldboot_mutex);
+    }
+    coldboot_active = 0;
+    pthread_mutex_unlock(&coldboot_mutex);
+}
+
+static void *coldboot_replay_work(void *data)
+{
+    coldboot_replay_lost();
+    return NULL;
+}
+
+// called by the uevent thread, starts a replay unless a walk will do it anyway
+static void coldboot_queue_replay(void)
+{
+    pthread_mutex_lock(&coldboot_mutex);
+    coldboot_replay = 1;
+    if (!coldboot_active && !coldboot_closing && coldboot_replays < COLDBOOT_REPLAY_MAX) {
+        // the previous walk has cleared coldboot_active, it is only returning
+        if (coldboot_thread_running)
+            pthread_join(coldboot_thread, NULL);
+        coldboot_thread_running = (pthread_create(&coldboot_thread, NULL, coldboot_replay_work, NULL) == 0);
+        coldboot_active = coldboot_thread_running;
+    }
+    pthread_mutex_unlock(&coldboot_mutex);
+}
+
+static void *coldboot_background(void *data)
+{
+    struct coldboot_done *done = data;
+    struct timespec start, end;
+    uint32_t triggered;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    triggered = coldboot(mr_init_devices, done);
+    triggered += coldboot(coldboot_extra, done);
+    uevent_thread_sync();
+
+    free(done->ino);
+    free(done);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ERROR("coldboot: background walk triggered %u uevents, done in %u ms",
+            triggered, timespec_diff(&start, &end));
+
+    // MultiROM keeps waiting until the lost ones are back too
+    coldboot_replay_lost();
+
+    remove(COLDBOOT_PENDING_FILE);
+    return NULL;
+}
+#endif
+
+void devices_init(struct fstab *fstab)
+{
+    struct timespec start, end;
+    uint32_t triggered;
+
+    /* is 1M enough? udev uses 16MB! Events are consumed in parallel with
+     * the coldboot walk, so there has to be room for a burst */
+    device_fd = uevent_open_socket(1024*1024, true);
+    if(device_fd < 0)
+        return;
+
+    fcntl(device_fd, F_SETFD, FD_CLOEXEC);
+    fcntl(device_fd, F_SETFL, O_NONBLOCK);
+
+    wake_fd = eventfd(0, 0);
+    if(wake_fd < 0)
+        ERROR("eventfd failed: %s, uevent thread will poll", strerror(errno));
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+#ifdef MR_SERIAL_COLDBOOT
+    triggered = coldboot(mr_init_devices);
+    triggered += coldboot(coldboot_extra);
+
+    // events are handled right after each write here, losing some is unlikely
+    if (coldboot_replay) {
+        coldboot_replay = 0;
+        ERROR("coldboot: uevents were lost, walking /sys again");
+        triggered += coldboot(mr_init_devices);
+        triggered += coldboot(coldboot_extra);
+    }
+
+    run_event_thread = 1;
+    pthread_create(&uevent_thread, NULL, uevent_thread_work, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ERROR("coldboot: serial walk triggered %u uevents, done in %u ms",
+            triggered, timespec_diff(&start, &end));
+#else
+    // overflows from now on are replayed by the background walk
+    coldboot_active = 1;
 
     run_event_thread = 1;
     pthread_create(&uevent_thread, NULL, uevent_thread_work, NULL);
+
+    struct coldboot_done *done = mzalloc(sizeof(struct coldboot_done));
+    triggered = coldboot_priority(fstab, done);
+    uevent_thread_sync();
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ERROR("coldboot: %u priority uevents done in %u ms", triggered, timespec_diff(&start, &end));
+
+    // everything else, MultiROM waits for it before it scans for partitions
+    write_file(COLDBOOT_PENDING_FILE, "1");
+    pthread_mutex_lock(&coldboot_mutex);
+    coldboot_thread_running = (pthread_create(&coldboot_thread, NULL, coldboot_background, done) == 0);
+    pthread_mutex_unlock(&coldboot_mutex);
+    if(!coldboot_thread_running)
+        coldboot_background(done);
+#endif
 }
 
+static void firmware_close(void);
+#ifdef MR_DEVICES_BENCH
+static void devices_bench(void);
+#endif
+
 void devices_close(void)
 {
+#ifndef MR_SERIAL_COLDBOOT
+    // no new replay can start after this, the uevent thread is still needed by a running one
+    pthread_mutex_lock(&coldboot_mutex);
+    coldboot_closing = 1;
+    pthread_mutex_unlock(&coldboot_mutex);
+
+    if(coldboot_thread_running)
+        pthread_join(coldboot_thread, NULL);
+    coldboot_thread_running = 0;
+#endif
+
     run_event_thread = 0;
+    wake_uevent_thread();
     pthread_join(uevent_thread, NULL);
 
+    firmware_close();
+
+    if(wake_fd >= 0)
+        close(wake_fd);
+    wake_fd = -1;
+
     close(device_fd);
     device_fd = -1;
+
+#ifdef MR_DEVICES_BENCH
+    devices_bench();
+#endif
+
+    ERROR("uevents: %u handled in %u batches (max %u), avg %u us, max %u us per event, %u lost",
+            uevent_stats.events, uevent_stats.batches, uevent_stats.max_batch,
+            uevent_stats.events ? (uint32_t)(uevent_stats.total_us / uevent_stats.events) : 0,
+            uevent_stats.max_us, uevent_stats.overflows);
 }
 
 struct uevent {
@@ -227,10 +828,36 @@ struct platform_node {
     struct listnode list;
 };
 
+// max sys_perms entries applied to one path
+#define MAX_SYS_PERMS_MATCH 32
+
 static list_declare(sys_perms);
 static list_declare(dev_perms);
 static list_declare(platform_names);
 
+/* indexes of the lists above, sys_perms are keyed without "/sys" */
+static struct path_trie sys_perms_index;
+static struct path_trie dev_perms_index;
+static struct path_trie platform_index;
+
+#ifdef MR_DEVICES_BENCH
+#define BENCH_MAX_PATHS 4096
+#define BENCH_ROUNDS 20
+
+/* paths seen during this boot, replayed through both lookups in devices_close */
+static char *bench_sys_paths[BENCH_MAX_PATHS];
+static char *bench_dev_paths[BENCH_MAX_PATHS];
+static int bench_sys_cnt;
+static int bench_dev_cnt;
+
+static void bench_record(char **paths, int *cnt, const char *path)
+{
+    if (*cnt < BENCH_MAX_PATHS)
+        paths[(*cnt)++] = strdup(path);
+}
+
+#endif
+
 int add_dev_perms(const char *name, const char *attr,
                   mode_t perm, unsigned int uid, unsigned int gid,
                   unsigned short prefix) {
@@ -253,10 +880,16 @@ int add_dev_perms(const char *name, const char *attr,
     node->dp.gid = gid;
     node->dp.prefix = prefix;
 
-    if (attr)
+    if (attr) {
         list_add_tail(&sys_perms, &node->plist);
-    else
+        if (strlen(name) >= 4 &&
+            path_trie_add(&sys_perms_index, name + 4, prefix, &node->dp) < 0)
+            return -ENOMEM;
+    } else {
         list_add_tail(&dev_perms, &node->plist);
+        if (path_trie_add(&dev_perms_index, name, prefix, &node->dp) < 0)
+            return -ENOMEM;
+    }
 
     return 0;
 }
@@ -264,33 +897,58 @@ int add_dev_perms(const char *name, const char *attr,
 void fixup_sys_perms(const char *upath)
 {
     char buf[512];
-    struct listnode *node;
+    void *stack_found[MAX_SYS_PERMS_MATCH];
+    void **found = stack_found;
     struct perms_ *dp;
+    int i, cnt;
 
-        /* upaths omit the "/sys" that paths in this list
-         * contain, so we add 4 when comparing...
-         */
-    list_for_each(node, &sys_perms) {
-        dp = &(node_to_item(node, struct perm_node, plist))->dp;
-        if (dp->prefix) {
-            if (strncmp(upath, dp->name + 4, strlen(dp->name + 4)))
-                continue;
-        } else {
-            if (strcmp(upath, dp->name + 4))
-                continue;
-        }
+    /* upaths omit the "/sys" that paths in this list contain, the index
+     * is keyed without it. Matches are applied in the order they were added.
+     */
+    cnt = path_trie_find_all(&sys_perms_index, upath, found, MAX_SYS_PERMS_MATCH);
+    if (cnt > MAX_SYS_PERMS_MATCH) {
+        found = malloc(cnt * sizeof(void*));
+        if (!found)
+            return;
+        path_trie_find_all(&sys_perms_index, upath, found, cnt);
+    }
+
+    for (i = 0; i < cnt; ++i) {
+        dp = found[i];
 
         if ((strlen(upath) + strlen(dp->attr) + 6) > sizeof(buf))
-            return;
+            break;
 
         sprintf(buf,"/sys%s/%s", upath, dp->attr);
         INFO("fixup %s %d %d 0%o\n", buf, dp->uid, dp->gid, dp->perm);
         chown(buf, dp->uid, dp->gid);
         chmod(buf, dp->perm);
     }
+
+    if (found != stack_found)
+        free(found);
 }
 
 static mode_t get_device_perm(const char *path, unsigned *uid, unsigned *gid)
+{
+    /* the latest added match wins, so that ueventd.$hardware can
+     * override ueventd.rc
+     */
+    struct perms_ *dp = path_trie_find_latest(&dev_perms_index, path);
+    if (dp) {
+        *uid = dp->uid;
+        *gid = dp->gid;
+        return dp->perm;
+    }
+
+    /* Default if nothing found. */
+    *uid = 0;
+    *gid = 0;
+    return 0600;
+}
+
+#ifdef MR_DEVICES_BENCH
+static mode_t get_device_perm_linear(const char *path, unsigned *uid, unsigned *gid)
 {
     mode_t perm;
     struct listnode *node;
@@ -320,6 +978,7 @@ static mode_t get_device_perm(const char *path, unsigned *uid, unsigned *gid)
     *gid = 0;
     return 0600;
 }
+#endif
 
 static void make_device(const char *path,
                         const char *upath,
@@ -333,6 +992,10 @@ static void make_device(const char *path,
     char *secontext = NULL;
 #endif
 
+#ifdef MR_DEVICES_BENCH
+    bench_record(bench_dev_paths, &bench_dev_cnt, path);
+#endif
+
     mode = get_device_perm(path, &uid, &gid) | (block ? S_IFBLK : S_IFCHR);
 #ifdef HAVE_SELINUX
     if (sehandle) {
@@ -387,7 +1050,6 @@ static int make_dir(const char *path, mode_t mode)
 static void add_platform_device(const char *path)
 {
     int path_len = strlen(path);
-    struct listnode *node;
     struct platform_node *bus;
     const char *name = path;
 
@@ -397,14 +1059,9 @@ static void add_platform_device(const char *path)
             name += 9;
     }
 
-    list_for_each_reverse(node, &platform_names) {
-        bus = node_to_item(node, struct platform_node, list);
-        if ((bus->path_len < path_len) &&
-                (path[bus->path_len] == '/') &&
-                !strncmp(path, bus->path, bus->path_len))
-            /* subdevice of an existing platform, ignore it */
-            return;
-    }
+    if (path_trie_find_parent(&platform_index, path))
+        /* subdevice of an existing platform, ignore it */
+        return;
 
     INFO("adding platform device %s (%s)\n", name, path);
 
@@ -413,6 +1070,7 @@ static void add_platform_device(const char *path)
     bus->path_len = path_len;
     bus->name = bus->path + (name - path);
     list_add_tail(&platform_names, &bus->list);
+    path_trie_add(&platform_index, bus->path, 1, bus);
 }
 
 /*
@@ -421,6 +1079,12 @@ static void add_platform_device(const char *path)
  * 0.
  */
 static struct platform_node *find_platform_device(const char *path)
+{
+    return path_trie_find_parent(&platform_index, path);
+}
+
+#ifdef MR_DEVICES_BENCH
+static struct platform_node *find_platform_device_linear(const char *path)
 {
     int path_len = strlen(path);
     struct listnode *node;
@@ -436,6 +1100,7 @@ static struct platform_node *find_platform_device(const char *path)
 
     return NULL;
 }
+#endif
 
 static void remove_platform_device(const char *path)
 {
@@ -446,6 +1111,7 @@ static void remove_platform_device(const char *path)
         bus = node_to_item(node, struct platform_node, list);
         if (!strcmp(path, bus->path)) {
             INFO("removing platform device %s\n", bus->name);
+            path_trie_remove(&platform_index, bus->path, 1, bus);
             free(bus->path);
             list_remove(node);
             free(bus);
@@ -804,6 +1470,10 @@ static void handle_generic_device_event(struct uevent *uevent)
 
 static void handle_device_event(struct uevent *uevent)
 {
+#ifdef MR_DEVICES_BENCH
+    bench_record(bench_sys_paths, &bench_sys_cnt, uevent->path);
+#endif
+
     if (!strcmp(uevent->action,"add"))
         fixup_sys_perms(uevent->path);
 
@@ -816,44 +1486,56 @@ static void handle_device_event(struct uevent *uevent)
     }
 }
 
-static int load_firmware(int fw_fd, int loading_fd, int data_fd)
+static int copy_firmware(int fw_fd, int data_fd, off_t size)
 {
-    struct stat st;
-    long len_to_copy;
-    int ret = 0;
+    char buf[PAGE_SIZE];
+    ssize_t nr, nw, off;
 
-    if(fstat(fw_fd, &st) < 0)
+    /* sendfile() into the sysfs data node saves the copy through userspace,
+     * older kernels only support it for sockets, fall back to read/write
+     */
+    while (size > 0) {
+        nw = sendfile(data_fd, fw_fd, NULL, size);
+        if (nw > 0) {
+            size -= nw;
+            continue;
+        }
+        if (nw < 0 && errno == EINTR)
+            continue;
+        if (nw < 0 && (errno == EINVAL || errno == ENOSYS))
+            break;
         return -1;
-    len_to_copy = st.st_size;
-
-    write(loading_fd, "1", 1);  /* start transfer */
-
-    while (len_to_copy > 0) {
-        char buf[PAGE_SIZE];
-        ssize_t nr;
+    }
 
+    while (size > 0) {
         nr = read(fw_fd, buf, sizeof(buf));
-        if(!nr)
-            break;
-        if(nr < 0) {
-            ret = -1;
+        if (!nr)
             break;
+        if (nr < 0)
+            return -1;
+
+        size -= nr;
+        for (off = 0; off < nr; off += nw) {
+            nw = write(data_fd, buf + off, nr - off);
+            if (nw <= 0)
+                return -1;
         }
+    }
+    return 0;
+}
 
-        len_to_copy -= nr;
-        while (nr > 0) {
-            ssize_t nw = 0;
+static int load_firmware(int fw_fd, int loading_fd, int data_fd)
+{
+    struct stat st;
+    int ret;
 
-            nw = write(data_fd, buf + nw, nr);
-            if(nw <= 0) {
-                ret = -1;
-                goto out;
-            }
-            nr -= nw;
-        }
-    }
+    if(fstat(fw_fd, &st) < 0)
+        return -1;
+
+    write(loading_fd, "1", 1);  /* start transfer */
+
+    ret = copy_firmware(fw_fd, data_fd, st.st_size);
 
-out:
     if(!ret)
         write(loading_fd, "0", 1);  /* successful end of transfer */
     else
@@ -867,87 +1549,159 @@ static int is_booting(void)
     return access("/dev/.booting", F_OK) == 0;
 }
 
-static void process_firmware_event(struct uevent *uevent)
+// loader threads, so that one firmware waiting for its file does not
+// block the others
+#define FIRMWARE_THREADS 2
+// mounts do not generate inotify events, check again after this long
+#define FIRMWARE_RECHECK_MS 1000
+
+struct firmware_req {
+    char *path;
+    char *firmware;
+    struct firmware_req *next;
+};
+
+static pthread_mutex_t fw_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fw_cond = PTHREAD_COND_INITIALIZER;
+static struct firmware_req *fw_queue = NULL;
+static struct firmware_req **fw_queue_tail = &fw_queue;
+static pthread_t fw_threads[FIRMWARE_THREADS];
+static int fw_threads_cnt = 0;
+static volatile int fw_quit = 0;
+
+static int open_firmware(const char *firmware)
 {
-    char *root, *loading, *data, *file1 = NULL, *file2 = NULL;
-    int l, loading_fd, data_fd, fw_fd;
-    int booting = is_booting();
+    static const char *dirs[] = { FIRMWARE_DIR1, FIRMWARE_DIR2 };
+    char path[PATH_MAX];
+    size_t i;
+    int fd;
 
-    INFO("firmware: loading '%s' for '%s'\n",
-         uevent->firmware, uevent->path);
+    for (i = 0; i < sizeof(dirs)/sizeof(dirs[0]); ++i) {
+        if (snprintf(path, sizeof(path), "%s/%s", dirs[i], firmware) >= (int)sizeof(path))
+            continue;
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0)
+            return fd;
+    }
+    return -1;
+}
 
-    l = asprintf(&root, SYSFS_PREFIX"%s/", uevent->path);
-    if (l == -1)
-        return;
+/*
+ * If we're not fully booted, we may be missing filesystems needed
+ * for firmware. Sleep until something changes in the firmware dirs
+ * or /dev/.booting goes away instead of retrying every 100 ms.
+ */
+static int wait_for_firmware(const char *firmware)
+{
+    struct pollfd pfd;
+    char buf[512];
+    int fd, booting;
+
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd >= 0) {
+        inotify_add_watch(fd, FIRMWARE_DIR1, IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE);
+        inotify_add_watch(fd, FIRMWARE_DIR2, IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE);
+        inotify_add_watch(fd, "/dev", IN_DELETE);
+    }
 
-    l = asprintf(&loading, "%sloading", root);
-    if (l == -1)
-        goto root_free_out;
+    while (1) {
+        // check after the watches are set up, to not miss anything
+        booting = is_booting();
+        int fw_fd = open_firmware(firmware);
+        if (fw_fd >= 0 || !booting || fw_quit) {
+            if (fd >= 0)
+                close(fd);
+            return fw_fd;
+        }
+
+        if (fd >= 0) {
+            pfd.fd = fd;
+            pfd.events = POLLIN;
+            if (poll(&pfd, 1, FIRMWARE_RECHECK_MS) > 0)
+                while (read(fd, buf, sizeof(buf)) > 0);
+        } else {
+            usleep(100000);
+        }
+    }
+}
 
-    l = asprintf(&data, "%sdata", root);
-    if (l == -1)
-        goto loading_free_out;
+static void process_firmware_event(const char *devpath, const char *firmware)
+{
+    char root[PATH_MAX], loading[PATH_MAX], data[PATH_MAX];
+    int loading_fd, data_fd, fw_fd;
+    uint64_t start = get_mono_us();
 
-    l = asprintf(&file1, FIRMWARE_DIR1"/%s", uevent->firmware);
-    if (l == -1)
-        goto data_free_out;
+    INFO("firmware: loading '%s' for '%s'\n", firmware, devpath);
 
-    l = asprintf(&file2, FIRMWARE_DIR2"/%s", uevent->firmware);
-    if (l == -1)
-        goto data_free_out;
+    if (snprintf(root, sizeof(root), SYSFS_PREFIX"%s/", devpath) >= (int)sizeof(root))
+        return;
+    snprintf(loading, sizeof(loading), "%sloading", root);
+    snprintf(data, sizeof(data), "%sdata", root);
 
-    loading_fd = open(loading, O_WRONLY);
+    loading_fd = open(loading, O_WRONLY | O_CLOEXEC);
     if(loading_fd < 0)
-        goto file_free_out;
+        return;
 
-    data_fd = open(data, O_WRONLY);
+    data_fd = open(data, O_WRONLY | O_CLOEXEC);
     if(data_fd < 0)
         goto loading_close_out;
 
-try_loading_again:
-    fw_fd = open(file1, O_RDONLY);
+    fw_fd = open_firmware(firmware);
+    if(fw_fd < 0 && is_booting())
+        fw_fd = wait_for_firmware(firmware);
+
     if(fw_fd < 0) {
-        fw_fd = open(file2, O_RDONLY);
-        if (fw_fd < 0) {
-            if (booting) {
-                    /* If we're not fully booted, we may be missing
-                     * filesystems needed for firmware, wait and retry.
-                     */
-                usleep(100000);
-                booting = is_booting();
-                goto try_loading_again;
-            }
-            INFO("firmware: could not open '%s' %d\n", uevent->firmware, errno);
-            write(loading_fd, "-1", 2);
-            goto data_close_out;
-        }
+        INFO("firmware: could not open '%s' %d\n", firmware, errno);
+        write(loading_fd, "-1", 2);
+        goto data_close_out;
     }
 
     if(!load_firmware(fw_fd, loading_fd, data_fd))
-        INFO("firmware: copy success { '%s', '%s' }\n", root, uevent->firmware);
+        INFO("firmware: copy success { '%s', '%s' } in %u us\n", root, firmware,
+                (uint32_t)(get_mono_us() - start));
     else
-        INFO("firmware: copy failure { '%s', '%s' }\n", root, uevent->firmware);
+        INFO("firmware: copy failure { '%s', '%s' }\n", root, firmware);
 
     close(fw_fd);
 data_close_out:
     close(data_fd);
 loading_close_out:
     close(loading_fd);
-file_free_out:
-    free(file1);
-    free(file2);
-data_free_out:
-    free(data);
-loading_free_out:
-    free(loading);
-root_free_out:
-    free(root);
+}
+
+static void *firmware_thread_work(void *cookie)
+{
+    struct firmware_req *req;
+
+    pthread_mutex_lock(&fw_mutex);
+    while (1) {
+        while (!fw_queue && !fw_quit)
+            pthread_cond_wait(&fw_cond, &fw_mutex);
+
+        // finish what was queued before quitting, the kernel waits for it
+        if (!fw_queue)
+            break;
+
+        req = fw_queue;
+        fw_queue = req->next;
+        if (!fw_queue)
+            fw_queue_tail = &fw_queue;
+        pthread_mutex_unlock(&fw_mutex);
+
+        process_firmware_event(req->path, req->firmware);
+        free(req->path);
+        free(req->firmware);
+        free(req);
+
+        pthread_mutex_lock(&fw_mutex);
+    }
+    pthread_mutex_unlock(&fw_mutex);
+    return NULL;
 }
 
 static void handle_firmware_event(struct uevent *uevent)
 {
-    pid_t pid;
-    int ret;
+    struct firmware_req *req;
 
     if(strcmp(uevent->subsystem, "firmware"))
         return;
@@ -955,16 +1709,172 @@ static void handle_firmware_event(struct uevent *uevent)
     if(strcmp(uevent->action, "add"))
         return;
 
-    /* we fork, to avoid making large memory allocations in init proper */
-    pid = fork();
-    if (!pid) {
-        process_firmware_event(uevent);
-        exit(EXIT_SUCCESS);
+    req = malloc(sizeof(struct firmware_req));
+    if (!req) {
+        process_firmware_event(uevent->path, uevent->firmware);
+        return;
     }
+    req->path = strdup(uevent->path);
+    req->firmware = strdup(uevent->firmware);
+    req->next = NULL;
+    // the kernel waits for an answer, so load it here if the copy failed
+    if (!req->path || !req->firmware) {
+        free(req->path);
+        free(req->firmware);
+        free(req);
+        process_firmware_event(uevent->path, uevent->firmware);
+        return;
+    }
+
+    pthread_mutex_lock(&fw_mutex);
+    *fw_queue_tail = req;
+    fw_queue_tail = &req->next;
+
+    // threads are started with the first request, most boots have none
+    if (fw_threads_cnt < FIRMWARE_THREADS && !fw_quit &&
+            pthread_create(&fw_threads[fw_threads_cnt], NULL, firmware_thread_work, NULL) == 0)
+        ++fw_threads_cnt;
+    pthread_cond_signal(&fw_cond);
+
+    // no thread could be started, load it here
+    if (fw_threads_cnt == 0) {
+        fw_queue = NULL;
+        fw_queue_tail = &fw_queue;
+        pthread_mutex_unlock(&fw_mutex);
+        process_firmware_event(req->path, req->firmware);
+        free(req->path);
+        free(req->firmware);
+        free(req);
+        return;
+    }
+    pthread_mutex_unlock(&fw_mutex);
 }
 
-#define UEVENT_MSG_LEN  1024
-void handle_device_fd(void)
+static void firmware_close(void)
+{
+    int i;
+
+    pthread_mutex_lock(&fw_mutex);
+    fw_quit = 1;
+    pthread_cond_broadcast(&fw_cond);
+    pthread_mutex_unlock(&fw_mutex);
+
+    for (i = 0; i < fw_threads_cnt; ++i)
+        pthread_join(fw_threads[i], NULL);
+    fw_threads_cnt = 0;
+}
+
+#ifdef MR_DEVICES_BENCH
+static int count_sys_perms_linear(const char *upath)
+{
+    struct listnode *node;
+    struct perms_ *dp;
+    int cnt = 0;
+
+    list_for_each(node, &sys_perms) {
+        dp = &(node_to_item(node, struct perm_node, plist))->dp;
+        if (dp->prefix) {
+            if (strncmp(upath, dp->name + 4, strlen(dp->name + 4)))
+                continue;
+        } else {
+            if (strcmp(upath, dp->name + 4))
+                continue;
+        }
+        ++cnt;
+    }
+    return cnt;
+}
+
+static void devices_bench(void)
+{
+    void *found[MAX_SYS_PERMS_MATCH];
+    uint64_t start, linear_us, trie_us;
+    unsigned uid, gid;
+    unsigned mismatch = 0;
+    mode_t a, b;
+    int r, i;
+
+    start = get_mono_us();
+    for (r = 0; r < BENCH_ROUNDS; ++r) {
+        for (i = 0; i < bench_dev_cnt; ++i)
+            get_device_perm_linear(bench_dev_paths[i], &uid, &gid);
+        for (i = 0; i < bench_sys_cnt; ++i) {
+            count_sys_perms_linear(bench_sys_paths[i]);
+            find_platform_device_linear(bench_sys_paths[i]);
+        }
+    }
+    linear_us = get_mono_us() - start;
+
+    start = get_mono_us();
+    for (r = 0; r < BENCH_ROUNDS; ++r) {
+        for (i = 0; i < bench_dev_cnt; ++i)
+            get_device_perm(bench_dev_paths[i], &uid, &gid);
+        for (i = 0; i < bench_sys_cnt; ++i) {
+            path_trie_find_all(&sys_perms_index, bench_sys_paths[i], found, MAX_SYS_PERMS_MATCH);
+            find_platform_device(bench_sys_paths[i]);
+        }
+    }
+    trie_us = get_mono_us() - start;
+
+    for (i = 0; i < bench_dev_cnt; ++i) {
+        unsigned uid2, gid2;
+        a = get_device_perm_linear(bench_dev_paths[i], &uid, &gid);
+        b = get_device_perm(bench_dev_paths[i], &uid2, &gid2);
+        if (a != b || uid != uid2 || gid != gid2)
+            ++mismatch;
+    }
+    for (i = 0; i < bench_sys_cnt; ++i) {
+        if (count_sys_perms_linear(bench_sys_paths[i]) !=
+                path_trie_find_all(&sys_perms_index, bench_sys_paths[i], found, MAX_SYS_PERMS_MATCH))
+            ++mismatch;
+        if (find_platform_device_linear(bench_sys_paths[i]) != find_platform_device(bench_sys_paths[i]))
+            ++mismatch;
+    }
+
+    ERROR("devices bench: %d uevent paths, %d device nodes, %d rounds: linear %llu us, trie %llu us, %u mismatches",
+            bench_sys_cnt, bench_dev_cnt, BENCH_ROUNDS,
+            (unsigned long long)linear_us, (unsigned long long)trie_us, mismatch);
+
+    for (i = 0; i < bench_sys_cnt; ++i)
+        free(bench_sys_paths[i]);
+    for (i = 0; i < bench_dev_cnt; ++i)
+        free(bench_dev_paths[i]);
+    bench_sys_cnt = bench_dev_cnt = 0;
+}
+#endif
+
+static void handle_uevent_msg(char *msg)
+{
+    struct uevent uevent;
+    uint64_t start, us;
+
+    start = get_mono_us();
+
+    parse_event(msg, &uevent);
+    handle_device_event(&uevent);
+    handle_firmware_event(&uevent);
+
+    us = get_mono_us() - start;
+    uevent_stats.events++;
+    uevent_stats.total_us += us;
+    if (us > uevent_stats.max_us)
+        uevent_stats.max_us = us;
+}
+
+// the socket buffer overran, the kernel dropped uevents
+static void uevent_overflow(void)
+{
+    uevent_stats.overflows++;
+    ERROR("uevent socket overflowed, lost uevents will be replayed");
+#ifdef MR_SERIAL_COLDBOOT
+    coldboot_replay = 1;
+#else
+    coldboot_queue_replay();
+#endif
+}
+
+// one message per syscall, also used when recvmmsg isn't available
+static void handle_device_fd_single(void)
 {
     char msg[UEVENT_MSG_LEN+2];
     int n;
@@ -975,14 +1885,128 @@ void handle_device_fd(void)
         msg[n] = '\0';
         msg[n+1] = '\0';
 
-        struct uevent uevent;
-        parse_event(msg, &uevent);
+        uevent_stats.batches++;
+        if (uevent_stats.max_batch == 0)
+            uevent_stats.max_batch = 1;
+        handle_uevent_msg(msg);
+    }
+
+    if (n < 0 && errno == ENOBUFS)
+        uevent_overflow();
+}
+
+#ifdef __NR_recvmmsg
+
+struct uevent_mmsghdr {
+    struct msghdr msg_hdr;
+    unsigned int msg_len;
+};
+
+/*
+ * Same checks as uevent_kernel_multicast_recv() does, only messages
+ * sent by the kernel are accepted.
+ */
+static int is_kernel_uevent(struct msghdr *hdr, struct sockaddr_nl *addr)
+{
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr);
+    struct ucred *cred;
+
+    if (cmsg == NULL || cmsg->cmsg_type != SCM_CREDENTIALS)
+        return 0;
+
+    cred = (struct ucred *)CMSG_DATA(cmsg);
+    if (cred->uid != 0)
+        return 0;
+
+    return addr->nl_groups != 0 && addr->nl_pid == 0;
+}
+
+// set when the kernel (or seccomp) turns recvmmsg down
+static int recvmmsg_unsupported = 0;
+
+void handle_device_fd(void)
+{
+    char msgs[UEVENT_BATCH][UEVENT_MSG_LEN+2];
+    char cred_msgs[UEVENT_BATCH][CMSG_SPACE(sizeof(struct ucred))];
+    struct sockaddr_nl addrs[UEVENT_BATCH];
+    struct iovec iovs[UEVENT_BATCH];
+    struct uevent_mmsghdr hdrs[UEVENT_BATCH];
+    int i, n;
+
+    if (recvmmsg_unsupported) {
+        handle_device_fd_single();
+        return;
+    }
+
+    for (;;) {
+        for (i = 0; i < UEVENT_BATCH; ++i) {
+            iovs[i].iov_base = msgs[i];
+            iovs[i].iov_len = UEVENT_MSG_LEN;
+            memset(&hdrs[i], 0, sizeof(hdrs[i]));
+            hdrs[i].msg_hdr.msg_name = &addrs[i];
+            hdrs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+            hdrs[i].msg_hdr.msg_iov = &iovs[i];
+            hdrs[i].msg_hdr.msg_iovlen = 1;
+            hdrs[i].msg_hdr.msg_control = cred_msgs[i];
+            hdrs[i].msg_hdr.msg_controllen = sizeof(cred_msgs[i]);
+        }
+
+        n = syscall(__NR_recvmmsg, device_fd, hdrs, UEVENT_BATCH, MSG_DONTWAIT, NULL);
+        if (n < 0) {
+            if (errno == ENOBUFS) {
+                /* socket buffer overrun, some uevents were lost */
+                uevent_overflow();
+                continue;
+            }
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+
+            if (errno == ENOSYS || errno == EINVAL) {
+                ERROR("recvmmsg not supported (%s), reading uevents one by one", strerror(errno));
+                recvmmsg_unsupported = 1;
+            } else {
+                ERROR("recvmmsg failed: %s", strerror(errno));
+            }
+            /* the socket must be empty, or the level-triggered poll spins */
+            handle_device_fd_single();
+            break;
+        }
+        if (n == 0)
+            break;
+
+        uevent_stats.batches++;
+        if ((uint32_t)n > uevent_stats.max_batch)
+            uevent_stats.max_batch = n;
+
+        for (i = 0; i < n; ++i) {
+            /* overflow -- discard */
+            if (hdrs[i].msg_len >= UEVENT_MSG_LEN)
+                continue;
+
+            if (!is_kernel_uevent(&hdrs[i].msg_hdr, &addrs[i]))
+                continue;
 
-        handle_device_event(&uevent);
-        handle_firmware_event(&uevent);
+            msgs[i][hdrs[i].msg_len] = '\0';
+            msgs[i][hdrs[i].msg_len+1] = '\0';
+            handle_uevent_msg(msgs[i]);
+        }
+
+        if (n < UEVENT_BATCH)
+            break;
     }
 }
 
+#else
+
+void handle_device_fd(void)
+{
+    handle_device_fd_single();
+}
+
+#endif
+
 int get_device_fd()
 {
     return device_fd;
@@ -1,7 +1,12 @@
 #ifndef DEVICES_H
 #define DEVICES_H
 
-void devices_init(void);
+// exists while the trampoline creates device nodes in background
+#define COLDBOOT_PENDING_FILE "/dev/.mr_coldboot_pending"
+
+struct fstab;
+
+void devices_init(struct fstab *fstab);
 
 #include <sys/stat.h>
 
@@ -0,0 +1,177 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "path_trie.h"
+
+static struct path_trie_node *find_child(struct path_trie_node *n, char c)
+{
+    for (n = n->child; n; n = n->next)
+        if (n->c == c)
+            return n;
+    return NULL;
+}
+
+static struct path_trie_node *get_node(struct path_trie *t, const char *path, int create)
+{
+    struct path_trie_node *n = &t->root;
+    struct path_trie_node *child;
+
+    for (; *path; ++path) {
+        child = find_child(n, *path);
+        if (!child) {
+            if (!create)
+                return NULL;
+            child = calloc(1, sizeof(struct path_trie_node));
+            if (!child)
+                return NULL;
+            child->c = *path;
+            child->next = n->child;
+            n->child = child;
+        }
+        n = child;
+    }
+    return n;
+}
+
+int path_trie_add(struct path_trie *t, const char *path, int prefix, void *data)
+{
+    struct path_trie_node *n = get_node(t, path, 1);
+    struct path_trie_item *item;
+
+    if (!n)
+        return -1;
+
+    item = malloc(sizeof(struct path_trie_item));
+    if (!item)
+        return -1;
+
+    item->seq = ++t->seq;
+    item->data = data;
+    if (prefix) {
+        item->next = n->prefix;
+        n->prefix = item;
+    } else {
+        item->next = n->exact;
+        n->exact = item;
+    }
+    return 0;
+}
+
+void path_trie_remove(struct path_trie *t, const char *path, int prefix, void *data)
+{
+    struct path_trie_node *n = get_node(t, path, 0);
+    struct path_trie_item **itr, *item;
+
+    if (!n)
+        return;
+
+    for (itr = prefix ? &n->prefix : &n->exact; *itr; itr = &(*itr)->next) {
+        if ((*itr)->data == data) {
+            item = *itr;
+            *itr = item->next;
+            free(item);
+            return;
+        }
+    }
+}
+
+static struct path_trie_item *later(struct path_trie_item *a, struct path_trie_item *b)
+{
+    if (!a)
+        return b;
+    if (!b)
+        return a;
+    return a->seq > b->seq ? a : b;
+}
+
+void *path_trie_find_latest(struct path_trie *t, const char *path)
+{
+    struct path_trie_node *n = &t->root;
+    struct path_trie_item *best = n->prefix;
+
+    for (; *path; ++path) {
+        n = find_child(n, *path);
+        if (!n)
+            return best ? best->data : NULL;
+        best = later(best, n->prefix);
+    }
+
+    best = later(best, n->exact);
+    return best ? best->data : NULL;
+}
+
+void *path_trie_find_parent(struct path_trie *t, const char *path)
+{
+    struct path_trie_node *n = &t->root;
+    struct path_trie_item *best = NULL;
+
+    for (; *path; ++path) {
+        if (*path == '/')
+            best = later(best, n->prefix);
+
+        n = find_child(n, *path);
+        if (!n)
+            break;
+    }
+    return best ? best->data : NULL;
+}
+
+// keeps the `max` earliest added items, `total` counts all of them
+static void insert_sorted(struct path_trie_item **found, int *cnt, int *total, int max, struct path_trie_item *item)
+{
+    int i;
+    for (; item; item = item->next) {
+        ++(*total);
+        if (*cnt == max) {
+            if (max == 0 || found[max-1]->seq < item->seq)
+                continue;
+            --(*cnt);
+        }
+        for (i = *cnt; i > 0 && found[i-1]->seq > item->seq; --i)
+            found[i] = found[i-1];
+        found[i] = item;
+        ++(*cnt);
+    }
+}
+
+int path_trie_find_all(struct path_trie *t, const char *path, void **res, int max)
+{
+    struct path_trie_item *found[max > 0 ? max : 1];
+    struct path_trie_node *n = &t->root;
+    int i, cnt = 0, total = 0;
+
+    if (max < 0)
+        max = 0;
+
+    insert_sorted(found, &cnt, &total, max, n->prefix);
+    for (; *path; ++path) {
+        n = find_child(n, *path);
+        if (!n)
+            break;
+        insert_sorted(found, &cnt, &total, max, n->prefix);
+    }
+
+    if (n)
+        insert_sorted(found, &cnt, &total, max, n->exact);
+
+    for (i = 0; i < cnt; ++i)
+        res[i] = found[i]->data;
+    return total;
+}
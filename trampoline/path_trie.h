@@ -0,0 +1,68 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PATH_TRIE_H
+#define PATH_TRIE_H
+
+/*
+ * Character trie of paths, used by devices.c to find permissions and
+ * platform devices in O(path length). Items are added with a sequence
+ * number, so that lookups can return the latest added match just like
+ * the reverse list walks they replace.
+ */
+
+struct path_trie_item {
+    struct path_trie_item *next;
+    unsigned int seq;
+    void *data;
+};
+
+struct path_trie_node {
+    struct path_trie_node *child;
+    struct path_trie_node *next;
+    char c;
+    struct path_trie_item *exact;   // latest added first
+    struct path_trie_item *prefix;  // latest added first
+};
+
+struct path_trie {
+    struct path_trie_node root;
+    unsigned int seq;
+};
+
+// `prefix`: item matches all paths starting with `path`
+int path_trie_add(struct path_trie *t, const char *path, int prefix, void *data);
+void path_trie_remove(struct path_trie *t, const char *path, int prefix, void *data);
+
+// latest added item which is an exact match or prefix of `path`
+void *path_trie_find_latest(struct path_trie *t, const char *path);
+
+/*
+ * Latest added prefix item, matching only at a '/' boundary of `path` and
+ * shorter than `path` (".../a" matches ".../a/b", not ".../ab" or ".../a")
+ */
+void *path_trie_find_parent(struct path_trie *t, const char *path);
+
+/*
+ * All items which are an exact match or prefix of `path`, in the order
+ * they were added. Returns the number of matches, only the first `max`
+ * of them are stored into `res`, call it again with a bigger one if
+ * that isn't enough.
+ */
+int path_trie_find_all(struct path_trie *t, const char *path, void **res, int max);
+
+#endif
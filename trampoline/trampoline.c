@@ -33,6 +33,8 @@
 #include "adb.h"
 #include "../fstab.h"
 #include "../hooks.h"
+#include "../trace.h"
+#include "../cpio.h"
 
 #define EXEC_MASK (S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH)
 #define REALDATA "/realdata"
@@ -73,6 +75,8 @@ static void clean_mnt_mounts(void)
 static int run_multirom_bin(char *path)
 {
     ERROR("Running multirom");
+    // multirom appends its own events to the trace file
+    trace_flush();
     int status = run_cmd((char *const[]){ path, NULL });
     ERROR("MultiROM exited with status %d", status);
     return status;
@@ -220,6 +224,8 @@ int main(int argc, char *argv[])
     mount("tmpfs", "/mnt", "tmpfs", 0, "");
 
     klog_init();
+    trace_init("trampoline");
+    trace_begin("trampoline");
     ERROR("Running trampoline v%d\n", VERSION_TRAMPOLINE);
 
     if(is_charger_mode())
@@ -228,12 +234,21 @@ int main(int argc, char *argv[])
     }
     else
     {
+        // fstab says which block devices are needed first
+        trace_begin("fstab_auto_load");
+        fstab = fstab_auto_load();
+        trace_end("fstab_auto_load");
+
         ERROR("Initializing devices...");
-        devices_init();
+        trace_begin("devices_init");
+        devices_init(fstab);
+        trace_end("devices_init");
         ERROR("Done initializing");
 
-        fstab = fstab_auto_load();
-        if(should_enter_recovery(fstab))
+        trace_begin("should_enter_recovery");
+        int recovery = should_enter_recovery(fstab);
+        trace_end("should_enter_recovery");
+        if(recovery)
         {
             ERROR("Entering recovery, replacing boot.cpio with recovery.cpio...");
             remove("/multirom/boot.cpio");
@@ -244,10 +259,15 @@ int main(int argc, char *argv[])
 #if 0
             fstab_dump(fstab); //debug
 #endif
-            if(wait_for_file("/dev/graphics/fb0", 5) >= 0)
+            trace_begin("wait_for_fb0");
+            int fb_ready = wait_for_file("/dev/graphics/fb0", 5) >= 0;
+            trace_end("wait_for_fb0");
+            if(fb_ready)
             {
                 adb_init(path_multirom);
+                trace_begin("run_multirom");
                 run_multirom();
+                trace_end("run_multirom");
                 adb_quit();
             }
             else
@@ -264,9 +284,12 @@ int main(int argc, char *argv[])
             fstab_destroy(fstab);
 
         // close and destroy everything
+        trace_begin("devices_close");
         devices_close();
+        trace_end("devices_close");
     }
 
+    trace_begin("cleanup");
     clean_mnt_mounts();
     remove("/mnt");
 
@@ -287,20 +310,31 @@ int main(int argc, char *argv[])
     remove("/multirom/adbd");
     remove("/multirom/kexec");
 
+    trace_end("cleanup");
+
     ERROR("extracting boot.cpio...");
-    int status = shell_cmd("cd /; /multirom/busybox cpio -i < /multirom/boot.cpio");
-    if(status != 0)
+    trace_begin("extract_boot_cpio");
+    if(cpio_extract("/multirom/boot.cpio", "/") < 0)
     {
-        ERROR("Cannot extract boot.cpio! Status %d", status);
+        ERROR("Failed to extract boot.cpio, trying busybox cpio");
+        int status = shell_cmd("cd /; /multirom/busybox cpio -i < /multirom/boot.cpio");
+        if(status != 0)
+        {
+            ERROR("Cannot extract boot.cpio! Status %d", status);
+        }
     }
 
     remove("/multirom/boot.cpio");
+    trace_end("extract_boot_cpio");
 
     static char *const cmd[] = { "/init", NULL };
     chmod(cmd[0], EXEC_MASK);
     chdir("/");
 
     ERROR("Running main init\n");
+    trace_end("trampoline");
+    trace_instant("exec_init");
+    trace_flush();
     // run the main init
     res = execve(cmd[0], cmd, NULL);
     ERROR("execve returned %d %d %s\n", res, errno, strerror(errno));
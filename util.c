@@ -468,6 +468,22 @@ uint32_t timespec_diff(struct timespec *f, struct timespec *s)
     return res;
 }
 
+int64_t get_mono_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((int64_t)ts.tv_sec)*1000000 + ts.tv_nsec/1000;
+}
+
+void cond_deadline(struct timespec *ts, uint32_t ms)
+{
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000)*1000000L;
+    ts->tv_sec += ts->tv_nsec / 1000000000L;
+    ts->tv_nsec %= 1000000000L;
+}
+
 char *readlink_recursive(const char *link)
 {
     struct stat info;
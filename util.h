@@ -21,6 +21,7 @@
 #include <sys/types.h>
 #include <sys/time.h>
 #include <time.h>
+#include <stdint.h>
 
 #define ARRAY_SIZE(x) (sizeof(x)/sizeof(x[0]))
 
@@ -45,6 +46,10 @@ char *readlink_recursive(const char *link);
 void stdio_to_null();
 char *parse_string(char *src);
 uint32_t timespec_diff(struct timespec *f, struct timespec *s);
+// CLOCK_MONOTONIC in microseconds
+int64_t get_mono_us(void);
+// absolute time ms from now for pthread_cond_timedwait(), which uses CLOCK_REALTIME
+void cond_deadline(struct timespec *ts, uint32_t ms);
 
 inline int imin(int a, int b);
 inline int imax(int a, int b);
@@ -18,6 +18,8 @@
 #include <pthread.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
 
 #include "util.h"
 #include "workers.h"
@@ -27,56 +29,160 @@ struct worker
 {
     void *data;
     worker_call call;
+    int64_t due;        // CLOCK_MONOTONIC ms
+    int64_t last;       // previous call, for ms_diff
+    int heap_idx;       // -1 when not scheduled
+    int idle;
+    int removed;        // removed by its own call
 };
 
+// Workers are kept in a min-heap by their next deadline, the thread sleeps
+// until the first one or until the schedule changes.
 struct worker_thread
 {
     pthread_t thread;
     pthread_mutex_t mutex;
+    pthread_cond_t cond;
     struct worker **workers;
+    struct worker **heap;
+    int heap_cnt;
+    int heap_alloc;
+    struct worker *running;
     volatile int run;
 };
 
 static struct worker_thread worker_thread = {
     .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
     .workers = NULL,
+    .heap = NULL,
     .run = 0,
 };
 
-#define SLEEP_CONST 16
+static void heap_swap(struct worker_thread *t, int a, int b)
+{
+    struct worker *w = t->heap[a];
+    t->heap[a] = t->heap[b];
+    t->heap[b] = w;
+    t->heap[a]->heap_idx = a;
+    t->heap[b]->heap_idx = b;
+}
+
+static void heap_up(struct worker_thread *t, int i)
+{
+    while(i > 0 && t->heap[(i-1)/2]->due > t->heap[i]->due)
+    {
+        heap_swap(t, i, (i-1)/2);
+        i = (i-1)/2;
+    }
+}
+
+static void heap_down(struct worker_thread *t, int i)
+{
+    int min, c;
+    while(1)
+    {
+        min = i;
+        for(c = i*2+1; c <= i*2+2 && c < t->heap_cnt; ++c)
+            if(t->heap[c]->due < t->heap[min]->due)
+                min = c;
+        if(min == i)
+            break;
+        heap_swap(t, i, min);
+        i = min;
+    }
+}
+
+// expects locked mutex
+static void heap_schedule(struct worker_thread *t, struct worker *w, int64_t due)
+{
+    if(w->heap_idx >= 0)
+    {
+        if(due >= w->due)
+            return;
+        w->due = due;
+        heap_up(t, w->heap_idx);
+        return;
+    }
+
+    if(t->heap_cnt == t->heap_alloc)
+    {
+        t->heap_alloc = imax(8, t->heap_alloc*2);
+        t->heap = realloc(t->heap, t->heap_alloc*sizeof(struct worker*));
+    }
+
+    w->due = due;
+    w->heap_idx = t->heap_cnt++;
+    t->heap[w->heap_idx] = w;
+    heap_up(t, w->heap_idx);
+}
+
+// expects locked mutex
+static void heap_remove(struct worker_thread *t, struct worker *w)
+{
+    int i = w->heap_idx;
+    if(i < 0)
+        return;
+
+    w->heap_idx = -1;
+    if(i != --t->heap_cnt)
+    {
+        t->heap[i] = t->heap[t->heap_cnt];
+        t->heap[i]->heap_idx = i;
+        heap_down(t, i);
+        heap_up(t, i);
+    }
+}
+
 static void *worker_thread_work(void *data)
 {
     struct worker_thread *t = (struct worker_thread*)data;
-    struct worker **w;
-
-    struct timespec last, curr;
-    uint32_t diff = 0, prev_sleep = 0;
-    clock_gettime(CLOCK_MONOTONIC, &last);
+    struct worker *w;
+    struct timespec deadline;
+    int64_t now, wait_ms;
+    uint32_t next, diff;
 
+    pthread_mutex_lock(&t->mutex);
     while(t->run)
     {
-        pthread_mutex_lock(&t->mutex);
-
-        clock_gettime(CLOCK_MONOTONIC, &curr);
-        diff = timespec_diff(&last, &curr);
+        if(t->heap_cnt == 0)
+        {
+            pthread_cond_wait(&t->cond, &t->mutex);
+            continue;
+        }
 
-        if(t->workers)
+        now = get_mono_us()/1000;
+        w = t->heap[0];
+        if(w->due > now)
         {
-            for(w = t->workers; *w; ++w)
-                (*w)->call(diff, (*w)->data);
+            wait_ms = w->due - now;
+
+            cond_deadline(&deadline, wait_ms);
+            pthread_cond_timedwait(&t->cond, &t->mutex, &deadline);
+            continue;
         }
 
+        heap_remove(t, w);
+        diff = now - w->last;
+        w->last = now;
+        w->idle = 0;
+        t->running = w;
         pthread_mutex_unlock(&t->mutex);
 
-        last = curr;
-        if(diff <= SLEEP_CONST+prev_sleep)
-        {
-            prev_sleep = SLEEP_CONST+prev_sleep-diff;
-            usleep(prev_sleep*1000);
-        }
+        next = w->call(diff, w->data);
+
+        pthread_mutex_lock(&t->mutex);
+        t->running = NULL;
+        pthread_cond_broadcast(&t->cond);
+
+        if(w->removed)
+            free(w);
+        else if(next == WORKER_IDLE)
+            w->idle = (w->heap_idx < 0); // unless woken meanwhile
         else
-            prev_sleep = 0;
+            heap_schedule(t, w, now + next);
     }
+    pthread_mutex_unlock(&t->mutex);
     return NULL;
 }
 
@@ -94,10 +200,16 @@ void workers_stop(void)
     if(worker_thread.run != 1)
         return;
 
+    pthread_mutex_lock(&worker_thread.mutex);
     worker_thread.run = 0;
+    pthread_cond_broadcast(&worker_thread.cond);
+    pthread_mutex_unlock(&worker_thread.mutex);
     pthread_join(worker_thread.thread, NULL);
 
     list_clear(&worker_thread.workers, &free);
+    free(worker_thread.heap);
+    worker_thread.heap = NULL;
+    worker_thread.heap_cnt = worker_thread.heap_alloc = 0;
 }
 
 void workers_add(worker_call call, void *data)
@@ -111,14 +223,37 @@ void workers_add(worker_call call, void *data)
     struct worker *w = mzalloc(sizeof(struct worker));
     w->call = call;
     w->data = data;
+    w->heap_idx = -1;
 
     pthread_mutex_lock(&worker_thread.mutex);
     list_add(w, &worker_thread.workers);
+    w->last = get_mono_us()/1000;
+    heap_schedule(&worker_thread, w, w->last);
+    pthread_cond_signal(&worker_thread.cond);
     pthread_mutex_unlock(&worker_thread.mutex);
 }
 
+// expects locked mutex
+static struct worker *workers_find(worker_call call, void *data, int *idx)
+{
+    int i;
+    for(i = 0; worker_thread.workers && worker_thread.workers[i]; ++i)
+    {
+        if(worker_thread.workers[i]->call == call && worker_thread.workers[i]->data == data)
+        {
+            if(idx)
+                *idx = i;
+            return worker_thread.workers[i];
+        }
+    }
+    return NULL;
+}
+
 void workers_remove(worker_call call, void *data)
 {
+    struct worker *w;
+    int i;
+
     if(worker_thread.run != 1)
     {
         ERROR("workers: removing worker when the thread isn't running'\n");
@@ -126,19 +261,44 @@ void workers_remove(worker_call call, void *data)
     }
 
     pthread_mutex_lock(&worker_thread.mutex);
-    if(worker_thread.workers)
+    w = workers_find(call, data, &i);
+    if(w)
     {
-        int i;
-        struct worker *w;
-        for(i = 0; worker_thread.workers[i]; ++i)
+        list_rm_at(i, &worker_thread.workers, NULL);
+        heap_remove(&worker_thread, w);
+
+        if(worker_thread.running == w && pthread_equal(pthread_self(), worker_thread.thread))
+            w->removed = 1; // freed once its call returns
+        else
         {
-            w = worker_thread.workers[i];
-            if(w->call == call && w->data == data)
-            {
-                list_rm_at(i, &worker_thread.workers, &free);
-                break;
-            }
+            // data might be freed right after this returns
+            while(worker_thread.running == w)
+                pthread_cond_wait(&worker_thread.cond, &worker_thread.mutex);
+            free(w);
         }
     }
     pthread_mutex_unlock(&worker_thread.mutex);
 }
+
+void workers_wake(worker_call call, void *data)
+{
+    struct worker *w;
+    int64_t now;
+
+    if(worker_thread.run != 1)
+        return;
+
+    pthread_mutex_lock(&worker_thread.mutex);
+    w = workers_find(call, data, NULL);
+    if(w)
+    {
+        now = get_mono_us()/1000;
+        // ms_diff counts from the wake up, not from the last call
+        if(w->idle)
+            w->last = now;
+        w->idle = 0;
+        heap_schedule(&worker_thread, w, now);
+        pthread_cond_signal(&worker_thread.cond);
+    }
+    pthread_mutex_unlock(&worker_thread.mutex);
+}
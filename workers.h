@@ -20,11 +20,19 @@
 
 #include <stdint.h>
 
-typedef void (*worker_call)(uint32_t, void *); // ms_diff, data
+// worker_call return values: ms until the next call, or WORKER_IDLE to
+// not be called again until workers_wake()
+#define WORKER_IDLE UINT32_MAX
+#define WORKER_FRAME_MS 16
+
+typedef uint32_t (*worker_call)(uint32_t, void *); // ms_diff, data
 
 void workers_start(void);
 void workers_stop(void);
+// the first call happens right away
 void workers_add(worker_call call, void *data);
+// waits for the call to return if it is running in the workers thread
 void workers_remove(worker_call call, void *data);
+void workers_wake(worker_call call, void *data);
 
 #endif